@@ -0,0 +1,410 @@
+/* Ahead of time recompiler for Synacor Challenge images, to C++. */
+
+
+/* Usage: vm-aot [-s] IMGFILE [OUTFILE]
+*
+* Finds the code in IMGFILE by following it from where it starts, and
+* from every address a jmp, jt, jf or call names, and writes it out as a
+* C++ program with a function per basic block, which aot.h runs. Built
+* with make, as IMGFILE's name with -native for .bin, it runs the program
+* natively and prints exactly what vm would.
+*
+* A jump or call to a literal address goes straight to the block there.
+* Jumps and calls through a register, and ret, go through a table of
+* where every block starts. Any code the program writes over, or that
+* wasn't found, is run by an interpreter in aot.h instead. Native hooks
+* aren't used; it's the guest's own routines that are compiled.
+*
+* Options: -s IMGFILE is a snapshot dumped from the debugger. The program
+*             picks up where it left off, with any input that was waiting.
+*          OUTFILE Write the program to OUTFILE instead of standard output.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iomanip>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#include "image.h"
+#include "snapshot.h"
+#include "profile.h"
+
+namespace {
+
+// What's to be compiled: the memory, and where and how to start.
+struct program {
+	std::vector<paged_memory::word> words;
+	numtype pc{0};
+	std::vector<numtype> regs, stack;
+	std::string input;
+	// What vm would say on loading it.
+	std::string banner;
+};
+
+struct block {
+	numtype first, last;
+	std::vector<numtype> ins;
+};
+
+constexpr bool is_jump(numtype op) {
+	return op >= 6 && op <= 8;
+}
+
+// Ends a block: halt, jmp, jt, jf, call and ret.
+constexpr bool ends_block(numtype op) {
+	return op == 0 || is_jump(op) || op == 17 || op == 18;
+}
+
+// Where a jump or call goes to, which is the first operand for jmp and
+// call and the second for jt and jf.
+constexpr int target_operand(numtype op) {
+	return op == 6 || op == 17 ? 1 : 2;
+}
+
+class recompiler {
+public:
+	explicit recompiler(const program &p)
+		: prog(p), words(p.words), leader(M, false), found(M, false),
+			block_index(M, none) {
+		// Room for the operands of an instruction at the very end.
+		words.resize(65536 + 4, 0);
+	}
+
+	void find(void) {
+		std::vector<numtype> todo{prog.pc};
+		if (prog.pc < M)
+			leader[prog.pc] = true;
+		// Return addresses on the stack are where rets will go.
+		for (auto addr : prog.stack)
+			if (addr < M) {
+				leader[addr] = true;
+				todo.push_back(addr);
+			}
+		// Anywhere anything that looks like a call or jmp goes, even if the
+		// code it's in isn't reached from the start, and the literals that
+		// look like set and push instructions give, which are where jumps
+		// and calls through a register usually go. Guessing wrong costs a
+		// block that's never run; what any block does is what the words it
+		// was compiled from say, whatever they were meant to be.
+		for (numtype addr = 0; addr < M; addr += 1) {
+			numtype op = words[addr];
+			if ((op == 1 || op == 2 || op == 6 || op == 17) && valid(addr)) {
+				numtype to = words[addr + oplen[op] - 1];
+				if (to < M && valid(to)) {
+					leader[to] = true;
+					todo.push_back(to);
+				}
+			}
+		}
+		while (!todo.empty()) {
+			numtype addr = todo.back();
+			todo.pop_back();
+			while (addr < M && !found[addr] && valid(addr)) {
+				found[addr] = true;
+				numtype op = words[addr];
+				numtype next = addr + oplen[op];
+				if (is_jump(op) || op == 17) {
+					numtype to = words[addr + target_operand(op)];
+					if (to < M) {
+						leader[to] = true;
+						todo.push_back(to);
+					}
+				}
+				// After a call is where its ret comes back to.
+				if ((op == 7 || op == 8 || op == 17) && next < M) {
+					leader[next] = true;
+					todo.push_back(next);
+				}
+				if (op == 0 || op == 6 || op == 17 || op == 18)
+					break;
+				addr = next;
+			}
+		}
+
+		for (numtype addr = 0; addr < M; addr += 1) {
+			if (!leader[addr] || !valid(addr))
+				continue;
+			block b{addr, addr, {}};
+			numtype at = addr;
+			do {
+				b.ins.push_back(at);
+				at += oplen[words[at]];
+			} while (!ends_block(words[b.ins.back()]) && at < M && !leader[at] &&
+							 valid(at));
+			b.last = at;
+			block_index[addr] = blocks.size();
+			blocks.push_back(b);
+		}
+	}
+
+	void write(std::ostream &out, const std::string &source) {
+		out << "// Recompiled from " << source << " by vm-aot. See aot.cc.\n\n"
+				<< "#include \"aot.h\"\n\n"
+				<< "namespace {\n\n";
+
+		std::size_t used{prog.words.size()};
+		while (used > 0 && prog.words[used - 1] == 0)
+			used -= 1;
+		out << "const std::uint16_t image[] = {";
+		for (std::size_t i = 0; i < used; i += 1)
+			out << (i % 12 == 0 ? "\n\t" : " ") << prog.words[i] << ',';
+		out << "\n\t0\n};\n\n";
+
+		for (auto &b : blocks)
+			out << "aot_block " << name(b.first) << "(aot_machine &);\n";
+		out << '\n';
+		for (auto &b : blocks)
+			write_block(out, b);
+
+		out << "const aot_entry blocks[] = {\n";
+		for (auto &b : blocks)
+			out << "\t{" << hex(b.first) << ", " << hex(b.last) << ", "
+					<< name(b.first) << "},\n";
+		out << "};\n\n"
+				<< "}\n\n"
+				<< "int main(void) {\n"
+				<< "\tstd::cout << \"" << prog.banner << "\";\n"
+				<< "\taot_machine m{image, " << used << ", blocks, "
+				<< blocks.size() << "};\n";
+		if (prog.pc != 0)
+			out << "\tm.pc = " << hex(prog.pc) << ";\n";
+		for (int i = 0; i < 8; i += 1)
+			if (i < static_cast<int>(prog.regs.size()) && prog.regs[i] != 0)
+				out << "\tm.r[" << i << "] = " << prog.regs[i] << ";\n";
+		if (!prog.stack.empty()) {
+			out << "\tm.stack = {";
+			for (std::size_t i = 0; i < prog.stack.size(); i += 1)
+				out << (i ? ", " : "") << prog.stack[i];
+			out << "};\n";
+		}
+		if (!prog.input.empty()) {
+			out << "\tm.input = std::string{\"";
+			for (char c : prog.input)
+				escape(out, c);
+			out << "\", " << prog.input.size() << "};\n";
+		}
+		out << "\treturn aot_run(m);\n"
+				<< "}\n";
+	}
+
+	std::size_t block_count(void) const { return blocks.size(); }
+	std::size_t instruction_count(void) const {
+		std::size_t n{0};
+		for (auto &b : blocks)
+			n += b.ins.size();
+		return n;
+	}
+
+private:
+	static constexpr std::uint32_t none = ~std::uint32_t{0};
+
+	const program &prog;
+	std::vector<paged_memory::word> words;
+	// Where blocks start, and where instructions that were reached do.
+	std::vector<bool> leader, found;
+	std::vector<std::uint32_t> block_index;
+	std::vector<block> blocks;
+
+	// An instruction the compiled code can run as it is: a known opcode,
+	// no operand past r7, and a register where it writes one.
+	bool valid(numtype addr) const {
+		numtype op = words[addr];
+		if (op >= oplen.size())
+			return false;
+		for (int i = 1; i < oplen[op]; i += 1)
+			if (words[addr + i] >= M + 8)
+				return false;
+		return !writes_register(op) || is_register(words[addr + 1]);
+	}
+
+	static std::string hex(numtype addr) {
+		std::ostringstream s;
+		s << "0x" << std::hex << std::setw(4) << std::setfill('0') << addr;
+		return s.str();
+	}
+	static std::string name(numtype addr) {
+		std::ostringstream s;
+		s << "b_" << std::hex << std::setw(4) << std::setfill('0') << addr;
+		return s.str();
+	}
+	static std::string value(numtype v) {
+		if (is_register(v))
+			return "m.r[" + std::to_string(to_register(v)) + "]";
+		return std::to_string(v) + "u";
+	}
+	static void escape(std::ostream &out, char c) {
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (c == '\n')
+			out << "\\n";
+		else if (c < ' ' || c > '~')
+			out << '\\' << std::oct << std::setw(3) << std::setfill('0')
+					<< (static_cast<unsigned>(c) & 0xFF) << std::dec;
+		else
+			out << c;
+	}
+
+	// Go on to addr: straight to its block if there is one, through the
+	// dispatch table if not.
+	std::string go(numtype addr) const {
+		if (addr < M && block_index[addr] != none)
+			return "return m.go(" + name(addr) + ", " +
+				std::to_string(block_index[addr]) + ", " + hex(addr) + ");";
+		return "m.pc = " + hex(addr) + "; return {nullptr};";
+	}
+
+	void write_block(std::ostream &out, const block &blk) {
+		out << "aot_block " << name(blk.first) << "(aot_machine &m) {\n";
+		for (auto addr : blk.ins) {
+			const paged_memory::word *w = &words[addr];
+			std::string a{value(w[1])}, b{value(w[2])}, c{value(w[3])};
+			numtype next = addr + oplen[w[0]];
+
+			out << "\t// " << hex(addr) << ": ";
+			disassemble(out, w);
+			out << '\n';
+			if (w[0] == 21)
+				continue;
+			out << '\t';
+			switch (w[0]) {
+			case 0: out << "m.pc = " << hex(addr) << "; m.halted = true; return {nullptr};"; break;
+			case 1: out << a << " = " << b << ';'; break;
+			case 2: out << "m.push(" << a << ");"; break;
+			case 3: out << a << " = m.pop();"; break;
+			case 4: out << a << " = " << b << " == " << c << ';'; break;
+			case 5: out << a << " = " << b << " > " << c << ';'; break;
+			case 6:
+				if (is_register(w[1]))
+					out << "m.pc = " << a << "; return {nullptr};";
+				else
+					out << go(w[1]);
+				break;
+			case 7:
+			case 8:
+				out << "if (" << a << (w[0] == 7 ? " != 0" : " == 0") << ") { ";
+				if (is_register(w[2]))
+					out << "m.pc = " << b << "; return {nullptr};";
+				else
+					out << go(w[2]);
+				out << " }\n\t" << go(next);
+				break;
+			case 9: out << a << " = (" << b << " + " << c << ") % M;"; break;
+			case 10: out << a << " = (" << b << " * " << c << ") % M;"; break;
+			case 11: out << a << " = " << b << " % " << c << ';'; break;
+			case 12: out << a << " = " << b << " & " << c << ';'; break;
+			case 13: out << a << " = " << b << " | " << c << ';'; break;
+			case 14: out << a << " = ~" << b << " & (M - 1);"; break;
+			case 15: out << a << " = m.load(" << b << ");"; break;
+			case 16:
+				out << "if (m.store(" << a << ", " << b << ")) { m.pc = " << hex(next)
+						<< "; return {nullptr}; }";
+				break;
+			case 17:
+				out << "m.push(" << next << "u);\n\t";
+				if (is_register(w[1]))
+					out << "m.pc = " << a << "; return {nullptr};";
+				else
+					out << go(w[1]);
+				break;
+			case 18:
+				out << "if (m.stack.empty()) { m.halted = true; return {nullptr}; }\n"
+						<< "\tm.pc = m.pop(); return {nullptr};";
+				break;
+			case 19: out << "m.out(" << a << ");"; break;
+			case 20: out << a << " = m.in();"; break;
+			}
+			out << '\n';
+		}
+		if (!ends_block(words[blk.ins.back()]))
+			out << '\t' << go(blk.last) << '\n';
+		out << "}\n\n";
+	}
+};
+
+// A plain image, as vm reads it.
+void load_image(const std::string &filename, program &p) {
+	mapped_file file{filename};
+	if (file.size() % 2 != 0)
+		throw std::runtime_error{"Unable to read full word from input file."};
+	std::size_t n{file.size() / 2};
+	if (n > M)
+		throw std::runtime_error{"Program is too big."};
+	const unsigned char *bytes = file.data();
+	for (std::size_t i = 0; i < n; i += 1)
+		p.words.push_back(bytes[2 * i] | bytes[2 * i + 1] << 8);
+	p.banner = "Reading program... done. Read " + std::to_string(n) + " words.\\n";
+}
+
+numtype from_le(const std::uint16_t *w) {
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(w);
+	return bytes[0] | bytes[1] << 8;
+}
+
+// A snapshot, as vm -s restores it. Breakpoints don't mean anything here.
+void load_snapshot(const std::string &filename, program &p) {
+	snapshot snap{filename};
+	const snapshot_header &h = snap.header();
+	for (std::size_t i = 0; i < h.mem_size; i += 1)
+		p.words.push_back(from_le(snap.memory() + i));
+	for (std::size_t i = 0; i < h.stack_size; i += 1)
+		p.stack.push_back(from_le(snap.stack() + i));
+	p.pc = h.pc;
+	p.regs.assign(h.regs, h.regs + 8);
+	p.input.assign(snap.input(), h.input_size);
+	p.banner = "Restoring snapshot... done. Read " + std::to_string(h.mem_size) +
+		" words.\\n";
+}
+
+}
+
+int main(int argc, char **argv) {
+	bool saved{false};
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i += 1) {
+		if (std::strcmp(argv[i], "-s") == 0)
+			saved = true;
+		else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+	if (argc - i != 1 && argc - i != 2) {
+		std::cerr << "Usage: " << argv[0] << " [-s] IMGFILE [OUTFILE]\n";
+		return 1;
+	}
+
+	std::string filename{argv[i]};
+	program p;
+	try {
+		if (saved && !snapshot::is_snapshot(filename))
+			throw std::runtime_error{"Only binary snapshots can be recompiled."};
+		if (saved)
+			load_snapshot(filename, p);
+		else
+			load_image(filename, p);
+	} catch (std::exception &e) {
+		std::cerr << "Unable to load " << filename << ": " << e.what() << '\n';
+		return 1;
+	}
+
+	recompiler rc{p};
+	rc.find();
+	if (argc - i == 1) {
+		rc.write(std::cout, filename);
+	} else {
+		std::ofstream out(argv[i + 1]);
+		if (!out.is_open()) {
+			std::cerr << "Unable to open " << argv[i + 1] << " for writing.\n";
+			return 1;
+		}
+		rc.write(out, filename);
+	}
+	std::cerr << "Compiled " << rc.instruction_count() << " instructions in "
+						<< rc.block_count() << " blocks.\n";
+	return 0;
+}
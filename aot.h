@@ -0,0 +1,239 @@
+/* The runtime for programs recompiled to C++ by vm-aot. See aot.cc.
+ *
+ * The generated code is a function per basic block, each running its
+ * instructions against an aot_machine and returning the block to run
+ * next. A jump to a literal address returns its block directly. ret, and
+ * jumps and calls through a register, return nothing, and aot_run() looks
+ * the program counter up in the dispatch table instead.
+ *
+ * The program can write over its own code. A write to a word any block
+ * was compiled from marks that block stale, and stale blocks are never
+ * run again: jumps to them, and anything vm-aot didn't find, go to the
+ * interpreter at the bottom of this file, which runs the words in memory
+ * as they are until it gets to a block that's still good.
+ *
+ * Input and output are the same as vm's on the terminal, so that the two
+ * can be compared byte for byte.
+ */
+
+#ifndef AOT_H
+#define AOT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+
+using numtype = std::uint32_t;
+constexpr numtype M{32768};
+
+struct aot_machine;
+struct aot_block;
+using aot_fn = aot_block (*)(aot_machine &);
+// What a block returns: the next one, or nothing to look up pc.
+struct aot_block { aot_fn fn; };
+
+// A block as vm-aot found it: where it starts, one past its last word,
+// and its code.
+struct aot_entry {
+	numtype first, last;
+	aot_fn fn;
+};
+
+struct aot_machine {
+	numtype pc{0};
+	numtype r[8]{0, 0, 0, 0, 0, 0, 0, 0};
+	std::vector<numtype> stack;
+	// All 16 bit addresses, as in paged_memory.
+	std::vector<std::uint16_t> mem;
+	bool halted{false};
+	std::string input;
+	std::size_t input_pos{0};
+
+	// The dispatch table: the block starting at each address, if any, and
+	// the number of it.
+	std::vector<aot_fn> entry;
+	std::vector<std::uint32_t> index;
+	// Blocks that have been written over.
+	std::vector<bool> stale;
+	// The blocks each word was compiled into, for the few words that are
+	// in more than one, with covers[addr] the first of them.
+	std::vector<std::uint32_t> covers;
+	std::vector<std::vector<std::uint32_t>> more;
+
+	static constexpr std::uint32_t none = ~std::uint32_t{0};
+
+	aot_machine(const std::uint16_t *image, std::size_t words,
+							const aot_entry *blocks, std::size_t count)
+		: mem(65536, 0), entry(M, nullptr), index(M, none), stale(count, false),
+			covers(65536, none), more(65536) {
+		for (std::size_t i = 0; i < words; i += 1)
+			mem[i] = image[i];
+		for (std::uint32_t k = 0; k < count; k += 1) {
+			entry[blocks[k].first] = blocks[k].fn;
+			index[blocks[k].first] = k;
+			for (numtype a = blocks[k].first; a < blocks[k].last; a += 1) {
+				if (covers[a] == none)
+					covers[a] = k;
+				else
+					more[a].push_back(k);
+			}
+		}
+	}
+
+	numtype load(numtype addr) const { return mem[addr & 0xFFFF]; }
+	// True if it wrote over a block that was still good, which the block
+	// doing it has to stop for, in case that was itself.
+	bool store(numtype addr, numtype v) {
+		addr &= 0xFFFF;
+		if (mem[addr] == std::uint16_t(v))
+			return false;
+		mem[addr] = v;
+		if (covers[addr] == none)
+			return false;
+		bool hit{mark(covers[addr])};
+		for (auto k : more[addr])
+			hit = mark(k) || hit;
+		return hit;
+	}
+	bool mark(std::uint32_t k) {
+		if (stale[k])
+			return false;
+		stale[k] = true;
+		return true;
+	}
+	void push(numtype v) { stack.push_back(v); }
+	numtype pop(void) {
+		if (stack.empty())
+			throw std::runtime_error{"empty stack"};
+		numtype v = stack.back();
+		stack.pop_back();
+		return v;
+	}
+	void out(numtype c) { std::cout.put(static_cast<char>(c)); }
+	// A line at a time from standard input, skipping empty ones, like
+	// terminal_source.
+	numtype in(void) {
+		while (input_pos == input.size()) {
+			std::string line;
+			if (!std::getline(std::cin, line))
+				throw std::runtime_error{"Input failed"};
+			if (line.empty())
+				continue;
+			input = line + '\n';
+			input_pos = 0;
+		}
+		return static_cast<unsigned char>(input[input_pos++]);
+	}
+
+	// Carry on at addr with the block a static jump found there, unless
+	// it's been written over.
+	aot_block go(aot_fn fn, std::uint32_t k, numtype addr) {
+		if (stale[k]) {
+			pc = addr;
+			return {nullptr};
+		}
+		return {fn};
+	}
+	// The block at pc, or nothing if there isn't a good one.
+	aot_fn lookup(void) const {
+		if (pc >= M || !entry[pc] || stale[index[pc]])
+			return nullptr;
+		return entry[pc];
+	}
+
+	void interpret(void);
+};
+
+// Operands, as the threaded engine reads them.
+#define AOT_V(n) ((n) < M ? numtype(n) : r[(n) - M])
+
+// Run the words in memory from pc until there's a good block to go to.
+inline void aot_machine::interpret(void) {
+	do {
+		if (pc >= M) {
+			halted = true;
+			return;
+		}
+		const std::uint16_t *w = &mem[pc];
+		numtype a{w[1]}, b{w[2]}, c{w[3]};
+		if (w[0] > 21)
+			throw std::out_of_range{"Invalid opcode."};
+		// Only the operands an instruction has are looked at, and where it
+		// writes to has to be a register.
+		static const int len[22] = {
+			1, 3, 2, 2, 4, 4, 2, 3, 3, 4, 4, 4, 4, 4, 3, 3, 3, 2, 1, 2, 2, 1
+		};
+		for (int i = 1; i < len[w[0]]; i += 1)
+			if (w[i] >= M + 8)
+				throw std::runtime_error{"Invalid number."};
+		bool writes{w[0] == 1 || (w[0] >= 3 && w[0] <= 5) ||
+			(w[0] >= 9 && w[0] <= 15) || w[0] == 20};
+		if (writes && a < M)
+			throw std::runtime_error{"not a register"};
+		switch (w[0]) {
+		case 0: halted = true; return;
+		case 1: r[a - M] = AOT_V(b); pc += 3; break;
+		case 2: push(AOT_V(a)); pc += 2; break;
+		case 3: r[a - M] = pop(); pc += 2; break;
+		case 4: r[a - M] = AOT_V(b) == AOT_V(c); pc += 4; break;
+		case 5: r[a - M] = AOT_V(b) > AOT_V(c); pc += 4; break;
+		case 6: pc = AOT_V(a); break;
+		case 7: pc = AOT_V(a) != 0 ? AOT_V(b) : pc + 3; break;
+		case 8: pc = AOT_V(a) == 0 ? AOT_V(b) : pc + 3; break;
+		case 9: r[a - M] = (AOT_V(b) + AOT_V(c)) % M; pc += 4; break;
+		case 10: r[a - M] = (AOT_V(b) * AOT_V(c)) % M; pc += 4; break;
+		case 11: r[a - M] = AOT_V(b) % AOT_V(c); pc += 4; break;
+		case 12: r[a - M] = AOT_V(b) & AOT_V(c); pc += 4; break;
+		case 13: r[a - M] = AOT_V(b) | AOT_V(c); pc += 4; break;
+		case 14: r[a - M] = ~AOT_V(b) & (M - 1); pc += 3; break;
+		case 15: r[a - M] = load(AOT_V(b)); pc += 3; break;
+		case 16: store(AOT_V(a), AOT_V(b)); pc += 3; break;
+		case 17: push(pc + 2); pc = AOT_V(a); break;
+		case 18:
+			if (stack.empty()) {
+				halted = true;
+				return;
+			}
+			pc = pop();
+			break;
+		case 19: out(AOT_V(a)); pc += 2; break;
+		case 20: r[a - M] = in(); pc += 2; break;
+		case 21: pc += 1; break;
+		}
+	} while (!lookup());
+}
+
+#undef AOT_V
+
+// Run from m.pc until the program halts. Returns vm's exit status, and
+// like vm, reports an error on standard error and ends the output with a
+// newline either way.
+inline int aot_run(aot_machine &m) {
+	int status{0};
+	try {
+		aot_block next{m.lookup()};
+		for (;;) {
+			if (!next.fn) {
+				if (!m.lookup())
+					m.interpret();
+				if (m.halted)
+					break;
+				next.fn = m.lookup();
+			}
+			next = next.fn(m);
+			if (m.halted)
+				break;
+		}
+	} catch (std::exception &e) {
+		std::cout << std::flush;
+		std::cerr << "\nError: " << e.what() << '\n';
+		status = 1;
+	}
+	std::cout << '\n' << std::flush;
+	return status;
+}
+
+#endif
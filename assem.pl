@@ -24,8 +24,8 @@ my %insns = (
 	"and" => [12, "r", "rn", "rn"],
 	"or" => [13, "r", "rn", "rn"],
 	"not" => [14, "r", "rn"],
-	"rmem" => [15, "r", "al"],
-	"wmem" => [16, "al", "rn"],
+	"rmem" => [15, "r", "ral"],
+	"wmem" => [16, "ral", "rn"],
 	"call" => [17, "ral"],
 	"ret" =>  [18],
 	"out" => [19, "rn"],
@@ -0,0 +1,324 @@
+/* Batch runner for the Synacor Challenge VM. */
+
+
+/* Usage: vm-batch [-s -H -j THREADS -n COUNT -e ENGINE -o DIR] IMGFILE SCRIPT...
+*
+* Runs one instance of IMGFILE per SCRIPT, with that script as its input,
+* and prints a report of how each one went. The image is only loaded once;
+* every instance starts out as a copy-on-write clone of it.
+*
+* Options: -s IMGFILE is a saved state from a previous session
+*          -H Run guest routines as they are, without native hooks.
+*          -j THREADS Number of worker threads. Defaults to one per core.
+*          -n COUNT Stop each instance after COUNT instructions.
+*          -e ENGINE Execution engine, as for vm.
+*          -o DIR Save the output of each instance in DIR/N-SCRIPT.out
+*/
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <limits>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "image.h"
+#include "snapshot.h"
+
+// A fixed set of workers, each with its own deque of jobs. A worker takes
+// jobs from the back of its own deque, and when that runs dry steals from
+// the front of the others'. Jobs don't submit more jobs, so once a worker
+// finds every deque empty it's done.
+class work_stealing_pool {
+public:
+	// Jobs are told which worker is running them.
+	using job = std::function<void(unsigned)>;
+
+	explicit work_stealing_pool(unsigned workers);
+	// Queue a job before run(). Jobs are dealt out round robin.
+	void submit(job j);
+	// Run every job, and return once they're all done.
+	void run(void);
+	std::uint64_t steals(unsigned worker) const { return stolen[worker]; }
+
+private:
+	struct queue {
+		std::mutex lock;
+		std::deque<job> jobs;
+	};
+	std::vector<std::unique_ptr<queue>> queues;
+	std::vector<std::uint64_t> stolen;
+	unsigned next{0};
+
+	bool take(unsigned self, job &j);
+	void work(unsigned self);
+};
+
+work_stealing_pool::work_stealing_pool(unsigned workers)
+	: stolen(workers, 0) {
+	for (unsigned i = 0; i < workers; i += 1)
+		queues.emplace_back(new queue);
+}
+
+void work_stealing_pool::submit(job j) {
+	queues[next]->jobs.push_back(std::move(j));
+	next = (next + 1) % queues.size();
+}
+
+bool work_stealing_pool::take(unsigned self, job &j) {
+	{
+		queue &q = *queues[self];
+		std::lock_guard<std::mutex> guard{q.lock};
+		if (!q.jobs.empty()) {
+			j = std::move(q.jobs.back());
+			q.jobs.pop_back();
+			return true;
+		}
+	}
+	for (unsigned i = 1; i < queues.size(); i += 1) {
+		queue &victim = *queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> guard{victim.lock};
+		if (!victim.jobs.empty()) {
+			j = std::move(victim.jobs.front());
+			victim.jobs.pop_front();
+			stolen[self] += 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void work_stealing_pool::work(unsigned self) {
+	job j;
+	while (take(self, j))
+		j(self);
+}
+
+void work_stealing_pool::run(void) {
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < queues.size(); i += 1)
+		threads.emplace_back(&work_stealing_pool::work, this, i);
+	work(0);
+	for (auto &t : threads)
+		t.join();
+}
+
+// One run of the image with one script.
+struct instance {
+	std::string script;
+	std::unique_ptr<file_source> input;
+	std::string output;
+	std::uint64_t output_size{0};
+	std::string result;
+	std::uint64_t instructions{0};
+	double seconds{0};
+	unsigned worker{0};
+};
+
+// Output is only kept if it's going to be saved; otherwise it's just
+// counted.
+static void run_instance(const image &base, instance &inst, std::uint64_t limit,
+												 bool keep_output) {
+	auto start = std::chrono::steady_clock::now();
+	image p{base};
+	memory_sink kept;
+	null_sink counted;
+	if (keep_output)
+		p.set_output(kept);
+	else
+		p.set_output(counted);
+	p.feed(*inst.input);
+	std::uint64_t before{p.instructions()};
+	try {
+		switch (p.run_for(limit)) {
+		case run_status::halted:
+			inst.result = "halted";
+			break;
+		case run_status::needs_input:
+			inst.result = "end of input";
+			break;
+		case run_status::budget_exhausted:
+			inst.result = "out of budget";
+			break;
+		case run_status::breakpoint:
+			inst.result = "breakpoint";
+			break;
+		}
+	} catch (std::exception &e) {
+		inst.result = std::string{"error: "} + e.what();
+	}
+	inst.instructions = p.instructions() - before;
+	if (keep_output) {
+		inst.output = kept.str();
+		inst.output_size = inst.output.size();
+	} else {
+		inst.output_size = counted.written();
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	inst.seconds = elapsed.count();
+}
+
+static std::string basename(const std::string &path) {
+	auto slash = path.find_last_of('/');
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+int main(int argc, char **argv) {
+	bool saved{false};
+	bool natives{true};
+	unsigned threads{std::thread::hardware_concurrency()};
+	std::uint64_t limit{std::numeric_limits<std::uint64_t>::max()};
+	engine eng{engine::table};
+	std::string outdir;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i += 1) {
+		if (std::strcmp(argv[i], "-s") == 0)
+			saved = true;
+		else if (std::strcmp(argv[i], "-H") == 0)
+			natives = false;
+		else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			limit = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outdir = argv[++i];
+		else if (std::strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			i += 1;
+			if (std::strcmp(argv[i], "threaded") == 0)
+				eng = engine::threaded;
+			else if (std::strcmp(argv[i], "decoded") == 0)
+				eng = engine::decoded;
+			else if (std::strcmp(argv[i], "jit") == 0)
+				eng = engine::jit;
+			else if (std::strcmp(argv[i], "table") == 0)
+				eng = engine::table;
+			else {
+				std::cerr << "Unknown engine '" << argv[i] << "'.\n";
+				return 1;
+			}
+		} else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+	if (argc - i < 2) {
+		std::cout << "Usage: " << argv[0]
+							<< " [-s -H -j THREADS -n COUNT -e ENGINE -o DIR] IMAGEFILE SCRIPT...\n";
+		return 1;
+	}
+	if (threads == 0)
+		threads = 1;
+
+	std::string filename{argv[i++]};
+	std::vector<instance> instances;
+	std::unique_ptr<image> base;
+	try {
+		for (; i < argc; i += 1) {
+			instance inst;
+			inst.script = argv[i];
+			inst.input.reset(new file_source{inst.script});
+			instances.push_back(std::move(inst));
+		}
+		if (saved && snapshot::is_snapshot(filename)) {
+			snapshot snap{filename};
+			base.reset(new image{snap, true});
+		} else if (saved) {
+			std::ifstream input(filename, std::ifstream::in | std::ifstream::binary);
+			if (!input.is_open())
+				throw std::runtime_error{"Unable to open " + filename + " for reading."};
+			base.reset(new image{input, true, true});
+		} else {
+			base.reset(new image{filename, true});
+		}
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+	base->set_engine(eng);
+	if (natives)
+		add_builtin_natives(*base);
+	if (threads > instances.size())
+		threads = instances.size();
+
+	work_stealing_pool pool{threads};
+	for (auto &inst : instances) {
+		instance *p = &inst;
+		bool keep_output{!outdir.empty()};
+		pool.submit([&base, p, limit, keep_output](unsigned worker) {
+			p->worker = worker;
+			run_instance(*base, *p, limit, keep_output);
+		});
+	}
+	auto start = std::chrono::steady_clock::now();
+	pool.run();
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+
+	int status{0};
+	std::vector<std::uint64_t> worker_instructions(threads, 0);
+	std::vector<double> worker_seconds(threads, 0);
+	std::vector<unsigned> worker_instances(threads, 0);
+	std::uint64_t total{0};
+
+	std::cout << std::left << std::setw(32) << "Script" << std::setw(16) << "Result"
+						<< std::right << std::setw(14) << "Instructions" << std::setw(10)
+						<< "Seconds" << std::setw(10) << "Output" << '\n';
+	for (std::size_t n = 0; n < instances.size(); n += 1) {
+		const instance &inst = instances[n];
+		std::cout << std::left << std::setw(32) << inst.script << std::setw(16)
+							<< inst.result << std::right << std::setw(14) << inst.instructions
+							<< std::setw(10) << std::fixed << std::setprecision(3)
+							<< inst.seconds << std::setw(10) << inst.output_size << '\n';
+		if (inst.result.compare(0, 6, "error:") == 0)
+			status = 1;
+		total += inst.instructions;
+		worker_instructions[inst.worker] += inst.instructions;
+		worker_seconds[inst.worker] += inst.seconds;
+		worker_instances[inst.worker] += 1;
+
+		if (!outdir.empty()) {
+			std::string name{outdir + '/' + std::to_string(n) + '-' +
+				basename(inst.script) + ".out"};
+			std::ofstream out(name, std::ofstream::out | std::ofstream::binary);
+			if (!out.is_open()) {
+				std::cerr << "Unable to open " << name << " for writing.\n";
+				status = 1;
+			} else {
+				out << inst.output;
+			}
+		}
+	}
+
+	double secs = elapsed.count();
+	std::cout << "\nRan " << instances.size() << " instances on " << threads
+						<< " threads in " << secs << " seconds: " << total
+						<< " instructions";
+	if (secs > 0)
+		std::cout << ", " << std::setprecision(1) << (total / secs / 1e6)
+							<< " MIPS overall, " << (total / secs / 1e6 / threads)
+							<< " MIPS per thread";
+	std::cout << ".\n";
+	for (unsigned w = 0; w < threads; w += 1) {
+		std::cout << "Thread " << w << ": " << worker_instances[w] << " instances ("
+							<< pool.steals(w) << " stolen), " << worker_instructions[w]
+							<< " instructions in " << std::setprecision(3) << worker_seconds[w]
+							<< " seconds";
+		if (worker_seconds[w] > 0)
+			std::cout << " (" << std::setprecision(1)
+								<< (worker_instructions[w] / worker_seconds[w] / 1e6) << " MIPS)";
+		std::cout << ".\n";
+	}
+	return status;
+}
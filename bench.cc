@@ -0,0 +1,286 @@
+/* Benchmark driver for the VM and the solvers. */
+
+
+/* Usage: vm-bench [-r RUNS -t PERCENT -w BASELINE] SUITE [BASELINE]
+*
+* Runs every workload in SUITE and reports its wall time, instructions per
+* second and peak RSS, compared with BASELINE if one is given.
+*
+* A SUITE file has one workload per line: a name, then the shell command
+* that runs it. Blank lines and lines starting with # are ignored. Commands
+* run with standard input from /dev/null and standard output thrown away.
+* If one prints vm -m's "Executed N instructions in S seconds" line to
+* standard error, its instructions per second are worked out from that.
+*
+* Options: -r RUNS Run each workload RUNS times and keep the fastest.
+*                  Defaults to 3.
+*          -t PERCENT How much slower or faster than the baseline a
+*                  workload has to be to be flagged. Defaults to 10.
+*          -w BASELINE Save the results as a new baseline.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct workload {
+	std::string name;
+	std::string command;
+};
+
+// How a workload went. Times are the fastest of its runs, and RSS the
+// largest.
+struct result {
+	double wall{0};
+	std::uint64_t instructions{0};
+	double vm_seconds{0};
+	long rss_kb{0};
+	bool ok{true};
+
+	double mips(void) const {
+		return vm_seconds > 0 ? instructions / vm_seconds / 1e6 : 0;
+	}
+};
+
+static std::vector<workload> read_suite(const std::string &filename) {
+	std::ifstream in(filename);
+	if (!in.is_open())
+		throw std::runtime_error{"Unable to open " + filename + " for reading."};
+	std::vector<workload> suite;
+	std::string line;
+	while (std::getline(in, line)) {
+		auto start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line[start] == '#')
+			continue;
+		auto end = line.find_first_of(" \t", start);
+		auto cmd = line.find_first_not_of(" \t", end);
+		if (end == std::string::npos || cmd == std::string::npos)
+			throw std::runtime_error{"Workload with no command in " + filename + "."};
+		suite.push_back({line.substr(start, end - start), line.substr(cmd)});
+	}
+	return suite;
+}
+
+// A baseline file has a line per workload: name, wall seconds, MIPS (0
+// if it doesn't count instructions) and peak RSS in KB.
+static std::map<std::string, result> read_baseline(const std::string &filename) {
+	std::ifstream in(filename);
+	if (!in.is_open())
+		throw std::runtime_error{"Unable to open " + filename + " for reading."};
+	std::map<std::string, result> baseline;
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+		std::istringstream fields{line};
+		std::string name;
+		double mips;
+		result r;
+		if (!(fields >> name >> r.wall >> mips >> r.rss_kb))
+			throw std::runtime_error{"Malformed line in " + filename + ": " + line};
+		// Enough to get mips() back.
+		r.vm_seconds = mips > 0 ? 1 : 0;
+		r.instructions = mips * 1e6;
+		baseline[name] = r;
+	}
+	return baseline;
+}
+
+static void write_baseline(const std::string &filename,
+													 const std::vector<workload> &suite,
+													 const std::vector<result> &results) {
+	std::ofstream out(filename);
+	if (!out.is_open())
+		throw std::runtime_error{"Unable to open " + filename + " for writing."};
+	out << "# name wall-seconds MIPS peak-RSS-KB, written by vm-bench -w\n";
+	for (std::size_t i = 0; i < suite.size(); i += 1)
+		if (results[i].ok)
+			out << suite[i].name << ' ' << std::fixed << std::setprecision(4)
+					<< results[i].wall << ' ' << std::setprecision(1) << results[i].mips()
+					<< ' ' << results[i].rss_kb << '\n';
+}
+
+// Run command once through the shell, and fill in r with how it went.
+// The shell execs the command, so the child's resource usage is the
+// command's own.
+static void run_once(const std::string &command, result &r) {
+	int err[2];
+	if (pipe(err) < 0)
+		throw std::runtime_error{"Unable to create a pipe."};
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid < 0)
+		throw std::runtime_error{"Unable to fork."};
+	if (pid == 0) {
+		int null = open("/dev/null", O_RDWR);
+		dup2(null, 0);
+		dup2(null, 1);
+		dup2(err[1], 2);
+		close(null);
+		close(err[0]);
+		close(err[1]);
+		execl("/bin/sh", "sh", "-c", ("exec " + command).c_str(),
+					static_cast<char *>(nullptr));
+		_exit(127);
+	}
+	close(err[1]);
+	std::string errors;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(err[0], buf, sizeof buf)) > 0)
+		errors.append(buf, n);
+	close(err[0]);
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) < 0)
+		throw std::runtime_error{"Unable to wait for a workload."};
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << command << " failed:\n" << errors;
+		r.ok = false;
+		return;
+	}
+	if (r.wall == 0 || elapsed.count() < r.wall)
+		r.wall = elapsed.count();
+	r.rss_kb = std::max(r.rss_kb, usage.ru_maxrss);
+
+	auto at = errors.find("Executed ");
+	if (at != std::string::npos) {
+		std::istringstream line{errors.substr(at + 9)};
+		std::uint64_t count;
+		std::string word;
+		double secs;
+		if (line >> count >> word >> word >> secs && secs > 0 &&
+				(r.vm_seconds == 0 || secs < r.vm_seconds)) {
+			r.instructions = count;
+			r.vm_seconds = secs;
+		}
+	}
+}
+
+// Percentage change from the baseline, positive meaning faster. Compares
+// MIPS where both have them, and wall time otherwise.
+static double speedup(const result &now, const result &then) {
+	if (now.mips() > 0 && then.mips() > 0)
+		return 100 * (now.mips() / then.mips() - 1);
+	return 100 * (then.wall / now.wall - 1);
+}
+
+int main(int argc, char **argv) {
+	unsigned runs{3};
+	double tolerance{10};
+	std::string save;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i += 1) {
+		if (std::strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			runs = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			tolerance = std::strtod(argv[++i], nullptr);
+		else if (std::strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			save = argv[++i];
+		else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+	if (argc - i < 1 || argc - i > 2) {
+		std::cout << "Usage: " << argv[0]
+							<< " [-r RUNS -t PERCENT -w BASELINE] SUITE [BASELINE]\n";
+		return 1;
+	}
+	if (runs == 0)
+		runs = 1;
+
+	std::vector<workload> suite;
+	std::map<std::string, result> baseline;
+	try {
+		suite = read_suite(argv[i]);
+		if (argc - i == 2)
+			baseline = read_baseline(argv[i + 1]);
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+
+	int status{0};
+	unsigned slower{0}, faster{0};
+	std::vector<result> results(suite.size());
+	std::cout << std::left << std::setw(20) << "Workload" << std::right
+						<< std::setw(10) << "Wall" << std::setw(10) << "MIPS"
+						<< std::setw(12) << "Peak RSS";
+	if (!baseline.empty())
+		std::cout << std::setw(12) << "Baseline";
+	std::cout << '\n';
+	for (std::size_t n = 0; n < suite.size(); n += 1) {
+		result &r = results[n];
+		try {
+			for (unsigned k = 0; k < runs && r.ok; k += 1)
+				run_once(suite[n].command, r);
+		} catch (std::exception &e) {
+			std::cerr << "Error: " << e.what() << '\n';
+			return 1;
+		}
+		std::cout << std::left << std::setw(20) << suite[n].name << std::right;
+		if (!r.ok) {
+			std::cout << "    failed\n";
+			status = 1;
+			continue;
+		}
+		std::cout << std::fixed << std::setprecision(3) << std::setw(9) << r.wall
+							<< 's' << std::setprecision(1) << std::setw(10);
+		if (r.mips() > 0)
+			std::cout << r.mips();
+		else
+			std::cout << '-';
+		std::cout << std::setw(9) << r.rss_kb << " KB";
+		auto then = baseline.find(suite[n].name);
+		if (then != baseline.end()) {
+			double change = speedup(r, then->second);
+			std::cout << std::setw(11) << std::showpos << change << std::noshowpos
+								<< '%';
+			if (change < -tolerance) {
+				std::cout << " slower";
+				slower += 1;
+			} else if (change > tolerance) {
+				std::cout << " faster";
+				faster += 1;
+			}
+		} else if (!baseline.empty()) {
+			std::cout << std::setw(12) << "new";
+		}
+		std::cout << std::endl;
+	}
+	if (!baseline.empty())
+		std::cout << '\n' << slower << " slower and " << faster
+							<< " faster than the baseline by more than " << tolerance
+							<< "%.\n";
+
+	if (!save.empty()) {
+		try {
+			write_baseline(save, suite, results);
+		} catch (std::exception &e) {
+			std::cerr << "Error: " << e.what() << '\n';
+			return 1;
+		}
+	}
+	return status;
+}
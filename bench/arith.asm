@@ -0,0 +1,27 @@
+# Arithmetic and logic in a tight loop, 50 million instructions of it: a
+# linear congruential generator with its bits mixed into an accumulator.
+# Prints one letter that depends on every step, then halts.
+set r0 0
+set r1 12345
+set r7 0
+OUTER:
+set r2 0
+INNER:
+mult r1 r1 1103
+add r1 r1 12345
+and r3 r1 255
+or r4 r3 r2
+not r5 r4
+mod r6 r5 97
+add r7 r7 r6
+add r2 r2 1
+eq r3 r2 10000
+jf r3 INNER
+add r0 r0 1
+eq r3 r0 500
+jf r3 OUTER
+mod r7 r7 26
+add r7 r7 'a'
+out r7
+out '\n'
+halt
@@ -0,0 +1,27 @@
+# Calls, returns and the stack: the naive recursive Fibonacci of 29, about
+# 1.6 million calls deep and wide. Prints fib(29) mod 32768 mod 26 as a
+# letter ('l'), then halts.
+set r0 29
+call FIB
+mod r0 r0 26
+add r0 r0 'a'
+out r0
+out '\n'
+halt
+
+# r0 = fib(r0). Clobbers r1.
+FIB:
+gt r1 r0 1
+jt r1 RECURSE
+ret
+RECURSE:
+push r0
+add r0 r0 32767
+call FIB
+pop r1
+push r0
+add r0 r1 32766
+call FIB
+pop r1
+add r0 r0 r1
+ret
@@ -0,0 +1,21 @@
+# Stores above 32767: memory goes up to 65535, though only a register
+# can hold an address that high. r0 gets 32775 from the operand of the
+# set at 0. 100 passes of 4096 stores spread over the top half, then the
+# last value stored at 32775 is read back and printed ('c').
+set r7 r7
+rmem r0 1
+set r3 0
+PASS:
+set r1 0
+STORE:
+or r2 r0 r1
+wmem r2 r3
+add r1 r1 1
+eq r4 r1 4096
+jf r4 STORE
+add r3 r3 1
+eq r4 r3 100
+jf r4 PASS
+rmem r5 r0
+out r5
+halt
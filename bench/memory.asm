@@ -0,0 +1,38 @@
+# Memory reads and writes: 100 passes of the sieve of Eratosthenes over
+# 16000 flags stored from address 16384 up. Prints the number of primes
+# found mod 26 as a letter ('q'), then halts.
+set r7 0
+PASS:
+set r0 16384
+CLEAR:
+wmem r0 0
+add r0 r0 1
+eq r1 r0 32384
+jf r1 CLEAR
+set r2 0
+set r3 2
+SCAN:
+add r0 r3 16384
+rmem r1 r0
+jt r1 NEXT
+add r2 r2 1
+add r4 r3 r3
+MARK:
+gt r1 r4 15999
+jt r1 NEXT
+add r0 r4 16384
+wmem r0 1
+add r4 r4 r3
+jmp MARK
+NEXT:
+add r3 r3 1
+eq r1 r3 16000
+jf r1 SCAN
+add r7 r7 1
+eq r1 r7 100
+jf r1 PASS
+mod r2 r2 26
+add r2 r2 'a'
+out r2
+out '\n'
+halt
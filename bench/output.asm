@@ -0,0 +1,16 @@
+# Output: 30000 lines of 60 characters each, about 15 million
+# instructions and 1.8 MB.
+set r0 0
+LINE:
+set r1 0
+CHAR:
+add r2 r1 'A'
+out r2
+add r1 r1 1
+eq r3 r1 60
+jf r3 CHAR
+out '\n'
+add r0 r0 1
+eq r3 r0 30000
+jf r3 LINE
+halt
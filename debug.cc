@@ -0,0 +1,328 @@
+/* Breakpoints, watchpoints and the conditions breakpoints can have.
+ *
+ * A condition is parsed once, by recursive descent, into a list of terms
+ * in postfix order, and evaluated with a little stack machine each time
+ * its breakpoint is reached.
+ */
+#include <string>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <cctype>
+#include <cstdint>
+
+#include "image.h"
+
+namespace {
+
+class parser {
+public:
+	parser(const std::string &text, std::vector<condition::term> &out)
+		: s(text), terms(out) {}
+
+	void parse(void) {
+		logical_or();
+		skip_space();
+		if (at < s.size())
+			fail("Unexpected '" + s.substr(at) + "'");
+	}
+
+private:
+	using kind = condition::term::kind_t;
+
+	const std::string &s;
+	std::vector<condition::term> &terms;
+	std::size_t at{0};
+
+	[[noreturn]] void fail(const std::string &why) {
+		throw std::runtime_error{why + " in condition."};
+	}
+	void skip_space(void) {
+		while (at < s.size() && std::isspace(static_cast<unsigned char>(s[at])))
+			at += 1;
+	}
+	// Consume op if it's next. Doesn't take the first half of a longer
+	// operator that starts the same way.
+	bool accept(const char *op) {
+		skip_space();
+		std::size_t len = std::char_traits<char>::length(op);
+		if (s.compare(at, len, op) != 0)
+			return false;
+		if (len == 1 && at + 1 < s.size() &&
+				(((op[0] == '&' || op[0] == '|') && s[at + 1] == op[0]) ||
+				 ((op[0] == '<' || op[0] == '>' || op[0] == '!') && s[at + 1] == '=')))
+			return false;
+		at += len;
+		return true;
+	}
+	void emit(kind k, std::uint32_t value = 0) { terms.push_back({k, value}); }
+
+	void logical_or(void) {
+		logical_and();
+		while (accept("||")) {
+			logical_and();
+			emit(kind::or_);
+		}
+	}
+	void logical_and(void) {
+		comparison();
+		while (accept("&&")) {
+			comparison();
+			emit(kind::and_);
+		}
+	}
+	void comparison(void) {
+		bits();
+		static const struct { const char *op; kind k; } ops[] = {
+			{"==", kind::eq}, {"!=", kind::ne}, {"<=", kind::le}, {">=", kind::ge},
+			{"<", kind::lt}, {">", kind::gt}
+		};
+		for (const auto &o : ops)
+			if (accept(o.op)) {
+				bits();
+				emit(o.k);
+				return;
+			}
+	}
+	void bits(void) {
+		sum();
+		for (;;) {
+			if (accept("&")) {
+				sum();
+				emit(kind::bitand_);
+			} else if (accept("|")) {
+				sum();
+				emit(kind::bitor_);
+			} else {
+				return;
+			}
+		}
+	}
+	void sum(void) {
+		product();
+		for (;;) {
+			if (accept("+")) {
+				product();
+				emit(kind::add);
+			} else if (accept("-")) {
+				product();
+				emit(kind::sub);
+			} else {
+				return;
+			}
+		}
+	}
+	void product(void) {
+		unary();
+		for (;;) {
+			if (accept("*")) {
+				unary();
+				emit(kind::mul);
+			} else if (accept("%")) {
+				unary();
+				emit(kind::mod);
+			} else {
+				return;
+			}
+		}
+	}
+	void unary(void) {
+		if (accept("!")) {
+			unary();
+			emit(kind::negate);
+		} else {
+			primary();
+		}
+	}
+	void primary(void) {
+		skip_space();
+		if (at == s.size())
+			fail("Unexpected end");
+		char c = s[at];
+		if (accept("(")) {
+			logical_or();
+			if (!accept(")"))
+				fail("Missing )");
+		} else if (accept("[")) {
+			logical_or();
+			if (!accept("]"))
+				fail("Missing ]");
+			emit(kind::deref);
+		} else if (c == 'r' && at + 1 < s.size() && s[at + 1] >= '0' &&
+							 s[at + 1] <= '7') {
+			emit(kind::reg, s[at + 1] - '0');
+			at += 2;
+		} else if (s.compare(at, 2, "pc") == 0) {
+			emit(kind::pc);
+			at += 2;
+		} else if (std::isdigit(static_cast<unsigned char>(c))) {
+			// Nothing the machine holds is bigger than a register operand.
+			bool hex{s.compare(at, 2, "0x") == 0};
+			if (hex)
+				at += 2;
+			std::size_t first{at};
+			std::uint32_t v{0};
+			for (; at < s.size(); at += 1) {
+				unsigned char d = s[at];
+				if (std::isdigit(d))
+					d -= '0';
+				else if (hex && std::isxdigit(d))
+					d = std::tolower(d) - 'a' + 10;
+				else
+					break;
+				v = v * (hex ? 16 : 10) + d;
+				if (v >= M + 8)
+					fail("Number too big");
+			}
+			if (at == first)
+				fail("Expected a number");
+			emit(kind::number, v);
+		} else {
+			fail(std::string{"Unexpected '"} + c + "'");
+		}
+	}
+};
+
+}
+
+condition::condition(const std::string &source) : text(source) {
+	parser{text, terms}.parse();
+	// Operands push a value, binary operators pop one, and the rest
+	// replace the one on top.
+	std::size_t depth{0};
+	for (const term &t : terms) {
+		if (t.kind < term::deref)
+			depth += 1;
+		else if (t.kind >= term::or_)
+			depth -= 1;
+		if (depth > max_depth)
+			throw std::runtime_error{"Too deeply nested condition."};
+	}
+}
+
+bool condition::holds(const cpu_state &cpu, const paged_memory &mem) const {
+	std::array<std::uint32_t, max_depth> stack;
+	std::size_t sp{0};
+	for (const term &t : terms) {
+		std::uint32_t b{0};
+		if (t.kind >= term::or_)
+			b = stack[--sp];
+		std::uint32_t &a = stack[t.kind >= term::deref ? sp - 1 : sp++];
+		switch (t.kind) {
+		case term::number: a = t.value; break;
+		case term::reg: a = cpu.regs[t.value]; break;
+		case term::pc: a = cpu.pc; break;
+		case term::deref: a = mem[a & 0xFFFF]; break;
+		case term::negate: a = !a; break;
+		case term::or_: a = a || b; break;
+		case term::and_: a = a && b; break;
+		case term::eq: a = a == b; break;
+		case term::ne: a = a != b; break;
+		case term::lt: a = a < b; break;
+		case term::gt: a = a > b; break;
+		case term::le: a = a <= b; break;
+		case term::ge: a = a >= b; break;
+		case term::bitand_: a &= b; break;
+		case term::bitor_: a |= b; break;
+		case term::add: a += b; break;
+		case term::sub: a -= b; break;
+		case term::mul: a *= b; break;
+		case term::mod: a = b != 0 ? a % b : 0; break;
+		}
+	}
+	return stack[0] != 0;
+}
+
+const std::bitset<M> breakpoint_map::none;
+
+breakpoint_map::breakpoint_map(const breakpoint_map &other)
+	: count(other.count), conditions(other.conditions) {
+	if (other.owned) {
+		owned.reset(new std::bitset<M>{*other.owned});
+		bits = owned.get();
+	}
+}
+
+bool breakpoint_map::stops(numtype addr, const cpu_state &cpu,
+													 const paged_memory &mem) const {
+	for (const auto &c : conditions)
+		if (c.first == addr)
+			return c.second.holds(cpu, mem);
+	return true;
+}
+
+void breakpoint_map::set(numtype addr) {
+	clear(addr);
+	if (!owned) {
+		owned.reset(new std::bitset<M>{});
+		bits = owned.get();
+	}
+	owned->set(addr);
+	count += 1;
+}
+
+void breakpoint_map::set(numtype addr, const condition &cond) {
+	set(addr);
+	conditions.emplace_back(addr, cond);
+}
+
+void breakpoint_map::clear(numtype addr) {
+	if (!(*bits)[addr])
+		return;
+	owned->reset(addr);
+	count -= 1;
+	conditions.erase(std::remove_if(conditions.begin(), conditions.end(),
+		[addr](const std::pair<numtype, condition> &c) { return c.first == addr; }),
+		conditions.end());
+}
+
+std::vector<numtype> breakpoint_map::addresses(void) const {
+	std::vector<numtype> all;
+	for (numtype addr = 0; addr < M && all.size() < count; addr += 1)
+		if ((*bits)[addr])
+			all.push_back(addr);
+	return all;
+}
+
+const watch_list::masks watch_list::none;
+
+watch_list::watch_list(const watch_list &other) : ranges(other.ranges) {
+	if (other.owned) {
+		owned.reset(new masks{*other.owned});
+		bits = owned.get();
+	}
+}
+
+void watch_list::add(const range &r) {
+	ranges.push_back(r);
+	rebuild();
+}
+
+bool watch_list::remove(numtype addr) {
+	auto old = ranges.size();
+	ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+		[addr](const range &r) { return r.first <= addr && addr <= r.last; }),
+		ranges.end());
+	if (ranges.size() == old)
+		return false;
+	rebuild();
+	return true;
+}
+
+void watch_list::rebuild(void) {
+	if (!owned) {
+		owned.reset(new masks{});
+		bits = owned.get();
+	}
+	owned->read.reset();
+	owned->write.reset();
+	for (const range &r : ranges)
+		for (numtype addr = r.first; addr <= r.last && addr < M; addr += 1) {
+			if (r.read)
+				owned->read.set(addr);
+			if (r.write)
+				owned->write.set(addr);
+		}
+}
@@ -2,21 +2,40 @@
 use strict;
 use warnings;
 
-# Prints out PC, registers, stack from a saved state file.
+# Prints out PC, registers, stack, breakpoints and pending input from a
+# saved state file. Understands both binary snapshots and the old text
+# save states.
 
-my $pc = <>;
-chomp $pc;
-my @regs;
-for (my $i = 0; $i < 8; $i += 1) {
-	my $r = <>;
-	push @regs, $r;
+my $IN = \*STDIN;
+if (@ARGV) {
+	my $file = shift;
+	open $IN, "<", $file or die "Unable to open $file: $!\n";
 }
-my @stack;
-my $ssize = <>;
-for (my $i = 0; $i < $ssize; $i += 1) {
-	my $s = <>;
-	chomp $s;
-	unshift @stack, $s;
+binmode $IN;
+my $data = do { local $/; <$IN> };
+
+my ($pc, @regs, @stack, @breakpoints, $input);
+
+if (substr($data, 0, 8) eq "SYNSNAP\x1A") {
+	my ($magic, $version, $checksum, $hpc, @rest) =
+		unpack "a8 V V v v8 x2 V V V V", $data;
+	die "Unsupported snapshot version $version\n" if $version != 1;
+	$pc = $hpc;
+	@regs = @rest[0..7];
+	my ($memsize, $ssize, $bpcount, $insize) = @rest[8..11];
+	my $off = 64 + 2 * $memsize;
+	# Stack is stored bottom first; show the top first.
+	@stack = reverse unpack "v$ssize", substr($data, $off, 2 * $ssize);
+	$off += 2 * $ssize;
+	@breakpoints = unpack "v$bpcount", substr($data, $off, 2 * $bpcount);
+	$off += 2 * $bpcount;
+	$input = substr($data, $off, $insize);
+} else {
+	my @lines = split /\n/, $data;
+	$pc = shift @lines;
+	@regs = splice @lines, 0, 8;
+	my $ssize = shift @lines;
+	@stack = reverse splice @lines, 0, $ssize;
 }
 
 print "PC = $pc\nREGISTERS:\n";
@@ -24,3 +43,9 @@ for (my $i = 0; $i < 8; $i += 1) {
 	print " r$i = $regs[$i]";
 }
 print "\nStack: @stack\n";
+printf "Breakpoints: %s\n", join ' ', map { sprintf "%x", $_ } @breakpoints
+	if @breakpoints;
+if (defined $input && length $input) {
+	(my $shown = $input) =~ s/\n/\\n/g;
+	print "Pending input: $shown\n";
+}
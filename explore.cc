@@ -0,0 +1,432 @@
+/* State-space explorer for the Synacor Challenge VM. */
+
+
+/* Usage: vm-explore [-s -H -j THREADS -d DEPTH -m STATES -n COUNT -e ENGINE -w FILE -i RANGE -o FILE] IMGFILE
+*
+* Runs IMGFILE to its first prompt, then tries every command in a
+* vocabulary there, and at every prompt that leads to, breadth first, and
+* writes out the graph of the distinct states it found in Graphviz's dot
+* format. Each state is labelled with the first line the program printed
+* on getting there, and each edge with the command that did it. Commands
+* that change nothing at all aren't drawn.
+*
+* Every command is tried on a copy-on-write clone of the state it starts
+* from. Two ways of getting to the same memory, registers and stack are
+* the same state, and only explored once; image::state_hash() tells them
+* apart. The states found, and their numbering, don't depend on the
+* number of threads. Memory the program only uses as scratch, like where
+* it reads a command into, makes states that are the same in every way
+* that matters look different; -i leaves it out.
+*
+* A vocabulary file has one command per line. A * in one stands for each
+* item of the last list the program printed, which is every line that
+* starts with "- ", so "take *" tries to take everything in sight. The
+* default vocabulary is *, take *, use * and inv.
+*
+* Options: -s IMGFILE is a saved state from a previous session
+*          -H Run guest routines as they are, without native hooks.
+*          -j THREADS Number of worker threads. Defaults to one per core.
+*          -d DEPTH Don't try more than DEPTH commands in a row. Defaults to
+*             no limit.
+*          -m STATES Stop after finding STATES states. Defaults to 10000.
+*          -n COUNT Give up on a command after COUNT instructions.
+*             Defaults to 100000000.
+*          -e ENGINE Execution engine, as for vm. Defaults to threaded.
+*          -w FILE Read the vocabulary from FILE.
+*          -i RANGE Don't tell states apart by the words in RANGE, which is
+*             FIRST-LAST, or just one address. Can be given more than once.
+*          -o FILE Write the graph to FILE instead of standard output.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <utility>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "image.h"
+#include "snapshot.h"
+
+// A prompt the program stopped at, or where it ended up otherwise.
+struct state {
+	std::uint64_t hash;
+	run_status status;
+	unsigned depth;
+	std::string label;
+	// The items of the last list printed on the way here, for *.
+	std::vector<std::string> listed;
+	// Only kept while it's still to be explored.
+	std::unique_ptr<image> vm;
+};
+
+struct edge {
+	std::size_t from, to;
+	std::string command;
+};
+
+// One command tried at one state.
+struct attempt {
+	std::size_t from;
+	std::string command;
+	std::uint64_t hash{0};
+	run_status status{run_status::halted};
+	std::string output;
+	std::unique_ptr<image> vm;
+};
+
+// The first line of output with anything on it.
+static std::string first_line(const std::string &output) {
+	std::istringstream in(output);
+	std::string line;
+	while (std::getline(in, line))
+		if (line.find_first_not_of(" \t\r") != std::string::npos)
+			return line;
+	return "";
+}
+
+// Each line of output that starts with "- ", without that.
+static std::vector<std::string> list_items(const std::string &output) {
+	std::vector<std::string> items;
+	std::istringstream in(output);
+	std::string line;
+	while (std::getline(in, line))
+		if (line.compare(0, 2, "- ") == 0)
+			items.push_back(line.substr(2));
+	return items;
+}
+
+class explorer {
+public:
+	using range = std::pair<numtype, numtype>;
+
+	explorer(const std::vector<std::string> &vocabulary,
+					 const std::vector<range> &ignored, unsigned threads,
+					 std::uint64_t limit)
+		: vocabulary(vocabulary), ignored(ignored), threads(threads),
+			limit(limit) {}
+	// Explore from start, which has to be waiting at a prompt, having
+	// printed intro to get there.
+	void run(std::unique_ptr<image> start, const std::string &intro,
+					 unsigned max_depth, std::size_t max_states);
+	void write_dot(std::ostream &) const;
+	std::size_t size(void) const { return states.size(); }
+	// Commands tried, and whether any new states were left unexplored.
+	std::uint64_t tries(void) const { return tried; }
+	bool truncated(void) const { return cut_short; }
+
+private:
+	std::vector<std::string> vocabulary;
+	std::vector<range> ignored;
+	unsigned threads;
+	std::uint64_t limit;
+	std::vector<state> states;
+	std::vector<edge> edges;
+	std::unordered_map<std::uint64_t, std::size_t> ids;
+	std::uint64_t tried{0};
+	bool cut_short{false};
+
+	std::uint64_t hash(const image &) const;
+	std::vector<std::string> commands(const state &) const;
+	void try_command(attempt &) const;
+	std::size_t add(attempt &, unsigned depth, std::size_t max_states);
+};
+
+// The state's hash, less the ignored words' share of it.
+std::uint64_t explorer::hash(const image &vm) const {
+	std::uint64_t h{vm.state_hash()};
+	for (const auto &r : ignored)
+		for (numtype addr = r.first; addr <= r.second; addr += 1)
+			h ^= paged_memory::key(addr, vm.peek(addr));
+	return h;
+}
+
+// The vocabulary, with each * filled in.
+std::vector<std::string> explorer::commands(const state &s) const {
+	std::vector<std::string> out;
+	for (const auto &word : vocabulary) {
+		auto star = word.find('*');
+		if (star == std::string::npos) {
+			out.push_back(word);
+			continue;
+		}
+		for (const auto &item : s.listed)
+			out.push_back(word.substr(0, star) + item + word.substr(star + 1));
+	}
+	return out;
+}
+
+void explorer::try_command(attempt &a) const {
+	a.vm.reset(new image{*states[a.from].vm});
+	memory_sink printed;
+	a.vm->set_output(printed);
+	a.vm->feed(a.command + '\n');
+	try {
+		a.status = a.vm->run_for(limit);
+	} catch (std::exception &) {
+		// Whatever the program did to get an error, it's as far as it goes.
+		a.status = run_status::halted;
+	}
+	a.vm->set_output(terminal_sink::instance());
+	a.hash = hash(*a.vm);
+	a.output = printed.str();
+	// Nothing writes to ids while commands are being tried, so it can be
+	// read without a lock. A state that's been seen before doesn't need
+	// its clone.
+	if (ids.count(a.hash) || a.status != run_status::needs_input)
+		a.vm.reset();
+}
+
+// The number of the state a led to, adding it if it's new. Returns
+// states.size() if it's new and there isn't room.
+std::size_t explorer::add(attempt &a, unsigned depth, std::size_t max_states) {
+	auto found = ids.find(a.hash);
+	if (found != ids.end())
+		return found->second;
+	if (states.size() >= max_states) {
+		cut_short = true;
+		return states.size();
+	}
+	state s;
+	s.hash = a.hash;
+	s.status = a.status;
+	s.depth = depth;
+	s.label = first_line(a.output);
+	s.listed = list_items(a.output);
+	if (s.listed.empty())
+		s.listed = states[a.from].listed;
+	s.vm = std::move(a.vm);
+	ids.emplace(s.hash, states.size());
+	states.push_back(std::move(s));
+	return states.size() - 1;
+}
+
+void explorer::run(std::unique_ptr<image> start, const std::string &intro,
+									 unsigned max_depth, std::size_t max_states) {
+	state first;
+	first.hash = hash(*start);
+	first.status = run_status::needs_input;
+	first.depth = 0;
+	first.label = first_line(intro);
+	first.listed = list_items(intro);
+	first.vm = std::move(start);
+	ids.emplace(first.hash, 0);
+	states.push_back(std::move(first));
+
+	// A step at a time: every command at every state found in the last
+	// step, tried in parallel, then the results gone through in order, so
+	// that which thread got to what first doesn't matter.
+	std::size_t begin{0}, end{1};
+	for (unsigned depth = 0; begin < end && depth < max_depth; depth += 1) {
+		std::vector<attempt> attempts;
+		for (std::size_t i = begin; i < end; i += 1)
+			if (states[i].vm)
+				for (auto &c : commands(states[i])) {
+					attempts.emplace_back();
+					attempts.back().from = i;
+					attempts.back().command = std::move(c);
+				}
+
+		std::atomic<std::size_t> next{0};
+		auto work = [this, &attempts, &next](void) {
+			std::size_t k;
+			while ((k = next.fetch_add(1, std::memory_order_relaxed)) < attempts.size())
+				try_command(attempts[k]);
+		};
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < threads && t < attempts.size(); t += 1)
+			pool.emplace_back(work);
+		work();
+		for (auto &t : pool)
+			t.join();
+		tried += attempts.size();
+
+		for (auto &a : attempts) {
+			std::size_t to = add(a, depth + 1, max_states);
+			if (to < states.size() && to != a.from)
+				edges.push_back(edge{a.from, to, a.command});
+		}
+		for (std::size_t i = begin; i < end; i += 1)
+			states[i].vm.reset();
+		begin = end;
+		end = states.size();
+	}
+	if (begin < end)
+		cut_short = true;
+	for (auto &s : states)
+		s.vm.reset();
+}
+
+static std::string quoted(const std::string &s) {
+	std::string out{"\""};
+	for (char c : s) {
+		if (c == '"' || c == '\\')
+			out += '\\';
+		out += c;
+	}
+	return out + '"';
+}
+
+void explorer::write_dot(std::ostream &out) const {
+	out << "digraph states {\n";
+	for (std::size_t i = 0; i < states.size(); i += 1) {
+		const state &s = states[i];
+		std::string label{std::to_string(i) + ": " + s.label};
+		out << "\ts" << i << " [label=" << quoted(label);
+		if (s.status == run_status::halted)
+			out << ", shape=box";
+		else if (s.status == run_status::budget_exhausted)
+			out << ", shape=box, style=dashed";
+		out << "];\n";
+	}
+	for (const auto &e : edges)
+		out << "\ts" << e.from << " -> s" << e.to << " [label="
+				<< quoted(e.command) << "];\n";
+	out << "}\n";
+}
+
+int main(int argc, char **argv) {
+	bool saved{false};
+	bool natives{true};
+	unsigned threads{std::thread::hardware_concurrency()};
+	unsigned depth{~0U};
+	std::size_t max_states{10000};
+	std::uint64_t limit{100000000};
+	engine eng{engine::threaded};
+	std::string wordfile, outfile;
+	std::vector<explorer::range> ignored;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i += 1) {
+		if (std::strcmp(argv[i], "-s") == 0)
+			saved = true;
+		else if (std::strcmp(argv[i], "-H") == 0)
+			natives = false;
+		else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			depth = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			max_states = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			limit = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			wordfile = argv[++i];
+		else if (std::strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			char *end;
+			numtype first = std::strtoul(argv[++i], &end, 0), last{first};
+			if (*end == '-')
+				last = std::strtoul(end + 1, &end, 0);
+			if (*end != '\0' || last < first || !is_number(last)) {
+				std::cerr << "Bad range '" << argv[i] << "'.\n";
+				return 1;
+			}
+			ignored.emplace_back(first, last);
+		} else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outfile = argv[++i];
+		else if (std::strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			i += 1;
+			if (std::strcmp(argv[i], "threaded") == 0)
+				eng = engine::threaded;
+			else if (std::strcmp(argv[i], "decoded") == 0)
+				eng = engine::decoded;
+			else if (std::strcmp(argv[i], "jit") == 0)
+				eng = engine::jit;
+			else if (std::strcmp(argv[i], "table") == 0)
+				eng = engine::table;
+			else {
+				std::cerr << "Unknown engine '" << argv[i] << "'.\n";
+				return 1;
+			}
+		} else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+	if (argc - i != 1) {
+		std::cerr << "Usage: " << argv[0]
+							<< " [-s -H -j THREADS -d DEPTH -m STATES -n COUNT -e ENGINE -w FILE -i RANGE -o FILE] IMGFILE\n";
+		return 1;
+	}
+	if (threads == 0)
+		threads = 1;
+
+	std::vector<std::string> vocabulary;
+	if (wordfile.empty()) {
+		vocabulary = {"*", "take *", "use *", "inv"};
+	} else {
+		std::ifstream words(wordfile);
+		if (!words.is_open()) {
+			std::cerr << "Unable to open " << wordfile << ".\n";
+			return 1;
+		}
+		std::string line;
+		while (std::getline(words, line))
+			if (!line.empty())
+				vocabulary.push_back(line);
+	}
+
+	std::string filename{argv[i]};
+	std::unique_ptr<image> base;
+	try {
+		if (saved && snapshot::is_snapshot(filename)) {
+			snapshot snap{filename};
+			base.reset(new image{snap, true});
+		} else if (saved) {
+			std::ifstream input(filename, std::ifstream::in | std::ifstream::binary);
+			if (!input.is_open())
+				throw std::runtime_error{"Unable to open " + filename + " for reading."};
+			base.reset(new image{input, true, true});
+		} else {
+			base.reset(new image{filename, true});
+		}
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+	base->set_engine(eng);
+	if (natives)
+		add_builtin_natives(*base);
+	base->set_hashing(true);
+
+	memory_sink intro;
+	base->set_output(intro);
+	run_status status;
+	try {
+		status = base->run_for(limit);
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+	base->set_output(terminal_sink::instance());
+	if (status != run_status::needs_input) {
+		std::cerr << "The program never asks for input.\n";
+		return 1;
+	}
+
+	explorer x{vocabulary, ignored, threads, limit};
+	x.run(std::move(base), intro.str(), depth, max_states);
+
+	if (outfile.empty()) {
+		x.write_dot(std::cout);
+	} else {
+		std::ofstream out(outfile);
+		if (!out.is_open()) {
+			std::cerr << "Unable to open " << outfile << " for writing.\n";
+			return 1;
+		}
+		x.write_dot(out);
+	}
+	std::cerr << "Found " << x.size() << " states with " << x.tries()
+						<< " commands" << (x.truncated() ? ", and stopped short" : "")
+						<< ".\n";
+	return 0;
+}
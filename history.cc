@@ -0,0 +1,143 @@
+#include <string>
+#include <limits>
+#include <cstdint>
+
+#include "image.h"
+#include "history.h"
+
+constexpr std::uint64_t history::interval;
+
+history::history(std::size_t limit, std::uint64_t icount, numtype pc)
+	: max_bytes(limit) {
+	checkpoints.push_back({icount, pc, 0, 0});
+}
+
+void history::mark(std::uint64_t icount, numtype pc) {
+	checkpoints.push_back({icount, pc, changes_dropped + changes.size(),
+		input_dropped + input.size()});
+	while (bytes() > max_bytes && checkpoints.size() > 1) {
+		checkpoints.pop_front();
+		const checkpoint &c = checkpoints.front();
+		changes.erase(changes.begin(),
+			changes.begin() + (c.journal - changes_dropped));
+		changes_dropped = c.journal;
+		input.erase(0, c.input - input_dropped);
+		input_dropped = c.input;
+	}
+}
+
+std::size_t history::before(std::uint64_t icount) const {
+	auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), icount,
+		[](std::uint64_t n, const checkpoint &c) { return n < c.icount; });
+	return after - checkpoints.begin() - 1;
+}
+
+void image::history_deleter::operator()(history *h) const {
+	delete h;
+}
+
+void image::set_history(std::size_t bytes) {
+	if (bytes > 0)
+		hist.reset(new history{bytes, cpu.icount, cpu.pc});
+	else
+		hist.reset();
+}
+
+// The debugger changed something behind the journal's back, so the
+// history up to now can't be replayed any more.
+void image::forget_history(void) {
+	if (hist)
+		set_history(hist->limit());
+}
+
+// Undo everything since checkpoint i.
+void image::undo_to(std::size_t i) {
+	std::string unread{hist->back_to(i, [this](const history::change &c) {
+		switch (c.what) {
+		case history::memory:
+			overwrite(c.where, c.old);
+			break;
+		case history::reg:
+			cpu.regs[c.where] = c.old;
+			break;
+		case history::push:
+			s.pop();
+			break;
+		case history::pop:
+			s.push(c.old);
+			break;
+		}
+	})};
+	if (!unread.empty()) {
+		input_owned = unread + std::string(input_pos, input_end);
+		input_pos = input_owned.data();
+		input_end = input_pos + input_owned.size();
+	}
+	const history::checkpoint &c = hist->at(i);
+	cpu.pc = c.pc;
+	cpu.icount = c.icount;
+	halted = waiting = false;
+}
+
+// Run forward to instruction target again, recording as usual but with
+// output thrown away and nothing stopping it. With stop, also notes the
+// last place before the end where a breakpoint or watchpoint would have
+// stopped it in *stop.
+void image::replay(std::uint64_t target, std::uint64_t end,
+									 std::uint64_t *stop) {
+	null_sink quiet;
+	struct restore {
+		output_buffer &out;
+		output_sink &sink;
+		~restore() { out.set_sink(sink); }
+	} restore_output{output, output.get_sink()};
+	output.set_sink(quiet);
+
+	watched.hit = false;
+	while (cpu.icount < target && cpu.pc < M && !halted) {
+		if (hist->due(cpu.icount))
+			hist->mark(cpu.icount, cpu.pc);
+		if (stop && breakpoints.at(cpu.pc) &&
+				breakpoints.stops(cpu.pc, cpu, mem))
+			*stop = cpu.icount;
+		step();
+		// Everything it read the first time round was put back, so this
+		// shouldn't happen.
+		if (waiting) {
+			waiting = false;
+			break;
+		}
+		cpu.icount += 1;
+		if (watched.hit) {
+			watched.hit = false;
+			if (stop && cpu.icount < end)
+				*stop = cpu.icount;
+		}
+	}
+}
+
+void image::rewind(std::uint64_t target) {
+	undo_to(hist->before(target));
+	replay(target, target, nullptr);
+	paused = true;
+}
+
+// Look back a checkpoint at a time for somewhere the debugger would have
+// stopped, and go back to the latest one.
+bool image::reverse_continue(void) {
+	const std::uint64_t none{std::numeric_limits<std::uint64_t>::max()};
+	std::uint64_t now{cpu.icount}, end{now};
+	while (end > hist->oldest()) {
+		std::size_t i{hist->before(end - 1)};
+		std::uint64_t start{hist->at(i).icount}, stop{none};
+		undo_to(i);
+		replay(end, now, &stop);
+		if (stop != none) {
+			rewind(stop);
+			return true;
+		}
+		end = start;
+	}
+	rewind(end);
+	return false;
+}
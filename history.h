@@ -0,0 +1,106 @@
+/* Where a program has been, so the debugger can go back there.
+ *
+ * While the debugger is recording, every change an instruction makes is
+ * journaled along with the value it replaced: writes to memory and
+ * registers, and pushes and pops. Every interval instructions a
+ * checkpoint notes the pc, the instruction count, and how far along the
+ * journal and the input read so far were. That's all a checkpoint is;
+ * memory, registers and the stack come back by undoing the journal.
+ *
+ * Going back to instruction T undoes the journal to the last checkpoint
+ * at or before T, and runs forward from there to T again with output
+ * thrown away. That costs time in proportion to how far back T is (Plus
+ * at most an interval), never to the size of memory or the stack. The
+ * input read since is put back in front of whatever hasn't been read yet,
+ * so running forward again reads the same thing. What came after T is
+ * forgotten, and recorded again as it runs forward.
+ *
+ * The journal is kept under a size limit by dropping the oldest
+ * checkpoint, and everything before the next one, when a new checkpoint
+ * takes it over.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include "image.h"
+
+class history {
+public:
+	enum kind : std::uint8_t { memory, reg, push, pop };
+	struct change {
+		kind what;
+		// The address, or register number. Nothing for a push.
+		std::uint16_t where;
+		// What was there before, or what was popped.
+		numtype old;
+	};
+	struct checkpoint {
+		std::uint64_t icount;
+		numtype pc;
+		// Where the journal and input were up to, counting everything
+		// that's been dropped.
+		std::uint64_t journal, input;
+	};
+	static constexpr std::uint64_t interval = 4096;
+
+	// Keep about limit bytes of history, starting at instruction icount
+	// with the pc at pc.
+	history(std::size_t limit, std::uint64_t icount, numtype pc);
+
+	void record(kind what, numtype where, numtype old) {
+		changes.push_back({what, static_cast<std::uint16_t>(where), old});
+	}
+	void read(char c) { input.push_back(c); }
+	bool due(std::uint64_t icount) const {
+		return icount - checkpoints.back().icount >= interval;
+	}
+	// Take a checkpoint, and drop old ones if that takes it over the limit.
+	void mark(std::uint64_t icount, numtype pc);
+
+	// The latest checkpoint at or before icount, which shouldn't be before
+	// oldest().
+	std::size_t before(std::uint64_t icount) const;
+	const checkpoint &at(std::size_t i) const { return checkpoints[i]; }
+	std::uint64_t oldest(void) const { return checkpoints.front().icount; }
+	std::size_t limit(void) const { return max_bytes; }
+	std::size_t bytes(void) const {
+		return changes.size() * sizeof(change) + input.size() +
+			checkpoints.size() * sizeof(checkpoint);
+	}
+
+	// Take back everything after checkpoint i, newest first, handing each
+	// change to undo. Returns the input read since then. Checkpoints after
+	// i are dropped.
+	template <typename F>
+	std::string back_to(std::size_t i, F undo);
+
+private:
+	std::size_t max_bytes;
+	std::deque<change> changes;
+	std::string input;
+	// How much of each has been dropped off the front.
+	std::uint64_t changes_dropped{0}, input_dropped{0};
+	std::deque<checkpoint> checkpoints;
+};
+
+template <typename F>
+std::string history::back_to(std::size_t i, F undo) {
+	const checkpoint &c = checkpoints[i];
+	while (changes_dropped + changes.size() > c.journal) {
+		undo(changes.back());
+		changes.pop_back();
+	}
+	std::string unread{input.substr(c.input - input_dropped)};
+	input.resize(c.input - input_dropped);
+	checkpoints.resize(i + 1);
+	return unread;
+}
+
+#endif
@@ -0,0 +1,1031 @@
+/* Normally, when I write an interpeter for a small bytecode language, I
+ * use a big switch statement to dispatch, one case per opcode. This time
+ * I decided to try something slightly different, though, and use an array
+ * of functions, with index corresponding to the opcode. C++11 lambdas make
+ * defining this array all happen in one spot, and ends up visually looking
+ * a lot like the classic switch. The actual execution of the program turns
+ * into two lines of while loop and function call.
+ *
+ * Possible other directions, for fun and profit: threaded code turning it
+ * into an array of functions, and JIT compiling a program to native code.
+ *
+ * The first of those is run_threaded(): direct threaded dispatch using
+ * g++'s computed goto extension, with one indirect jump per instruction
+ * and the program counter and registers held in local variables instead
+ * of going through the std::function table. Compilers without labels as
+ * values get a plain switch instead. Pick it with -e threaded. It's a
+ * template on a policy saying whether to check operands, how wide to keep
+ * registers, and whether to trace, stop at breakpoints or profile, and
+ * run_for() picks a build, so none of what's off costs anything.
+ *
+ * run_decoded() goes a step further and caches each instruction the first
+ * time it's executed, with operands resolved to pointers at either a
+ * register or a literal, so the hot loop never looks at the raw words or
+ * decides register-vs-number again. The program modifies itself, so
+ * store() throws away any cached instruction that overlaps a write.
+ *
+ * And finally, run_jit() translates hot basic blocks to x86-64 machine
+ * code, with the eight registers living in r8-r15 for as long as the
+ * program stays in compiled code. Blocks jump directly to each other, and
+ * ret and computed jumps go through a table of compiled entry points.
+ * in, out and halt are left to the interpreter, as is anything that
+ * writes over compiled code.
+ *
+ * Every engine is driven through run_for(), which executes up to a given
+ * number of instructions and returns saying why it stopped: the program
+ * halted, it's waiting on input that nobody has fed it yet, or it used up
+ * its budget. None of that goes through exceptions, and where the input
+ * comes from is up to the caller. main() in vm.cc is a loop around it.
+ */
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <vector>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/endian/conversion.hpp>
+
+#include "image.h"
+#include "profile.h"
+#include "history.h"
+
+constexpr unsigned paged_memory::page_bits;
+constexpr paged_memory::size_type paged_memory::page_words;
+constexpr paged_memory::size_type paged_memory::page_count;
+
+paged_memory::paged_memory() {
+	static const std::shared_ptr<page> zeros = std::make_shared<page>(page{});
+	owners.fill(zeros);
+	table.fill(zeros->w.data());
+}
+
+paged_memory::size_type paged_memory::used(void) const {
+	for (size_type addr = M; addr > 0; addr -= 1)
+		if ((*this)[addr - 1] != 0)
+			return addr;
+	return 0;
+}
+
+void paged_memory::adopt(const std::shared_ptr<void> &keep, word *first,
+												 size_type n) {
+	bool was_hashing{hashing};
+	*this = paged_memory{};
+	size_type p{0};
+	for (; n >= page_words; p += 1, n -= page_words, first += page_words) {
+		owners[p] = std::shared_ptr<page>(keep, reinterpret_cast<page *>(first));
+		table[p] = first;
+	}
+	if (n > 0) {
+		unshare(p);
+		std::copy(first, first + n, table[p]);
+	}
+	set_hashing(was_hashing);
+}
+
+// Zeros don't count, so only the words that aren't take any work.
+std::uint64_t paged_memory::rehash(void) const {
+	std::uint64_t h{0};
+	for (size_type addr = 0; addr < page_count * page_words; addr += 1)
+		h ^= key(addr, (*this)[addr]);
+	return h;
+}
+
+// Give page p an owner of its own before writing to it.
+void paged_memory::unshare(size_type p) {
+	std::shared_ptr<page> copy = std::make_shared<page>(*owners[p]);
+	table[p] = copy->w.data();
+	owners[p] = std::move(copy);
+}
+
+// Convert a numtype to a number, or return the value
+// in a register if numtype refers to one.
+numtype image::val(numtype n) {
+#ifdef UNSAFE
+	if (is_number(n))
+		return n;
+	else
+		return cpu.regs[to_register(n)];
+#else
+	if (is_number(n))
+		return n;
+	else if (is_register(n))
+		return cpu.regs[to_register(n)];
+	else
+		throw std::runtime_error{"Invalid number."};
+#endif
+}
+
+// Return the value stored in a memory location
+numtype image::load(numtype addr) {
+#ifndef UNSAFE
+	if (!is_number(addr))
+		throw std::runtime_error("Trying to load from an invalid address.");
+#endif
+	if (watches.any() && watches.reads(addr))
+		watched = {true, false, addr, mem[addr], mem[addr]};
+	return mem[addr];
+}
+
+// Write a value to a memory location.
+void image::store(numtype addr, numtype v) {
+#ifndef UNSAFE
+	if (!is_number(addr))
+		throw std::runtime_error("Trying to store in an invalid address.");
+#endif
+	if (watches.any() && watches.writes(addr))
+		watched = {true, true, addr, mem[addr], v};
+	if (mem[addr] != v) {
+		if (hist)
+			hist->record(history::memory, addr, mem[addr]);
+		overwrite(addr, v);
+	}
+}
+
+void image::overwrite(numtype addr, numtype v) {
+	if (!dcache.empty())
+		invalidate(addr);
+	if (jit)
+		jit_invalidate(addr);
+	mem.set(addr, v);
+}
+
+// Forget any cached decoded instruction that includes the word at addr.
+// Instructions are at most 4 words long, so only the entries starting at
+// addr and the three before it need checking. Only addresses below M are
+// cached, though memory goes up to 65535.
+void image::invalidate(numtype addr) {
+	numtype first = addr > 3 ? addr - 3 : 0;
+	numtype last = std::min(addr, M - 1);
+	for (numtype a = first; a <= last; a += 1) {
+		decoded &d = dcache[a];
+		if (d.op != decoded::empty && a + d.len > addr) {
+			d.op = decoded::empty;
+			d.handler = decode_handler;
+			invalidations += 1;
+		}
+	}
+}
+
+// Decode the instruction at addr into the cache.
+image::decoded &image::decode(numtype addr) {
+	decoded &d = dcache[addr];
+	numtype op = load(addr);
+	decodes += 1;
+	if (op >= oplen.size()) {
+		d.op = decoded::invalid;
+		d.len = 1;
+		return d;
+	}
+	d.op = op;
+	d.len = oplen[op];
+	for (int i = 0; i < d.len - 1; i += 1) {
+		numtype w = load(addr + 1 + i);
+		if (is_number(w)) {
+			d.lit[i] = w;
+			d.arg[i] = &d.lit[i];
+		} else if (is_register(w)) {
+			d.arg[i] = &cpu.regs[to_register(w)];
+		} else {
+			d.op = decoded::invalid;
+		}
+	}
+	if (writes_register(op) && d.arg[0] == &d.lit[0])
+		d.op = decoded::invalid;
+	return d;
+}
+
+// Write val to the encoded register r
+void image::regstore(numtype r, numtype val) {
+	if (hist)
+		hist->record(history::reg, to_register(r), cpu.regs[to_register(r)]);
+#ifdef UNSAFE
+	cpu.regs[to_register(r)] = val;
+#else
+	if (is_register(r))
+		cpu.regs[to_register(r)] = val;
+	else 
+		throw std::runtime_error("not a register");
+#endif
+}
+
+void image::push(numtype w) {
+	if (hist)
+		hist->record(history::push, 0, 0);
+	s.push(w);
+}
+
+// Pop the stack, which mustn't be empty.
+void image::pop(void) {
+	if (hist)
+		hist->record(history::pop, 0, s.top());
+	s.pop();
+}
+
+// Memory's share comes from paged_memory. The registers
+// and pc live wherever the engine running has them, which store() never
+// sees, so they're hashed here along with the stack, which is short.
+std::uint64_t image::state_hash(void) const {
+	std::uint64_t h{mem.hash()};
+	h ^= mix64(std::uint64_t{1} << 48 | std::uint64_t{halted} << 32 | cpu.pc);
+	for (int i = 0; i < 8; i += 1)
+		h ^= mix64(std::uint64_t{2} << 48 | std::uint64_t(i) << 32 | cpu.regs[i]);
+	std::uint64_t stack{s.size()};
+	for (numtype w : s)
+		stack = mix64(stack ^ w);
+	return h ^ mix64(std::uint64_t{3} << 48 ^ stack);
+}
+
+// Load image from a file. With dump set, it starts with a text save state
+// from older versions; see snapshot.cc for the current format.
+image::image(std::istream &in, bool dump, bool quiet)
+	: debug(false), stepping(false) {
+	if (!quiet)
+		std::cout << "Reading program..." << std::flush;
+
+	if (dump) { // Load saved state information at start of image
+		in >> cpu.pc;
+		for (int i = 0; i < 8; i += 1)
+			in >> cpu.regs[i];
+		stack::size_type ssize;
+		in >> ssize;
+		for (stack::size_type i = 0; i < ssize; i += 1) {
+			numtype n;
+			in >> n;
+			s.push(n);
+		}
+		while (in.peek() != '~')
+			in.get();
+		in.get();
+	}
+
+	// Everything left is the program. Its size is checked up front, and
+	// it's converted in one go.
+	std::vector<char> raw;
+	do {
+		std::size_t had{raw.size()};
+		raw.resize(had + 65536);
+		in.read(raw.data() + had, 65536);
+		raw.resize(had + in.gcount());
+	} while (in.good() && raw.size() <= 2 * M);
+	if (raw.size() % 2 != 0)
+		throw std::runtime_error{"Unable to read full word from input file."};
+	memory::size_type at{raw.size() / 2};
+	if (at > M)
+		throw std::runtime_error{"Program is too big."};
+	std::vector<memory::word> words(at);
+	std::memcpy(words.data(), raw.data(), raw.size());
+	for (auto &w : words)
+		boost::endian::little_to_native_inplace(w);
+	mem.assign(words.begin(), words.end());
+	if (!quiet)
+		std::cout << " done. Read " << at << " words.\n";
+}
+
+
+image::image(const image &other)
+	: cpu(other.cpu), mem(other.mem), s(other.s),
+		debug(other.debug), stepping(other.stepping),
+		breakpoints(other.breakpoints), watches(other.watches),
+		natives(other.natives),
+		input_pos(other.input_pos),
+		input_end(other.input_end), input_owned(other.input_owned),
+		output(other.output), eng(other.eng), checked(other.checked),
+		narrow(other.narrow), halted(other.halted),
+		waiting(other.waiting), paused(other.paused) {
+	// Input that other owns has to be read from the copy of it.
+	const char *owned = other.input_owned.data();
+	if (input_pos >= owned && input_pos <= owned + other.input_owned.size()) {
+		input_pos = input_owned.data() + (other.input_pos - owned);
+		input_end = input_owned.data() + input_owned.size();
+	}
+}
+
+// Return the next char from the input buffer, which mustn't be empty.
+char image::next_char(void) {
+	if (hist)
+		hist->read(*input_pos);
+	return *input_pos++;
+}
+
+void image::feed(const std::string &chars) {
+	input_owned.assign(input_pos, input_end);
+	input_owned += chars;
+	input_pos = input_owned.data();
+	input_end = input_pos + input_owned.size();
+}
+
+void image::feed_view(const char *p, std::size_t n) {
+	if (input_pos != input_end) {
+		feed(std::string(p, n));
+		return;
+	}
+	input_owned.clear();
+	input_pos = p;
+	input_end = p + n;
+}
+
+bool image::debugger(const std::string &cmdstr) {
+	std::istringstream cmdstream{cmdstr};
+	std::string cmd, arg;
+	// Should clean this up instead of having one big chain of if/else
+	cmdstream >> cmd;
+	if (cmd == "c") {
+		// c: continue execution until next breakpoint, stop stepping.
+		stepping = false;
+		return false;
+	} else if (cmd == "n") {
+		// n: continue to next instruction.
+		return false;
+	} else if (cmd == "step") {
+		// step (on|off): turn on or off instruction level stepping
+		cmdstream >> arg;
+		stepping = arg == "on";
+		std::cout << "DEBUG: stepping " << (stepping ? "on\n" : "off\n");
+	} else if (cmd == "quit") {
+		std::cout << "DEBUG: Quitting.\n";
+		halted = true;
+		return false;
+	} else if (cmd == "dump") {
+		// dump filename: Dump state to a file.
+		cmdstream >> arg;
+		std::cout << "DEBUG: Dumping state to " << arg << '\n';
+		dump(arg);
+	} else if (cmd == "showr" || cmd == "showx") {
+		// showr N: Show a single register.
+		bool wanthex = cmd == "showx";
+		int r;
+		cmdstream >> r;
+		std::cout << "DEBUG: Register r" << r << " = ";
+		if (wanthex)
+			std::cout << std::hex;
+		std::cout << cpu.regs[r] << std::dec << '\n';
+	} else if (cmd == "showallr" || cmd == "showallx") {
+		// showallr: Show all 8 registers
+		std::cout << "DEBUG: Registers: ";
+		for (int i = 0; i < 8; i += 1) 
+			std::cout << 'r' << i << " = " << (cmd == "showallx" ? std::hex : std::dec)
+				<< cpu.regs[i] << std::dec << ' ';
+		std::cout << '\n';
+	} else if (cmd == "setr" || cmd == "setx") {
+		// setr N V: Set a register to a new base-10 value.
+		// setx N V: Set a register to a new base-16 value.
+		int r;
+		numtype val;
+		cmdstream >> r >> (cmd == "setr" ? std::dec : std::hex) >> val;
+		std::cout << "DEBUG: Setting register r" << r << " = " << std::hex << val
+			<< std::dec << '\n';
+		cpu.regs[r] = val;
+		forget_history();
+	} else if (cmd == "showpc" || cmd == "showpcx") {
+		// showpc: Show the program counter in base 10 or 16.
+		if (cmd == "showpcx")
+			std::cout << std::hex;
+		std::cout << "DEBUG: pc=" << cpu.pc << std::dec << '\n';
+	} else if (cmd == "setpc") {
+		// setpc A: Set the program counter to a new base-16 value
+		numtype addr;
+		cmdstream >> std::hex >> addr;
+		std::cout << "DEBUG: Setting program counter.\n";
+		cpu.pc = addr;
+		forget_history();
+	} else if (cmd == "break") {
+		// break A: Set a breakpoint at base-16 address.
+		// break A if EXPR: Only stop there when EXPR is true. See condition
+		// in image.h for what EXPR can be.
+		numtype addr;
+		if (!(cmdstream >> std::hex >> addr) || addr >= M) {
+			std::cout << "DEBUG: Bad address.\n";
+			return true;
+		}
+		std::string cond;
+		if (cmdstream >> arg) {
+			if (arg != "if") {
+				std::cout << "DEBUG: Expected 'if'.\n";
+				return true;
+			}
+			std::getline(cmdstream, cond);
+			try {
+				breakpoints.set(addr, condition{cond});
+			} catch (std::runtime_error &e) {
+				std::cout << "DEBUG: " << e.what() << '\n';
+				return true;
+			}
+			std::cout << "DEBUG: Setting conditional breakpoint.\n";
+		} else {
+			std::cout << "DEBUG: Setting breakpoint.\n";
+			breakpoints.set(addr);
+		}
+	} else if (cmd == "unbreak") {
+		// unbreak A: Clear a breakpoint.
+		numtype addr;
+		cmdstream >> std::hex >> addr;
+		std::cout << "DEBUG: Clearing breakpoint.\n";
+		if (addr < M)
+			breakpoints.clear(addr);
+	} else if (cmd == "watch" || cmd == "rwatch" || cmd == "awatch") {
+		// watch A [B]: Stop after writes to base-16 addresses A to B.
+		// rwatch A [B]: The same for reads, by rmem.
+		// awatch A [B]: Both.
+		watch_list::range r;
+		if (!(cmdstream >> std::hex >> r.first) || r.first >= M) {
+			std::cout << "DEBUG: Bad address.\n";
+			return true;
+		}
+		if (!(cmdstream >> r.last))
+			r.last = r.first;
+		if (r.last < r.first || r.last >= M) {
+			std::cout << "DEBUG: Bad address.\n";
+			return true;
+		}
+		r.read = cmd != "watch";
+		r.write = cmd != "rwatch";
+		watches.add(r);
+		std::cout << "DEBUG: Setting watchpoint.\n";
+	} else if (cmd == "unwatch") {
+		// unwatch A: Clear every watchpoint with base-16 address A in it.
+		numtype addr;
+		cmdstream >> std::hex >> addr;
+		if (watches.remove(addr))
+			std::cout << "DEBUG: Clearing watchpoint.\n";
+		else
+			std::cout << "DEBUG: No watchpoint there.\n";
+	} else if (cmd == "breaks") {
+		// breaks: List breakpoints and watchpoints.
+		std::cout << "DEBUG: Breakpoints:" << std::hex;
+		for (auto addr : breakpoints.addresses())
+			std::cout << ' ' << addr;
+		std::cout << '\n';
+		for (const auto &c : breakpoints.conditional())
+			std::cout << "DEBUG: " << c.first << " if" << c.second.str() << '\n';
+		for (const auto &r : watches.list())
+			std::cout << "DEBUG: Watching " << r.first << '-' << r.last
+								<< (r.read && r.write ? " for access\n" :
+										r.read ? " for reads\n" : " for writes\n");
+		std::cout << std::dec;
+	} else if (cmd == "showmem" || cmd == "showmemx") {
+		// showmemx A: Show the word at base-16 address.
+		numtype addr;
+		cmdstream >> std::hex >> addr;
+		std::cout << "DEBUG: Value at address " << std::hex << addr << ": ";
+		if (cmd == "showmemx")
+			std::cout << std::hex;
+		std::cout << mem[addr] << std::dec << '\n';
+	} else if (cmd == "stack" || cmd == "stackx") {
+		stack s2;
+		std::cout << "DEBUG: Stack:";
+		if (cmd == "stackx")
+			std::cout << std::hex;
+		while (!s.empty()) {
+			s2.push(s.top());
+			s.pop();
+			std::cout << ' ' << s2.top();
+		}
+		while (!s2.empty()) {
+			s.push(s2.top());
+			s2.pop();
+		}
+		std::cout << std::dec << '\n';
+	} else if (cmd == "push" || cmd == "pushx") {
+		// push V: push base-10 or base-16 value onto stack
+		numtype val;
+		if (cmd == "pushx")
+			cmdstream >> std::hex;
+		cmdstream >> val;
+		std::cout << "DEBUG: Pushing " << std::hex << val << std::dec << " onto the stack.\n";
+		s.push(val);
+		forget_history();
+	} else if (cmd == "pop") {
+		// pop: pop value off the stack
+		std::cout << "DEBUG: Popping " << std::hex << s.top() << std::dec << " off of the stack.\n";
+		s.pop();
+		forget_history();
+	} else if (cmd == "record") {
+		// record MB: Record up to MB megabytes of history for going
+		// backwards with rstep and rc. Starts afresh from here.
+		// record off: Stop recording, and forget the history.
+		unsigned long mb;
+		if (cmdstream >> arg && arg == "off") {
+			set_history(0);
+			std::cout << "DEBUG: Recording off.\n";
+		} else if (std::istringstream{arg} >> mb && mb > 0) {
+			set_history(mb << 20);
+			std::cout << "DEBUG: Recording.\n";
+		} else {
+			std::cout << "DEBUG: Bad size.\n";
+		}
+	} else if (cmd == "rstep" || cmd == "rc") {
+		// rstep [N]: Go back N instructions, or 1.
+		// rc: Go back to the last place a breakpoint or watchpoint would
+		// have stopped, or as far as the history goes.
+		if (!hist) {
+			std::cout << "DEBUG: Not recording.\n";
+			return true;
+		}
+		std::uint64_t n{1};
+		cmdstream >> n;
+		if (cpu.icount == hist->oldest()) {
+			std::cout << "DEBUG: At the start of the history.\n";
+		} else if (cmd == "rc") {
+			if (!reverse_continue())
+				std::cout << "DEBUG: Back to the start of the history.\n";
+		} else {
+			rewind(cpu.icount - std::min(n, cpu.icount - hist->oldest()));
+		}
+		std::cout << "DEBUG: At instruction " << std::dec << cpu.icount << ".\n";
+	} else if (cmd == "history") {
+		// history: Show how far back the history goes.
+		if (hist)
+			std::cout << "DEBUG: History from instruction " << hist->oldest()
+								<< " to " << cpu.icount << ", " << (hist->bytes() >> 10)
+								<< " of " << (hist->limit() >> 10) << " KB.\n";
+		else
+			std::cout << "DEBUG: Not recording.\n";
+	} else {
+		std::cout << "DEBUG: Unknown command.\n";
+	}
+	return true;
+}
+
+// The features run_threaded() can be built with, a bit each.
+constexpr unsigned threaded_checked{1}, threaded_narrow{2}, threaded_traced{4},
+	threaded_breaks{8}, threaded_profiled{16}, threaded_builds{32};
+
+template <unsigned Bits>
+struct threaded_policy {
+	// What the registers are kept in.
+	using word = typename std::conditional<(Bits & threaded_narrow) != 0,
+		std::uint16_t, numtype>::type;
+	// Throw on bad operands, opcodes and addresses.
+	static constexpr bool checked = Bits & threaded_checked;
+	// Write every instruction to image::trace.
+	static constexpr bool traced = Bits & threaded_traced;
+	// Stop at breakpoints.
+	static constexpr bool breaks = Bits & threaded_breaks;
+	// Count everything in image::prof.
+	static constexpr bool profiled = Bits & threaded_profiled;
+};
+
+// Narrow registers are only there to be compared for speed, so they're
+// only built without tracing, breakpoints and profiling, which all cost
+// more than word size could ever save. Those get the wide build instead.
+// Each build adds about a second to compiling this file.
+constexpr unsigned threaded_built(unsigned bits) {
+	return bits & (threaded_traced | threaded_breaks | threaded_profiled) ?
+		bits & ~threaded_narrow : bits;
+}
+
+// Counting down from Bits to the one that's wanted.
+template <unsigned Bits>
+image::threaded_loop image::threaded_build(unsigned bits) {
+	if (bits == Bits)
+		return &image::run_threaded<threaded_policy<threaded_built(Bits)>>;
+	return threaded_build<Bits - 1>(bits);
+}
+
+template <>
+image::threaded_loop image::threaded_build<0>(unsigned) {
+	return &image::run_threaded<threaded_policy<0>>;
+}
+
+template <typename Word>
+bool image::call_native(numtype addr, Word *regs) {
+	numtype wide[8];
+	std::copy(regs, regs + 8, wide);
+	if (!call_native(addr, wide))
+		return false;
+	std::copy(wide, wide + 8, regs);
+	return true;
+}
+
+template <typename Word>
+void image::trace_step(std::uint64_t count, numtype pc,
+											 const memory::word *ins, const Word *regs) {
+	std::ostream &out = *trace;
+	out << count << " 0x" << std::hex << std::uppercase << std::setw(4)
+			<< std::setfill('0') << pc << std::nouppercase << std::setfill(' ')
+			<< std::dec << "  ";
+	std::ostringstream text;
+	disassemble(text, ins);
+	out << std::left << std::setw(24) << text.str() << std::right;
+	for (int i = 0; i < 8; i += 1)
+		out << ' ' << regs[i];
+	out << '\n';
+}
+
+run_status image::run_for(std::uint64_t max) {
+	// Whatever happens, output is flushed on the way out.
+	struct flusher {
+		output_buffer &out;
+		~flusher() { out.flush(); }
+	} flush_output{output};
+
+	if (halted)
+		return run_status::halted;
+	if (debug && (stepping || hist || watches.any()))
+		return run_table(max);
+	bool breaks{debug && breakpoints.any()};
+	if (prof || trace || breaks || eng == engine::threaded) {
+		unsigned bits = (checked ? threaded_checked : 0) |
+			(narrow ? threaded_narrow : 0) | (trace ? threaded_traced : 0) |
+			(breaks ? threaded_breaks : 0) | (prof ? threaded_profiled : 0);
+		return (this->*threaded_build<threaded_builds - 1>(bits))(max);
+	}
+	paused = false;
+	switch (eng) {
+	case engine::decoded:
+		return run_decoded(max);
+	case engine::jit:
+		return run_jit(max);
+	default:
+		return run_table(max);
+	}
+}
+
+// The ops table, one instruction at a time. In debug mode, this is also
+// where stepping and breakpoints stop execution.
+run_status image::run_table(std::uint64_t max) {
+	bool resuming = paused;
+	paused = false;
+	watched.hit = false;
+	for (std::uint64_t n = 0; cpu.pc < M; n += 1) {
+		if (n == max)
+			return run_status::budget_exhausted;
+		if (debug && !resuming && (stepping || (breakpoints.at(cpu.pc) &&
+				breakpoints.stops(cpu.pc, cpu, mem)))) {
+			paused = true;
+			return run_status::breakpoint;
+		}
+		resuming = false;
+		if (hist && hist->due(cpu.icount))
+			hist->mark(cpu.icount, cpu.pc);
+		step();
+		if (waiting) {
+			waiting = false;
+			paused = true;
+			return run_status::needs_input;
+		}
+		cpu.icount += 1;
+		if (halted)
+			return run_status::halted;
+		// Watchpoints stop after the instruction that tripped them.
+		if (watched.hit && debug) {
+			watched.hit = false;
+			output.flush();
+			std::cout << "DEBUG: " << (watched.write ? "Write to " : "Read from ")
+								<< std::hex << watched.addr << ": " << watched.before;
+			if (watched.write)
+				std::cout << " -> " << watched.after;
+			std::cout << std::dec << '\n';
+			paused = true;
+			return run_status::breakpoint;
+		}
+	}
+	halted = true;
+	return run_status::halted;
+}
+
+#ifdef __GNUC__
+#define THREADED_DISPATCH
+#endif
+
+// Same semantics as run_table(), but dispatches with computed gotos (Or
+// a switch on compilers without them), and keeps the hot state in locals.
+// Built from Policy: see threaded_policy. Whatever it leaves out is
+// folded away, so the plain build is as lean as it always was.
+template <typename Policy>
+run_status image::run_threaded(std::uint64_t max) {
+	profile *counts{Policy::profiled ? prof.get() : nullptr};
+	typename Policy::word r[8];
+	std::copy(cpu.regs.begin(), cpu.regs.end(), r);
+	numtype ip{cpu.pc};
+	std::uint64_t n{0};
+	run_status status;
+	memory::cursor m{mem};
+	const memory::word *ins;
+	// Carrying on from a breakpoint doesn't stop at it again.
+	bool resuming{paused};
+	paused = false;
+
+#define ARG(i) ins[i]
+#define COUNT do { if (Policy::profiled) counts->count(ip, ins[0]); } while (0)
+// Backwards jumps are where loops are.
+#define JUMP(to) do { numtype to_ = (to); \
+		if (Policy::profiled && to_ <= ip) counts->back_edge(ip, to_); \
+		ip = to_; } while (0)
+#define V(x) (is_number(x) ? numtype(x) : \
+	!Policy::checked || is_register(x) ? numtype(r[to_register(x)]) : \
+	throw std::runtime_error{"Invalid number."})
+#define R(x) r[!Policy::checked || is_register(x) ? to_register(x) : \
+	throw std::runtime_error("not a register")]
+#define ADDR(x) (!Policy::checked || is_number(x) ? (x) : \
+	throw std::runtime_error{"Invalid address."})
+// Breakpoint conditions look at the registers in cpu, which are only
+// brought up to date when there's a breakpoint at ip.
+#define BREAK do { if (Policy::breaks && breakpoints.at(ip) && \
+		!(n == 0 && resuming)) { \
+		std::copy(r, r + 8, cpu.regs.begin()); \
+		cpu.pc = ip; \
+		if (breakpoints.stops(ip, cpu, mem)) \
+			goto at_breakpoint; \
+	} } while (0)
+// An in with nothing to read doesn't run yet, so it's traced when it does.
+#define TRACE do { if (Policy::traced && \
+		(ins[0] != 20 || input_pos != input_end)) \
+		trace_step(cpu.icount + n - 1, ip, ins, r); } while (0)
+
+#ifdef THREADED_DISPATCH
+	static const void *const labels[22] = {
+		&&op0, &&op1, &&op2, &&op3, &&op4, &&op5, &&op6, &&op7, &&op8,
+		&&op9, &&op10, &&op11, &&op12, &&op13, &&op14, &&op15, &&op16,
+		&&op17, &&op18, &&op19, &&op20, &&op21
+	};
+#define NEXT do { if (ip >= M) goto halt; \
+		if (n == max) goto out_of_budget; \
+		BREAK; \
+		n += 1; ins = m.fetch(ip); \
+		if (Policy::checked && ins[0] > 21) \
+			throw std::out_of_range{"Invalid opcode."}; \
+		TRACE; COUNT; goto *labels[ins[0]]; } while (0)
+#define OP(o) op##o
+#else
+#define NEXT continue
+#define OP(o) case o
+#endif
+
+	try {
+#ifdef THREADED_DISPATCH
+	NEXT;
+#else
+	for (;;) {
+		if (ip >= M)
+			goto halt;
+		if (n == max)
+			goto out_of_budget;
+		BREAK;
+		n += 1;
+		ins = m.fetch(ip);
+		TRACE;
+		COUNT;
+		switch (ins[0]) {
+#endif
+
+	OP(0): goto halt; // halt
+	OP(1): R(ARG(1)) = V(ARG(2)); ip += 3; NEXT; // set
+	OP(2): s.push(V(ARG(1))); ip += 2; NEXT; // push
+	OP(3): // pop
+		if (s.empty())
+			throw std::runtime_error{"empty stack"};
+		R(ARG(1)) = s.top();
+		s.pop();
+		ip += 2;
+		NEXT;
+	OP(4): R(ARG(1)) = V(ARG(2)) == V(ARG(3)); ip += 4; NEXT; // eq
+	OP(5): R(ARG(1)) = V(ARG(2)) > V(ARG(3)); ip += 4; NEXT; // gt
+	OP(6): JUMP(V(ARG(1))); NEXT; // jmp
+	OP(7): // jt
+		if (V(ARG(1)) != 0)
+			JUMP(V(ARG(2)));
+		else
+			ip += 3;
+		NEXT;
+	OP(8): // jf
+		if (V(ARG(1)) == 0)
+			JUMP(V(ARG(2)));
+		else
+			ip += 3;
+		NEXT;
+	OP(9): R(ARG(1)) = (V(ARG(2)) + V(ARG(3))) % M; ip += 4; NEXT; // add
+	OP(10): R(ARG(1)) = (V(ARG(2)) * V(ARG(3))) % M; ip += 4; NEXT; // mult
+	OP(11): R(ARG(1)) = V(ARG(2)) % V(ARG(3)); ip += 4; NEXT; // mod
+	OP(12): R(ARG(1)) = V(ARG(2)) & V(ARG(3)); ip += 4; NEXT; // and
+	OP(13): R(ARG(1)) = V(ARG(2)) | V(ARG(3)); ip += 4; NEXT; // or
+	OP(14): R(ARG(1)) = fix15(~V(ARG(2))); ip += 3; NEXT; // not
+	OP(15): R(ARG(1)) = load(ADDR(V(ARG(2)))); ip += 3; NEXT; // rmem
+	OP(16): // wmem
+		store(ADDR(V(ARG(1))), V(ARG(2)));
+		// Memory might have had its pages moved.
+		m.reset();
+		ip += 3;
+		NEXT;
+	OP(17): // call
+		if (natives.at(V(ARG(1))) && call_native(V(ARG(1)), r)) {
+			ip += 2;
+			NEXT;
+		}
+		s.push(ip + 2);
+		if (Policy::profiled)
+			counts->call(V(ARG(1)), ip + 2, cpu.icount + n);
+		ip = V(ARG(1));
+		NEXT;
+	OP(18): // ret
+		if (s.empty())
+			goto halt;
+		ip = s.top();
+		s.pop();
+		if (Policy::profiled)
+			counts->ret(ip, cpu.icount + n);
+		NEXT;
+	OP(19): output.put(static_cast<char>(V(ARG(1)))); ip += 2; NEXT; // out
+	OP(20): // in
+		if (input_pos == input_end) {
+			n -= 1;
+			if (Policy::profiled)
+				counts->uncount(ip, 20);
+			goto need_input;
+		}
+		R(ARG(1)) = next_char();
+		ip += 2;
+		NEXT;
+	OP(21): ip += 1; NEXT; // noop
+
+#ifndef THREADED_DISPATCH
+		default:
+			throw std::out_of_range{"Invalid opcode."};
+		}
+	}
+#endif
+	} catch (...) {
+		// Leave the image in a state that can still be dumped.
+		std::copy(r, r + 8, cpu.regs.begin());
+		cpu.pc = ip;
+		cpu.icount += n;
+		throw;
+	}
+
+halt:
+	halted = true;
+	status = run_status::halted;
+	goto done;
+need_input:
+	// So as not to stop at a breakpoint on the in again once there's input.
+	paused = true;
+	status = run_status::needs_input;
+	goto done;
+at_breakpoint:
+	paused = true;
+	status = run_status::breakpoint;
+	goto done;
+out_of_budget:
+	status = run_status::budget_exhausted;
+done:
+	std::copy(r, r + 8, cpu.regs.begin());
+	cpu.pc = ip;
+	cpu.icount += n;
+	return status;
+
+#undef OP
+#undef NEXT
+#undef TRACE
+#undef BREAK
+#undef ADDR
+#undef R
+#undef V
+#undef JUMP
+#undef COUNT
+#undef ARG
+}
+
+// Like run_threaded(), but executing from the decoded instruction cache.
+run_status image::run_decoded(std::uint64_t max) {
+#ifdef THREADED_DISPATCH
+	decode_handler = &&miss;
+#endif
+	if (dcache.empty()) {
+		decoded proto;
+		proto.handler = decode_handler;
+		dcache.resize(M, proto);
+	}
+
+	numtype ip{cpu.pc};
+	std::uint64_t n{0};
+	run_status status;
+	decoded *d{nullptr};
+
+#define A (*d->arg[0])
+#define B (*d->arg[1])
+#define C (*d->arg[2])
+
+#ifdef THREADED_DISPATCH
+	static const void *const labels[23] = {
+		&&op0, &&op1, &&op2, &&op3, &&op4, &&op5, &&op6, &&op7, &&op8,
+		&&op9, &&op10, &&op11, &&op12, &&op13, &&op14, &&op15, &&op16,
+		&&op17, &&op18, &&op19, &&op20, &&op21, &&op22
+	};
+#define NEXT do { if (ip >= M) goto halt; \
+		if (n == max) goto out_of_budget; \
+		n += 1; d = &dcache[ip]; goto *d->handler; } while (0)
+#define OP(o) op##o
+#else
+#define NEXT continue
+#define OP(o) case o
+#endif
+
+	try {
+#ifdef THREADED_DISPATCH
+	NEXT;
+miss:
+	d = &decode(ip);
+	d->handler = labels[d->op];
+	goto *d->handler;
+#else
+	for (;;) {
+		if (ip >= M)
+			goto halt;
+		if (n == max)
+			goto out_of_budget;
+		n += 1;
+		d = &dcache[ip];
+		if (d->op == decoded::empty)
+			d = &decode(ip);
+		switch (d->op) {
+#endif
+
+	OP(0): goto halt; // halt
+	OP(1): A = B; ip += 3; NEXT; // set
+	OP(2): s.push(A); ip += 2; NEXT; // push
+	OP(3): // pop
+		if (s.empty())
+			throw std::runtime_error{"empty stack"};
+		A = s.top();
+		s.pop();
+		ip += 2;
+		NEXT;
+	OP(4): A = B == C; ip += 4; NEXT; // eq
+	OP(5): A = B > C; ip += 4; NEXT; // gt
+	OP(6): ip = A; NEXT; // jmp
+	OP(7): ip = A != 0 ? B : ip + 3; NEXT; // jt
+	OP(8): ip = A == 0 ? B : ip + 3; NEXT; // jf
+	OP(9): A = (B + C) % M; ip += 4; NEXT; // add
+	OP(10): A = (B * C) % M; ip += 4; NEXT; // mult
+	OP(11): A = B % C; ip += 4; NEXT; // mod
+	OP(12): A = B & C; ip += 4; NEXT; // and
+	OP(13): A = B | C; ip += 4; NEXT; // or
+	OP(14): A = fix15(~B); ip += 3; NEXT; // not
+	OP(15): A = load(B); ip += 3; NEXT; // rmem
+	OP(16): // wmem. Might invalidate d, so don't touch it afterwards.
+		ip += 3;
+		store(A, B);
+		NEXT;
+	OP(17): // call
+		if (natives.at(A) && call_native(A, cpu.regs.data())) {
+			ip += 2;
+			NEXT;
+		}
+		s.push(ip + 2);
+		ip = A;
+		NEXT;
+	OP(18): // ret
+		if (s.empty())
+			goto halt;
+		ip = s.top();
+		s.pop();
+		NEXT;
+	OP(19): output.put(static_cast<char>(A)); ip += 2; NEXT; // out
+	OP(20): // in
+		if (input_pos == input_end) {
+			n -= 1;
+			goto need_input;
+		}
+		A = next_char();
+		ip += 2;
+		NEXT;
+	OP(21): ip += 1; NEXT; // noop
+	OP(22): throw std::runtime_error{"Invalid instruction."};
+
+#ifndef THREADED_DISPATCH
+		}
+	}
+#endif
+	} catch (...) {
+		cpu.pc = ip;
+		cpu.icount += n;
+		throw;
+	}
+
+halt:
+	halted = true;
+	status = run_status::halted;
+	goto done;
+need_input:
+	status = run_status::needs_input;
+	goto done;
+out_of_budget:
+	status = run_status::budget_exhausted;
+done:
+	cpu.pc = ip;
+	cpu.icount += n;
+	return status;
+
+#undef OP
+#undef NEXT
+#undef C
+#undef B
+#undef A
+}
@@ -0,0 +1,663 @@
+/* The Synacor virtual machine: a loaded program image and the engines
+ * that run it. See image.cc for how they work.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <iostream>
+#include <array>
+#include <vector>
+#include <stdexcept>
+#include <string>
+#include <functional>
+#include <bitset>
+#include <unordered_map>
+#include <utility>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include "io.h"
+
+/* Control what type is used to represent words in registers and on the
+   stack. 32 bits, which x86-64 handles without the operand size prefixes
+   16 bit words need, or exactly 16 bits. Memory is 16 bit words either way.
+*/
+#define FAST_WORD
+/* Disables some bounds and consistency checks. Should be okay on
+   well formed binary images.
+*/
+#define UNSAFE
+
+#ifdef FAST_WORD
+using numtype = std::uint32_t;
+#else
+using numtype = std::uint16_t;
+#endif
+
+#ifdef UNSAFE
+#define AT(c, i) c[i]
+#else
+#define AT(c, i) c.at(i)
+#endif
+
+constexpr numtype M{32768}; 
+
+constexpr numtype fix15(numtype a) {
+	return a & 0b0111111111111111;
+}
+
+// Scrambles the bits of x, so that inputs differing by a bit give
+// unrelated outputs. The finalizer from splitmix64.
+inline std::uint64_t mix64(std::uint64_t x) {
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+	return x ^ (x >> 31);
+}
+
+constexpr bool is_number(numtype n) {
+	return n < 32768;
+}
+	
+constexpr bool is_register(numtype n) {
+	return n > 32767 && n < 32776;
+}
+	
+constexpr int to_register(numtype n) {
+	return n - 32768;
+}
+
+// Length in words of each instruction, indexed by opcode.
+constexpr std::array<int, 22> oplen{{
+	1, 3, 2, 2, 4, 4, 2, 3, 3, 4, 4, 4, 4, 4, 3, 3, 3, 2, 1, 2, 2, 1
+}};
+
+// Opcodes whose first argument is a register to write to.
+constexpr bool writes_register(numtype op) {
+	return op == 1 || op == 3 || (op >= 4 && op <= 5) || (op >= 9 && op <= 15)
+		|| op == 20;
+}
+
+// The guest stack. Works like a std::stack, but is kept in one contiguous
+// chunk so that JIT compiled code can push and pop without calling back
+// into C++.
+class word_stack {
+public:
+	using size_type = std::size_t;
+
+	bool empty(void) const { return n == 0; }
+	size_type size(void) const { return n; }
+	numtype top(void) const { return words[n - 1]; }
+	void push(numtype w) {
+		if (n == words.size())
+			grow();
+		words[n++] = w;
+	}
+	void pop(void) { n -= 1; }
+	// Bottom to top.
+	const numtype *begin(void) const { return words.data(); }
+	const numtype *end(void) const { return words.data() + n; }
+	template <typename It>
+	void assign(It first, It last) {
+		words.assign(first, last);
+		n = words.size();
+	}
+
+private:
+	friend class jit_compiler;
+	std::vector<numtype> words;
+	size_type n{0};
+
+	void grow(void) { words.resize(words.empty() ? 256 : words.size() * 2); }
+};
+
+// Guest memory, in pages shared copy-on-write between copies. Copying one
+// only copies the page table, and a page is duplicated the first time
+// either side writes to it. Pages nothing has been written to are all
+// the same page of zeros.
+//
+// Memory is always the full 32768 words the architecture has, stored as
+// 16 bit words whatever numtype is, so nothing ever has to grow it. The
+// table covers every 16 bit address anyway, so reads never need a bounds
+// check; the half above M reads as 0 unless something stores there.
+class paged_memory {
+public:
+	using size_type = std::size_t;
+	using word = std::uint16_t;
+	static constexpr unsigned page_bits = 8;
+	static constexpr size_type page_words = size_type{1} << page_bits;
+	static constexpr size_type page_count = 65536 / page_words;
+
+	paged_memory();
+
+	numtype operator[](size_type addr) const {
+		return table[addr >> page_bits][addr & (page_words - 1)];
+	}
+	numtype at(size_type addr) const {
+		if (addr >= M)
+			throw std::out_of_range{"Address out of range."};
+		return (*this)[addr];
+	}
+	// The (up to) four words of the instruction at addr, contiguous. Points
+	// into its page, or into scratch if it runs over the end of one.
+	const word *fetch(size_type addr, word *scratch) const {
+		size_type offset = addr & (page_words - 1);
+		if (offset <= page_words - 4)
+			return table[addr >> page_bits] + offset;
+		for (size_type i = 0; i < 4; i += 1)
+			scratch[i] = (*this)[(addr + i) & (page_count * page_words - 1)];
+		return scratch;
+	}
+	// fetch(), but hanging on to the page the last instruction was in so
+	// that it usually doesn't have to go through the table. Anything that
+	// writes to memory has to reset() it.
+	class cursor {
+	public:
+		explicit cursor(const paged_memory &m) : mem(m) {}
+		const word *fetch(size_type addr) {
+			size_type offset = addr - base;
+			if (offset > page_words - 4) {
+				base = addr & ~(page_words - 1);
+				page = mem.table[addr >> page_bits];
+				offset = addr - base;
+				if (offset > page_words - 4)
+					return mem.fetch(addr, scratch);
+			}
+			return page + offset;
+		}
+		void reset(void) { base = page_count * page_words; }
+	private:
+		const paged_memory &mem;
+		size_type base{page_count * page_words};
+		const word *page{nullptr};
+		word scratch[4];
+	};
+
+	void set(size_type addr, numtype w) {
+		size_type p = addr >> page_bits;
+		if (owners[p].use_count() != 1)
+			unshare(p);
+		word &at = table[p][addr & (page_words - 1)];
+		if (hashing)
+			digest ^= key(addr, at) ^ key(addr, w);
+		at = w;
+	}
+	// A hash of the whole of memory, Zobrist style: the xor of a key for
+	// each address and the word in it. While hashing is on, set() swaps the
+	// old word's key for the new one's, so it's always up to date without
+	// looking at the other 65535 words. Otherwise it's worked out from
+	// scratch every time.
+	std::uint64_t hash(void) const { return hashing ? digest : rehash(); }
+	// Turning it on costs one rehash, and a couple of multiplies per set()
+	// from then on. Copies keep it on.
+	void set_hashing(bool on) {
+		if (on && !hashing)
+			digest = rehash();
+		hashing = on;
+	}
+	// The key for word w at addr. Worked out rather than looked up in a
+	// table, which would need one for every value at every address, and 0
+	// for 0, so that untouched memory doesn't count.
+	static std::uint64_t key(size_type addr, numtype w) {
+		w = word(w);
+		return w ? mix64(std::uint64_t{addr} << 16 | w) : 0;
+	}
+	static constexpr size_type size(void) { return M; }
+	// One past the last word that isn't 0.
+	size_type used(void) const;
+	// Replace the contents with the words in [first, last), a page at a
+	// time.
+	template <typename It>
+	void assign(It first, It last);
+	// The same, but using the words at [first, first + n) in place, a
+	// whole page at a time, rather than copying them. keep is held on to
+	// for as long as any page is. Whatever's left after the last whole
+	// page is copied. As with any other page, one that no copy shares is
+	// written in place, so the words have to be writable.
+	void adopt(const std::shared_ptr<void> &keep, word *first, size_type n);
+	// The page table, for JIT compiled code to read through.
+	const word *const *pages(void) const { return table.data(); }
+
+private:
+	struct page { std::array<word, page_words> w; };
+	std::array<word *, page_count> table;
+	std::array<std::shared_ptr<page>, page_count> owners;
+	bool hashing{false};
+	std::uint64_t digest{0};
+
+	void unshare(size_type);
+	std::uint64_t rehash(void) const;
+};
+
+template <typename It>
+void paged_memory::assign(It first, It last) {
+	bool was_hashing{hashing};
+	*this = paged_memory{};
+	for (size_type p = 0; first != last; p += 1) {
+		size_type len = std::min<size_type>(last - first, page_words);
+		unshare(p);
+		std::copy(first, first + len, table[p]);
+		first += len;
+	}
+	set_hashing(was_hashing);
+}
+
+#if defined(__x86_64__) && defined(__unix__)
+#define HAVE_JIT
+#endif
+
+// What the program counter and registers are kept in, along with the
+// instruction count, all in one cache line.
+struct alignas(64) cpu_state {
+	numtype pc{0};
+	std::array<numtype, 8> regs{{0,0,0,0,0,0,0,0}};
+	std::uint64_t icount{0};
+};
+static_assert(sizeof(cpu_state) == 64, "cpu_state should fit one cache line");
+
+// A debugger condition, like r0 == 6 && [0x0AAC] != 0. Numbers are
+// decimal, or hex with 0x. [a] is the word at address a, r0-r7 the
+// registers and pc the program counter. Operators, loosest first: ||, &&,
+// the comparisons, & and |, + and -, * and %, and unary !. Parsing and
+// evaluating it are in debug.cc.
+class condition {
+public:
+	// Throws std::runtime_error if text isn't an expression.
+	explicit condition(const std::string &text);
+	bool holds(const cpu_state &, const paged_memory &) const;
+	const std::string &str(void) const { return text; }
+
+	// The expression in postfix order.
+	struct term {
+		enum kind_t : std::uint8_t {
+			number, reg, pc, deref, negate, or_, and_, eq, ne, lt, gt, le, ge,
+			bitand_, bitor_, add, sub, mul, mod
+		} kind;
+		std::uint32_t value;
+	};
+
+	// How many values evaluating one can need at once. Anything that needs
+	// more is rejected, so that holds() needn't allocate.
+	static constexpr std::size_t max_depth = 32;
+
+private:
+	std::string text;
+	std::vector<term> terms;
+};
+
+// Breakpoints, as one bit per address, so checking for one costs next to
+// nothing. Some have a condition too, and only stop when it holds.
+class breakpoint_map {
+public:
+	breakpoint_map() = default;
+	breakpoint_map(const breakpoint_map &);
+	bool at(numtype addr) const { return (*bits)[addr]; }
+	bool any(void) const { return count > 0; }
+	// Should execution stop at addr? Only call when at() is true.
+	bool stops(numtype addr, const cpu_state &cpu, const paged_memory &mem) const;
+	void set(numtype addr);
+	void set(numtype addr, const condition &);
+	void clear(numtype addr);
+	// Every breakpoint, lowest address first, and the conditional ones.
+	std::vector<numtype> addresses(void) const;
+	const std::vector<std::pair<numtype, condition>> &conditional(void) const {
+		return conditions;
+	}
+
+private:
+	// Most images never get a breakpoint, so the bits are only allocated
+	// at the first one. Until then bits points at none.
+	static const std::bitset<M> none;
+	std::unique_ptr<std::bitset<M>> owned;
+	const std::bitset<M> *bits{&none};
+	std::size_t count{0};
+	std::vector<std::pair<numtype, condition>> conditions;
+};
+
+// Watchpoints on ranges of memory, checked by image::load() and store().
+class watch_list {
+public:
+	struct range {
+		numtype first, last;
+		bool read, write;
+	};
+
+	watch_list() = default;
+	watch_list(const watch_list &);
+	bool any(void) const { return !ranges.empty(); }
+	bool reads(numtype addr) const { return addr < M && bits->read[addr]; }
+	bool writes(numtype addr) const { return addr < M && bits->write[addr]; }
+	void add(const range &);
+	// Remove every range with addr in it. False if there weren't any.
+	bool remove(numtype addr);
+	const std::vector<range> &list(void) const { return ranges; }
+
+private:
+	struct masks {
+		std::bitset<M> read, write;
+	};
+	std::vector<range> ranges;
+	// Allocated at the first watchpoint, as for breakpoint_map.
+	static const masks none;
+	std::unique_ptr<masks> owned;
+	const masks *bits{&none};
+
+	void rebuild(void);
+};
+
+// A native stand-in for a guest routine. It gets the registers, and the
+// stack and memory as the routine would see them, except that the
+// return address isn't on the stack. It does the routine's work on
+// those, and execution carries on after the call as if the routine had
+// returned. If it returns false instead, because the code there isn't
+// what it expected, say, the guest routine is called after all. Hooks
+// have to give the same result every time, for the debugger's history
+// to be able to replay them.
+using native_hook =
+	std::function<bool(std::array<numtype, 8> &, word_stack &, const paged_memory &)>;
+
+// Native hooks, by the address of the routine they replace.
+class hook_table {
+public:
+	hook_table();
+	bool any(void) const { return !hooks.empty(); }
+	// Is there a hook for a call to addr? Any 16 bit value will do.
+	bool at(numtype addr) const { return bits[addr]; }
+	const native_hook &operator[](numtype addr) const {
+		return hooks.find(addr)->second;
+	}
+	void set(numtype addr, native_hook);
+	void clear(numtype addr);
+	// One byte per 16 bit address, nonzero where there's a hook, for JIT
+	// compiled code to check.
+	const std::uint8_t *table(void) const { return bits; }
+
+private:
+	// Shared between copies until one of them changes it, which most
+	// never do. bits is flags->data().
+	std::shared_ptr<std::vector<std::uint8_t>> flags;
+	const std::uint8_t *bits;
+	std::unordered_map<numtype, native_hook> hooks;
+
+	void unshare(void);
+};
+
+class jit_compiler;
+class snapshot;
+class profile;
+class history;
+
+// Why run_for() returned.
+enum class run_status {
+	halted, // The program is done. Further calls do nothing.
+	needs_input, // Stopped at an in instruction with nothing to read. Feed it.
+	budget_exhausted, // Ran as many instructions as it was allowed to.
+	breakpoint // Debug mode only: stepping, or at a breakpoint.
+};
+
+enum class engine { table, threaded, decoded, jit };
+
+class image {
+private:
+	using stack = word_stack;
+	using memory = paged_memory;
+	
+	cpu_state cpu;
+	memory mem;
+	stack s;
+	bool debug;
+	bool stepping;
+	breakpoint_map breakpoints;
+	watch_list watches;
+	hook_table natives;
+	// The last watched access, for run_table() to stop after.
+	struct watch_hit {
+		bool hit, write;
+		numtype addr, before, after;
+	} watched{false, false, 0, 0, 0};
+	// Unread input. Points into input_owned, or at a buffer given to
+	// feed_view().
+	const char *input_pos{nullptr}, *input_end{nullptr};
+	std::string input_owned;
+	output_buffer output{terminal_sink::instance()};
+	engine eng{engine::table};
+	// Which build of run_threaded() to use. See set_checked().
+#ifdef UNSAFE
+	bool checked{false};
+#else
+	bool checked{true};
+#endif
+#ifdef FAST_WORD
+	bool narrow{false};
+#else
+	bool narrow{true};
+#endif
+	std::ostream *trace{nullptr};
+
+	// Set by halt, and ret with an empty stack. Sticks.
+	bool halted{false};
+	// Set by an in instruction that found nothing to read. It doesn't
+	// count as executed, and pc is left pointing at it.
+	bool waiting{false};
+	// Set when run_table() returns at pc, so it doesn't stop on the same
+	// instruction again when it's resumed.
+	bool paused{false};
+
+	// A pre-decoded instruction for run_decoded(). Each argument points
+	// at either a register or the literal stored in the entry itself.
+	// With computed gotos, handler is the label to jump to, which is the
+	// decoder for entries that haven't been filled in yet. Entries are a
+	// cache line each, so one never straddles two.
+	struct alignas(64) decoded {
+		static constexpr std::uint8_t empty = 0xFF, invalid = 22;
+		std::uint8_t op{empty};
+		std::uint8_t len{0};
+		const void *handler{nullptr};
+		std::array<numtype, 3> lit{{0,0,0}};
+		std::array<numtype *, 3> arg{{nullptr,nullptr,nullptr}};
+	};
+	// Indexed by address; empty until run_decoded() is first used.
+	std::vector<decoded> dcache;
+	const void *decode_handler{nullptr};
+	std::uint64_t decodes{0}, invalidations{0};
+
+	decoded &decode(numtype);
+	void invalidate(numtype);
+	void jit_invalidate(numtype);
+
+	friend class jit_compiler;
+	// jit_compiler is only complete in jit.cc, so that's where it's deleted.
+	struct jit_deleter { void operator()(jit_compiler *) const; };
+	std::unique_ptr<jit_compiler, jit_deleter> jit;
+
+	// Only there while profiling. See profile.h.
+	struct profile_deleter { void operator()(profile *) const; };
+	std::unique_ptr<profile, profile_deleter> prof;
+
+	// Only there while the debugger is recording. See history.h.
+	struct history_deleter { void operator()(history *) const; };
+	std::unique_ptr<history, history_deleter> hist;
+	void forget_history(void);
+	void undo_to(std::size_t);
+	void replay(std::uint64_t target, std::uint64_t end, std::uint64_t *stop);
+	void rewind(std::uint64_t);
+	bool reverse_continue(void);
+
+	numtype val(numtype);
+	numtype load(numtype);
+	void store(numtype, numtype);
+	// store() without the watchpoints and history.
+	void overwrite(numtype, numtype);
+	void regstore(numtype, numtype);
+	void push(numtype);
+	void pop(void);
+	// Run the hook for a call to addr with the registers in regs. False if
+	// it wants the guest routine run instead.
+	bool call_native(numtype addr, numtype *regs);
+	// The same, for registers kept in some other type.
+	template <typename Word>
+	bool call_native(numtype addr, Word *regs);
+	// Write the instruction at pc, and the registers, to trace.
+	template <typename Word>
+	void trace_step(std::uint64_t count, numtype pc, const paged_memory::word *ins,
+									const Word *regs);
+
+	char next_char(void);
+
+	// The instruction being run by ops, from paged_memory::fetch().
+	const memory::word *ins{nullptr};
+	memory::word ins_scratch[4];
+	void step(void) {
+		ins = mem.fetch(cpu.pc, ins_scratch);
+		AT(ops, ins[0])();
+	}
+
+	run_status run_table(std::uint64_t);
+	// Built once per combination of the features in image.cc's
+	// threaded_policy, each with no trace of the ones it doesn't have.
+	template <typename Policy>
+	run_status run_threaded(std::uint64_t);
+	using threaded_loop = run_status (image::*)(std::uint64_t);
+	// The build of run_threaded() with the features in bits.
+	template <unsigned Bits>
+	static threaded_loop threaded_build(unsigned bits);
+	run_status run_decoded(std::uint64_t);
+	run_status run_jit(std::uint64_t);
+
+#ifdef UNSAFE
+#define W(i) ins[i]
+#else
+#define W(i) mem.at(cpu.pc + (i))
+#endif
+#define A   numtype a{W(1)}; cpu.pc += 2
+#define AB  numtype a{W(1)}, b{W(2)}; cpu.pc += 3
+#define ABC numtype a{W(1)}, b{W(2)}, c{W(3)}; cpu.pc += 4
+	std::array<std::function<void(void)>, 22>
+	ops{{
+		[&](){ halted = true; }, // 0 halt
+		[&](){ AB; regstore(a, val(b)); }, // 1 set
+		[&](){ A; push(val(a)); }, // 2 push
+		[&](){ A; if (s.empty()) { throw std::runtime_error{"empty stack"}; }
+					 regstore(a, s.top()); pop(); }, // 3 pop
+		[&](){ ABC; regstore(a, val(b) == val(c)); }, // 4 eq
+		[&](){ ABC; regstore(a, val(b) > val(c)); }, // 5 gt
+		[&](){ A; cpu.pc = val(a); }, // 6 jmp
+		[&](){ AB; if (val(a) != 0) cpu.pc = val(b); }, // 7 jt
+		[&](){ AB; if (val(a) == 0) cpu.pc = val(b); }, // 8 jf
+		[&](){ ABC; regstore(a, (val(b) + val(c)) % M); }, // 9 add
+		[&](){ ABC; regstore(a, (val(b) * val(c)) % M); }, // 10 mult
+		[&](){ ABC; regstore(a, val(b) % val(c)); }, // 11 mod
+		[&](){ ABC; regstore(a, val(b) & val(c)); }, // 12 and
+		[&](){ ABC; regstore(a, val(b) | val(c)); }, // 13 or
+		[&](){ AB; regstore(a, fix15(~val(b))); }, // 14 not
+		[&](){ AB; regstore(a, load(val(b))); }, // 15 rmem
+		[&](){ AB; store(val(a), val(b)); }, // 16 wmem
+		[&](){ A; if (natives.at(val(a)) && call_native(val(a), cpu.regs.data()))
+						 return;
+					 push(cpu.pc); cpu.pc = val(a); }, // 17 call
+		[&](){ if (s.empty()) { halted = true; return; }
+					 cpu.pc = s.top(); pop(); }, // 18 ret
+		[&](){ A; output.put(static_cast<char>(val(a))); }, // 19 out
+		[&](){ if (input_pos == input_end) { waiting = true; return; }
+					 A; regstore(a, next_char()); }, // 20 in
+		[&](){ cpu.pc += 1; } // 21 noop
+	}};
+
+#undef ABC
+#undef AB
+#undef A
+#undef W
+	
+	public:	
+		// Load a program image from a stream, or with dump set, an old text
+		// save state. Each constructor says what it's loading on std::cout
+		// unless it's quiet.
+		explicit image(std::istream &, bool dump = false, bool quiet = false);
+		// Load the program image in filename by mapping it, and use the
+		// mapping as memory until it's written to. Quiet, it's fit for batch
+		// runs and servers to start instances with. Defined in snapshot.cc,
+		// like restoring a snapshot.
+		explicit image(const std::string &filename, bool quiet = false);
+		explicit image(const snapshot &, bool quiet = false);
+		// A copy of the machine state, sharing memory pages with the
+		// original until one of them writes to them. Caches, the JIT and
+		// statistics aren't copied.
+		image(const image &);
+		image &operator=(const image &) = delete;
+		~image();
+		void set_engine(engine e) { eng = e; }
+		// How the threaded engine's loop is built. Checked checks every
+		// operand, opcode and address, and throws on a bad one, as if UNSAFE
+		// weren't defined. Narrow keeps the registers in 16 bit words while
+		// it runs, as if FAST_WORD weren't. They default to what those say,
+		// and copies keep them. Each combination is compiled in, so
+		// comparing them doesn't take a rebuild.
+		void set_checked(bool c) { checked = c; }
+		void set_narrow(bool n) { narrow = n; }
+		// Write each instruction run, and the registers before it, to out,
+		// or stop if it's null. Runs on the threaded engine whatever
+		// set_engine() said. Copies don't trace.
+		void set_trace(std::ostream *out) { trace = out; }
+		// Where out instructions write to. Defaults to the terminal.
+		void set_output(output_sink &s) { output.set_sink(s); }
+		// Debug mode starts out stepping. While it's stepping, recording, or
+		// there are breakpoints or watchpoints, it runs with the table
+		// engine and checks before every instruction; otherwise with the
+		// usual one.
+		void set_debug(bool d) { debug = stepping = d; }
+		// Record up to about bytes of history in debug mode, for the
+		// debugger to go backwards through, or 0 to stop. Starts afresh
+		// either way. Defined in history.cc.
+		void set_history(std::size_t bytes);
+		// Call fn instead of the guest routine at addr. See native_hook.
+		void set_native(numtype addr, native_hook fn);
+		void clear_native(numtype addr);
+		bool is_stepping(void) const { return stepping; }
+		void set_stepping(bool s) { stepping = s; }
+		numtype program_counter(void) const { return cpu.pc; }
+		// Run at most max instructions, stopping early if the program halts
+		// or wants input that hasn't been fed to it yet. Can be called
+		// again to carry on from wherever it stopped.
+		run_status run_for(std::uint64_t max);
+		// Queue up characters for the program's in instructions.
+		void feed(const std::string &);
+		// The same, but read straight out of [p, p + n), which has to stay
+		// around until the program has read it all. Only copied if there's
+		// unread input already.
+		void feed_view(const char *p, std::size_t n);
+		// Refill from a source on needs_input. False if it's run dry.
+		bool feed(input_source &src) { return src.refill(*this); }
+		bool finished(void) const { return halted; }
+		// Run one debugger command. Returns false if it resumes execution.
+		bool debugger(const std::string &);
+		std::uint64_t instructions(void) const { return cpu.icount; }
+		// A hash of the machine's state: memory, registers, stack, pc and
+		// whether it's halted. Two states that hash the same are, barring a
+		// 64 bit collision, the same state. With set_hashing() on, memory's
+		// share is kept up to date as it's written, and this costs as much
+		// as the stack is deep, not as much as memory is big.
+		std::uint64_t state_hash(void) const;
+		void set_hashing(bool on) { mem.set_hashing(on); }
+		// The word at addr, without it counting as a read for watchpoints.
+		numtype peek(numtype addr) const { return mem[addr]; }
+		std::uint64_t decoded_instructions(void) const { return decodes; }
+		std::uint64_t invalidated_instructions(void) const {
+			return invalidations;
+		}
+		void jit_stats(std::ostream &) const;
+		// Count where run_for() spends its time, or stop counting and forget
+		// it all. Defined in profile.cc, like the report.
+		void set_profiling(bool);
+		void profile_report(std::ostream &) const;
+		// The call chains the profile saw, for flame graphs.
+		void profile_folded(std::ostream &) const;
+		void dump(const std::string &s) { dump(s.c_str()); }
+		void dump(const char *);
+};
+
+// Hook in the native routines that come with the VM. See natives.cc.
+void add_builtin_natives(image &);
+
+#endif
@@ -0,0 +1,92 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include "io.h"
+#include "image.h"
+
+constexpr std::size_t output_buffer::capacity;
+
+void terminal_sink::write(const char *p, std::size_t n) {
+	std::cout.write(p, n);
+}
+
+void terminal_sink::flush(void) {
+	std::cout.flush();
+}
+
+terminal_sink &terminal_sink::instance(void) {
+	static terminal_sink terminal;
+	return terminal;
+}
+
+file_sink::file_sink(const std::string &filename)
+	: out(filename, std::ofstream::out | std::ofstream::binary) {
+	if (!out.is_open())
+		throw std::runtime_error{"Unable to open " + filename + " for writing."};
+}
+
+void file_sink::write(const char *p, std::size_t n) {
+	out.write(p, n);
+}
+
+void file_sink::flush(void) {
+	out.flush();
+}
+
+// The buffered characters are in at most two pieces: up to the end of the
+// ring, and from the start of it.
+void output_buffer::drain(void) {
+	while (tail != head) {
+		std::size_t start = tail & (capacity - 1);
+		std::size_t len = std::min(head - tail, capacity - start);
+		sink->write(ring.data() + start, len);
+		tail += len;
+	}
+}
+
+bool terminal_source::refill(image &vm) {
+	while (std::getline(std::cin, line)) {
+		if (line.empty())
+			continue;
+		if (debug && line[0] == '~') {
+			vm.debugger(line.substr(1));
+			if (vm.finished())
+				return true;
+			continue;
+		}
+		// line isn't touched again until the VM has read all of it.
+		line += '\n';
+		vm.feed_view(line.data(), line.size());
+		return true;
+	}
+	return false;
+}
+
+file_source::file_source(const std::string &filename) {
+	std::ifstream in(filename);
+	if (!in.is_open())
+		throw std::runtime_error{"Unable to open " + filename + " for reading."};
+	std::string line;
+	while (std::getline(in, line))
+		if (!line.empty())
+			data += line + '\n';
+}
+
+bool file_source::refill(image &vm) {
+	if (done || data.empty())
+		return false;
+	vm.feed_view(data.data(), data.size());
+	done = true;
+	return true;
+}
+
+bool memory_source::refill(image &vm) {
+	if (done || size == 0)
+		return false;
+	vm.feed_view(data, size);
+	done = true;
+	return true;
+}
@@ -0,0 +1,132 @@
+/* Where a VM's out instructions write to, and where its in instructions
+ * read from.
+ *
+ * Output goes through an output_buffer, a small ring buffer that hands
+ * whole lines to an output_sink, and everything left over when run_for()
+ * returns. Input is handed to the VM in blocks by an input_source when it
+ * runs out, and read in place from there when possible.
+ */
+
+#ifndef IO_H
+#define IO_H
+
+#include <string>
+#include <fstream>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+class image;
+
+class output_sink {
+public:
+	virtual ~output_sink() {}
+	virtual void write(const char *, std::size_t) = 0;
+	// Called when the VM stops running, e.g. to wait for input.
+	virtual void flush(void) {}
+};
+
+// Standard output.
+class terminal_sink : public output_sink {
+public:
+	void write(const char *, std::size_t) override;
+	void flush(void) override;
+	// The one everything uses unless told otherwise.
+	static terminal_sink &instance(void);
+};
+
+class file_sink : public output_sink {
+public:
+	explicit file_sink(const std::string &filename);
+	void write(const char *, std::size_t) override;
+	void flush(void) override;
+private:
+	std::ofstream out;
+};
+
+// Collects everything in a string.
+class memory_sink : public output_sink {
+public:
+	void write(const char *p, std::size_t n) override { data.append(p, n); }
+	const std::string &str(void) const { return data; }
+private:
+	std::string data;
+};
+
+// Throws it all away, but keeps count.
+class null_sink : public output_sink {
+public:
+	void write(const char *, std::size_t n) override { bytes += n; }
+	std::uint64_t written(void) const { return bytes; }
+private:
+	std::uint64_t bytes{0};
+};
+
+class output_buffer {
+public:
+	static constexpr std::size_t capacity = 4096;
+
+	explicit output_buffer(output_sink &s) : sink(&s) {}
+	void set_sink(output_sink &s) { flush(); sink = &s; }
+	output_sink &get_sink(void) const { return *sink; }
+	void put(char c) {
+		ring[head & (capacity - 1)] = c;
+		head += 1;
+		if (c == '\n' || head - tail == capacity)
+			drain();
+	}
+	// Hand everything buffered to the sink, and flush that too.
+	void flush(void) { drain(); sink->flush(); }
+
+private:
+	output_sink *sink;
+	std::array<char, capacity> ring;
+	// Count of characters ever put and ever handed on.
+	std::size_t head{0}, tail{0};
+
+	void drain(void);
+};
+
+class input_source {
+public:
+	virtual ~input_source() {}
+	// Give vm more input. Returns false if there isn't any.
+	virtual bool refill(image &vm) = 0;
+};
+
+// Standard input, a line at a time. Empty lines are skipped. In debug
+// mode, lines that start with ~ are debugger commands instead.
+class terminal_source : public input_source {
+public:
+	explicit terminal_source(bool debug = false) : debug(debug) {}
+	bool refill(image &) override;
+private:
+	bool debug;
+	std::string line;
+};
+
+// A whole file, read up front. Empty lines are skipped, like on the
+// terminal.
+class file_source : public input_source {
+public:
+	explicit file_source(const std::string &filename);
+	bool refill(image &) override;
+private:
+	std::string data;
+	bool done{false};
+};
+
+// Someone else's buffer, which has to outlive the VM reading it.
+class memory_source : public input_source {
+public:
+	memory_source(const char *p, std::size_t n) : data(p), size(n) {}
+	explicit memory_source(const std::string &s)
+		: memory_source(s.data(), s.size()) {}
+	bool refill(image &) override;
+private:
+	const char *data;
+	std::size_t size;
+	bool done{false};
+};
+
+#endif
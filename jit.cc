@@ -0,0 +1,832 @@
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "image.h"
+
+#ifdef HAVE_JIT
+
+#include <sys/mman.h>
+
+/* The JIT.
+ *
+ * Compiled code runs with a pointer to a jit_context in rbx, guest
+ * registers r0-r7 in host registers r8d-r15d, the guest stack depth in
+ * rbp and the count of instructions executed in rdi. Everything else it
+ * needs (memory, the stack, the table of compiled blocks) is reached
+ * through the context. Code is entered and left through a small trampoline at the
+ * start of the code buffer that loads and saves the registers, so blocks
+ * can jump straight into each other.
+ *
+ * Any exit from compiled code leaves the address of the next instruction
+ * to run in the context, and run_jit() carries on from there in the
+ * interpreter until it finds another compiled or hot block.
+ *
+ * Each block adds its length to the count on the way in, and leaves
+ * again straight away if that goes past the limit run_jit() was given,
+ * so compiled code never runs over budget by even one instruction.
+ */
+
+// Everything compiled code touches, at fixed offsets.
+struct jit_context {
+	std::uint64_t regs[8];
+	std::uint64_t pc;
+	std::uint64_t count;
+	// Guest memory's page table.
+	const paged_memory::word *const *pages;
+	numtype *stack;
+	std::uint64_t sp;
+	std::uint64_t stack_cap;
+	const void *const *blocks;
+	image *vm;
+	// Blocks exit before they start if running them would take count
+	// past this.
+	std::uint64_t limit;
+	// hook_table::table(), for calls through a register.
+	const std::uint8_t *natives;
+};
+
+class jit_compiler {
+public:
+	explicit jit_compiler(image &);
+	~jit_compiler();
+	jit_compiler(const jit_compiler &) = delete;
+	jit_compiler &operator=(const jit_compiler &) = delete;
+
+	// Compiled code for a block starting at addr, or nullptr.
+	const void *entry(numtype addr) const { return blocks[addr]; }
+	// Note one interpreted execution of addr. True if it should be compiled.
+	bool hot(numtype addr);
+	bool compile(numtype addr);
+	// Run compiled code until it exits, for at most limit instructions.
+	// Returns how many it ran.
+	std::uint64_t enter(const void *code, std::uint64_t limit);
+	// Called by image::store() for every changed word.
+	void written(numtype addr);
+
+	std::uint64_t compiled{0}, flushes{0}, native{0};
+
+private:
+	static constexpr std::size_t buffer_size = 16 * 1024 * 1024;
+	static constexpr int max_block = 128;
+	static constexpr std::uint16_t threshold = 32;
+	static constexpr std::uint16_t never = 0xFFFF;
+
+	image &vm;
+	jit_context ctx;
+	std::uint8_t *buf, *cur;
+	std::uint8_t *exit_code, *code_start;
+	void (*trampoline)(jit_context *, const void *);
+	std::vector<const void *> blocks;
+	std::vector<std::uint16_t> heat;
+	// Words covered by compiled code, and words that have been
+	// overwritten after being compiled and so are never compiled again.
+	// For all of memory: stores can go anywhere, and an instruction just
+	// below M runs over into the words above it.
+	std::vector<bool> covered, dirty;
+	// Jumps to blocks that weren't compiled yet, waiting to be pointed
+	// at the real thing.
+	std::unordered_map<numtype, std::vector<std::uint8_t *>> pending;
+	bool flushed{false};
+
+	struct exit_stub {
+		std::uint8_t *site;
+		numtype pc;
+		int executed;
+		bool chain;
+	};
+	std::vector<exit_stub> stubs;
+
+	enum hreg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6,
+							RDI = 7, R8 = 8 };
+	static constexpr int guest(int r) { return R8 + r; }
+
+	// Where a guest argument lives: a register, or a literal.
+	struct operand {
+		bool reg;
+		numtype v;
+		int host(void) const { return guest(to_register(v)); }
+	};
+
+	void flush(void);
+	void load_context(void);
+	void save_context(void);
+
+	static std::uint64_t wmem_helper(jit_context *, std::uint64_t, std::uint64_t);
+	static void grow_helper(jit_context *);
+
+	// Instruction encoding.
+	void byte(std::uint8_t b) { *cur++ = b; }
+	void dword(std::uint32_t d) { std::memcpy(cur, &d, 4); cur += 4; }
+	void qword(std::uint64_t q) { std::memcpy(cur, &q, 8); cur += 8; }
+	void rex(bool w, int r, int x, int b);
+	void modrm_reg(int reg, int rm) { byte(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+	void modrm_ctx(int reg, int disp);
+	void modrm_index(int reg, int base, int index, int scale);
+	void alu_rr(std::uint8_t op, int dst, int src);
+	void alu_ri(int ext, int dst, std::uint32_t imm);
+	void mov_rr(int dst, int src) { alu_rr(0x89, dst, src); }
+	void mov_ri(int dst, std::uint32_t imm);
+	void mov_r64_i64(int dst, std::uint64_t imm);
+	void load_ctx32(int dst, int disp);
+	void load_ctx64(int dst, int disp);
+	void store_ctx64(int disp, int src);
+	void push(int r) { rex(false, 0, 0, r); byte(0x50 | (r & 7)); }
+	void pop(int r) { rex(false, 0, 0, r); byte(0x58 | (r & 7)); }
+	std::uint8_t *jmp32(void) { byte(0xE9); dword(0); return cur - 4; }
+	std::uint8_t *jcc32(std::uint8_t cc) {
+		byte(0x0F); byte(0x80 | cc); dword(0); return cur - 4;
+	}
+	std::uint8_t *jcc8(std::uint8_t cc) { byte(0x70 | cc); byte(0); return cur - 1; }
+	static void patch32(std::uint8_t *site, const void *target);
+	void patch8(std::uint8_t *site) { *site = cur - (site + 1); }
+	void load_word(int dst, int base, int index, int size = sizeof(numtype));
+	void store_word(int base, int index, const operand &);
+	void get(int dst, const operand &o);
+	void call_helper(const void *);
+
+	// Guest level pieces.
+	void exit_to(std::uint8_t *site, numtype pc, int executed, bool chain);
+	void jump_to(numtype target, int executed);
+	void jump_dynamic(void);
+	void emit_push(const operand &);
+	void emit_pop(int dst, numtype pc, int executed);
+	void emit_stubs(int total);
+};
+
+constexpr std::size_t jit_compiler::buffer_size;
+constexpr int jit_compiler::max_block;
+constexpr std::uint16_t jit_compiler::threshold;
+constexpr std::uint16_t jit_compiler::never;
+
+#define CTX(field) static_cast<int>(offsetof(jit_context, field))
+
+jit_compiler::jit_compiler(image &vm_)
+	: vm(vm_), blocks(2 * M, nullptr), heat(M, 0), covered(65536, false),
+		dirty(65536, false) {
+	void *p = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+								 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		throw std::runtime_error{"Unable to allocate JIT code buffer."};
+	buf = cur = static_cast<std::uint8_t *>(p);
+
+	ctx.blocks = blocks.data();
+	ctx.vm = &vm;
+	ctx.natives = vm.natives.table();
+
+	// Entry: trampoline(context, code)
+	trampoline = reinterpret_cast<void (*)(jit_context *, const void *)>(cur);
+	push(RBX);
+	push(RBP);
+	for (int r = 12; r <= 15; r += 1)
+		push(r);
+	alu_ri(5, RSP, 8); // sub rsp, 8 to keep calls 16 byte aligned
+	rex(true, RDI, 0, RBX);
+	byte(0x89);
+	modrm_reg(RDI, RBX); // mov rbx, rdi
+	for (int r = 0; r < 8; r += 1)
+		load_ctx32(guest(r), CTX(regs) + 8 * r);
+	load_ctx64(RBP, CTX(sp));
+	load_ctx64(RDI, CTX(count));
+	byte(0xFF); modrm_reg(4, RSI); // jmp rsi
+
+	// Exit: registers back to the context and return to C++.
+	exit_code = cur;
+	for (int r = 0; r < 8; r += 1)
+		store_ctx64(CTX(regs) + 8 * r, guest(r));
+	store_ctx64(CTX(sp), RBP);
+	store_ctx64(CTX(count), RDI);
+	alu_ri(0, RSP, 8);
+	for (int r = 15; r >= 12; r -= 1)
+		pop(r);
+	pop(RBP);
+	pop(RBX);
+	byte(0xC3);
+	code_start = cur;
+}
+
+jit_compiler::~jit_compiler() {
+	munmap(buf, buffer_size);
+}
+
+void jit_compiler::rex(bool w, int r, int x, int b) {
+	std::uint8_t v = 0x40 | w << 3 | (r >> 3) << 2 | (x >> 3) << 1 | (b >> 3);
+	if (v != 0x40)
+		byte(v);
+}
+
+// [rbx + disp32]
+void jit_compiler::modrm_ctx(int reg, int disp) {
+	byte(0x80 | (reg & 7) << 3 | RBX);
+	dword(disp);
+}
+
+// [base + index * scale], base not rbp/r13.
+void jit_compiler::modrm_index(int reg, int base, int index, int scale) {
+	static const std::uint8_t ss[9] = { 0, 0, 1, 0, 2, 0, 0, 0, 3 };
+	byte(0x04 | (reg & 7) << 3);
+	byte(ss[scale] << 6 | (index & 7) << 3 | (base & 7));
+}
+
+// 32 bit op r/m32, r32
+void jit_compiler::alu_rr(std::uint8_t op, int dst, int src) {
+	rex(false, src, 0, dst);
+	byte(op);
+	modrm_reg(src, dst);
+}
+
+// 32 bit op r/m32, imm32 (64 bit when used on rsp).
+void jit_compiler::alu_ri(int ext, int dst, std::uint32_t imm) {
+	rex(dst == RSP, 0, 0, dst);
+	byte(0x81);
+	modrm_reg(ext, dst);
+	dword(imm);
+}
+
+void jit_compiler::mov_ri(int dst, std::uint32_t imm) {
+	rex(false, 0, 0, dst);
+	byte(0xB8 | (dst & 7));
+	dword(imm);
+}
+
+void jit_compiler::mov_r64_i64(int dst, std::uint64_t imm) {
+	rex(true, 0, 0, dst);
+	byte(0xB8 | (dst & 7));
+	qword(imm);
+}
+
+void jit_compiler::load_ctx32(int dst, int disp) {
+	rex(false, dst, 0, RBX);
+	byte(0x8B);
+	modrm_ctx(dst, disp);
+}
+
+void jit_compiler::load_ctx64(int dst, int disp) {
+	rex(true, dst, 0, RBX);
+	byte(0x8B);
+	modrm_ctx(dst, disp);
+}
+
+void jit_compiler::store_ctx64(int disp, int src) {
+	rex(true, src, 0, RBX);
+	byte(0x89);
+	modrm_ctx(src, disp);
+}
+
+void jit_compiler::patch32(std::uint8_t *site, const void *target) {
+	std::int32_t rel = static_cast<const std::uint8_t *>(target) - (site + 4);
+	std::memcpy(site, &rel, 4);
+}
+
+// dst = the size byte word at [base + index * size], zero extended. Size
+// is 2 or 4 (or 8, of which only the low half is loaded).
+void jit_compiler::load_word(int dst, int base, int index, int size) {
+	rex(false, dst, index, base);
+	if (size == 2) {
+		byte(0x0F);
+		byte(0xB7);
+	} else {
+		byte(0x8B);
+	}
+	modrm_index(dst, base, index, size);
+}
+
+// numtype at [base + index * sizeof(numtype)] = o
+void jit_compiler::store_word(int base, int index, const operand &o) {
+	if (o.reg) {
+		int src = o.host();
+		if (sizeof(numtype) == 2)
+			byte(0x66);
+		rex(sizeof(numtype) == 8, src, index, base);
+		byte(0x89);
+		modrm_index(src, base, index, sizeof(numtype));
+	} else {
+		if (sizeof(numtype) == 2)
+			byte(0x66);
+		rex(sizeof(numtype) == 8, 0, index, base);
+		byte(0xC7);
+		modrm_index(0, base, index, sizeof(numtype));
+		if (sizeof(numtype) == 2) {
+			byte(o.v & 0xFF);
+			byte(o.v >> 8);
+		} else {
+			dword(o.v);
+		}
+	}
+}
+
+// dst = value of a guest argument
+void jit_compiler::get(int dst, const operand &o) {
+	if (o.reg)
+		mov_rr(dst, o.host());
+	else
+		mov_ri(dst, o.v);
+}
+
+// Call a C++ helper with the context as its first argument. Guest
+// registers in caller saved host registers get preserved around it, and
+// the stack depth and count go through the context.
+void jit_compiler::call_helper(const void *fn) {
+	store_ctx64(CTX(sp), RBP);
+	store_ctx64(CTX(count), RDI);
+	for (int r = 0; r < 4; r += 1)
+		push(guest(r));
+	rex(true, RBX, 0, RDI);
+	byte(0x89);
+	modrm_reg(RBX, RDI); // mov rdi, rbx
+	mov_r64_i64(RAX, reinterpret_cast<std::uint64_t>(fn));
+	byte(0xFF);
+	modrm_reg(2, RAX); // call rax
+	for (int r = 3; r >= 0; r -= 1)
+		pop(guest(r));
+	load_ctx64(RBP, CTX(sp));
+	load_ctx64(RDI, CTX(count));
+}
+
+// Leave compiled code, continuing at pc. The jump at site gets pointed at
+// an exit stub after the block; stubs for chainable jumps get pointed
+// straight at the target block if and when it's compiled.
+void jit_compiler::exit_to(std::uint8_t *site, numtype pc, int executed,
+													 bool chain) {
+	stubs.push_back(exit_stub{site, pc, executed, chain});
+}
+
+// Emit a jump to the block at target, chaining to it if it's compiled.
+void jit_compiler::jump_to(numtype target, int executed) {
+	std::uint8_t *site = jmp32();
+	if (blocks[target])
+		patch32(site, blocks[target]);
+	else
+		exit_to(site, target, executed, true);
+}
+
+// Jump to the guest address in eax, through the table of compiled blocks.
+// The table covers every 16 bit value, so there's no range check.
+void jit_compiler::jump_dynamic(void) {
+	load_ctx64(RCX, CTX(blocks));
+	rex(true, RCX, RAX, RCX);
+	byte(0x8B);
+	modrm_index(RCX, RCX, RAX, 8); // mov rcx, [rcx + rax * 8]
+	rex(true, RCX, 0, RCX);
+	byte(0x85);
+	modrm_reg(RCX, RCX); // test rcx, rcx
+	std::uint8_t *missing = jcc8(0x4); // jz
+	byte(0xFF);
+	modrm_reg(4, RCX); // jmp rcx
+	patch8(missing);
+	store_ctx64(CTX(pc), RAX);
+	patch32(jmp32(), exit_code);
+}
+
+void jit_compiler::emit_push(const operand &o) {
+	rex(true, RBP, 0, RBX);
+	byte(0x3B);
+	modrm_ctx(RBP, CTX(stack_cap)); // cmp rbp, [stack_cap]
+	std::uint8_t *room = jcc8(0x2); // jb
+	call_helper(reinterpret_cast<const void *>(&grow_helper));
+	patch8(room);
+	load_ctx64(RCX, CTX(stack));
+	store_word(RCX, RBP, o);
+	rex(true, 0, 0, RBP);
+	byte(0x83);
+	modrm_reg(0, RBP);
+	byte(1); // add rbp, 1
+}
+
+// Pop the top of the stack into dst, or leave compiled code at pc if the
+// stack is empty.
+void jit_compiler::emit_pop(int dst, numtype pc, int executed) {
+	rex(true, RBP, 0, RBP);
+	byte(0x85);
+	modrm_reg(RBP, RBP); // test rbp, rbp
+	exit_to(jcc32(0x4), pc, executed, false);
+	rex(true, 0, 0, RBP);
+	byte(0x83);
+	modrm_reg(5, RBP);
+	byte(1); // sub rbp, 1
+	load_ctx64(RCX, CTX(stack));
+	load_word(dst, RCX, RBP);
+}
+
+// Write out the exit stubs collected while compiling a block of total
+// instructions. Instructions after the exit weren't run, and come back
+// off the count added at the top of the block.
+void jit_compiler::emit_stubs(int total) {
+	for (auto &st : stubs) {
+		patch32(st.site, cur);
+		if (st.chain)
+			pending[st.pc].push_back(st.site);
+		rex(true, 0, 0, RBX);
+		byte(0xC7);
+		modrm_ctx(0, CTX(pc));
+		dword(st.pc); // mov qword [pc], imm32
+		if (st.executed != total) {
+			rex(true, 0, 0, RDI);
+			byte(0x81);
+			modrm_reg(5, RDI);
+			dword(total - st.executed); // sub rdi, imm32
+		}
+		patch32(jmp32(), exit_code);
+	}
+	stubs.clear();
+}
+
+bool jit_compiler::hot(numtype addr) {
+	std::uint16_t &h = heat[addr];
+	if (h == never)
+		return false;
+	h += 1;
+	return h >= threshold;
+}
+
+void jit_compiler::flush(void) {
+	cur = code_start;
+	std::fill(blocks.begin(), blocks.end(), nullptr);
+	std::fill(covered.begin(), covered.end(), false);
+	pending.clear();
+	flushes += 1;
+	flushed = true;
+}
+
+void jit_compiler::written(numtype addr) {
+	if (covered[addr]) {
+		dirty[addr] = true;
+		flush();
+	}
+}
+
+// Translate the block starting at start. Returns false if nothing at all
+// could be compiled there, which also stops it being tried again.
+bool jit_compiler::compile(numtype start) {
+	const auto &mem = vm.mem;
+
+	if (buf + buffer_size - cur < 64 * 1024)
+		flush();
+
+	std::uint8_t *block = cur;
+	rex(true, 0, 0, RDI);
+	byte(0x81);
+	modrm_reg(0, RDI); // add rdi, total
+	std::uint8_t *total_site = cur;
+	dword(0);
+	rex(true, RDI, 0, RBX);
+	byte(0x3B);
+	modrm_ctx(RDI, CTX(limit)); // cmp rdi, [limit]
+	exit_to(jcc32(0x7), start, 0, false); // ja
+
+	// Static jumps and calls are followed, so a block is really a trace
+	// through the program, but not around loops.
+	std::vector<numtype> trace;
+	auto follow = [&](numtype target) {
+		return target != start && target < M &&
+			std::find(trace.begin(), trace.end(), target) == trace.end();
+	};
+
+	numtype addr = start;
+	int n = 0;
+	bool done = false;
+	while (!done) {
+		if (n == max_block || addr >= M) {
+			jump_to(addr, n);
+			break;
+		}
+		numtype op = mem[addr];
+		if (op >= oplen.size() || addr + oplen[op] > M) {
+			exit_to(jmp32(), addr, n, false);
+			break;
+		}
+		int len = oplen[op];
+		bool ok = true;
+		operand a[3];
+		for (int i = 0; i < len - 1; i += 1) {
+			numtype w = mem[addr + 1 + i];
+			ok = ok && !dirty[addr + 1 + i] && (is_number(w) || is_register(w));
+			a[i] = operand{is_register(w), w};
+		}
+		if (dirty[addr] || (writes_register(op) && !a[0].reg))
+			ok = false;
+		// in, out and halt are always left to the interpreter, and so are
+		// calls to native hooks.
+		if (!ok || op == 0 || op == 19 || op == 20 ||
+				(op == 17 && !a[0].reg && vm.natives.at(a[0].v))) {
+			if (n == 0)
+				break;
+			exit_to(jmp32(), addr, n, false);
+			break;
+		}
+
+		trace.push_back(addr);
+		numtype next = addr + len;
+		switch (op) {
+		case 1: // set
+			get(a[0].host(), a[1]);
+			break;
+		case 2: // push
+			emit_push(a[0]);
+			break;
+		case 3: // pop. Empty stack: let the interpreter complain.
+			emit_pop(a[0].host(), addr, n);
+			break;
+		case 4: // eq
+		case 5: // gt
+			get(RAX, a[1]);
+			if (a[2].reg)
+				alu_rr(0x39, RAX, a[2].host());
+			else
+				alu_ri(7, RAX, a[2].v);
+			byte(0x0F);
+			byte(op == 4 ? 0x94 : 0x97); // sete/seta
+			modrm_reg(0, RAX);
+			byte(0x0F);
+			byte(0xB6);
+			modrm_reg(RAX, RAX); // movzx eax, al
+			mov_rr(a[0].host(), RAX);
+			break;
+		case 6: // jmp
+			if (a[0].reg) {
+				get(RAX, a[0]);
+				jump_dynamic();
+			} else if (follow(a[0].v)) {
+				next = a[0].v;
+				break;
+			} else {
+				jump_to(a[0].v, n + 1);
+			}
+			done = true;
+			break;
+		case 7: // jt
+		case 8: // jf
+			if (!a[0].reg) {
+				bool taken = (a[0].v != 0) == (op == 7);
+				if (a[1].reg && taken) {
+					get(RAX, a[1]);
+					jump_dynamic();
+				} else {
+					jump_to(taken ? a[1].v : next, n + 1);
+				}
+				done = true;
+				break;
+			}
+			alu_rr(0x85, a[0].host(), a[0].host()); // test r, r
+			if (a[1].reg) {
+				std::uint8_t *skip = jcc8(op == 7 ? 0x4 : 0x5);
+				get(RAX, a[1]);
+				jump_dynamic();
+				patch8(skip);
+			} else {
+				std::uint8_t *site = jcc32(op == 7 ? 0x5 : 0x4); // jnz/jz
+				if (blocks[a[1].v])
+					patch32(site, blocks[a[1].v]);
+				else
+					exit_to(site, a[1].v, n + 1, true);
+			}
+			jump_to(next, n + 1);
+			done = true;
+			break;
+		case 9: // add
+		case 12: // and
+		case 13: // or
+			get(RAX, a[1]);
+			{
+				std::uint8_t rr = op == 9 ? 0x01 : op == 12 ? 0x21 : 0x09;
+				int ext = op == 9 ? 0 : op == 12 ? 4 : 1;
+				if (a[2].reg)
+					alu_rr(rr, RAX, a[2].host());
+				else
+					alu_ri(ext, RAX, a[2].v);
+			}
+			if (op == 9)
+				alu_ri(4, RAX, M - 1);
+			mov_rr(a[0].host(), RAX);
+			break;
+		case 10: // mult
+			get(RAX, a[1]);
+			if (a[2].reg) {
+				rex(false, RAX, 0, a[2].host());
+				byte(0x0F);
+				byte(0xAF);
+				modrm_reg(RAX, a[2].host()); // imul eax, r
+			} else {
+				byte(0x69);
+				modrm_reg(RAX, RAX);
+				dword(a[2].v); // imul eax, eax, imm
+			}
+			alu_ri(4, RAX, M - 1);
+			mov_rr(a[0].host(), RAX);
+			break;
+		case 11: // mod
+			get(RAX, a[1]);
+			get(RCX, a[2]);
+			alu_rr(0x31, RDX, RDX); // xor edx, edx
+			byte(0xF7);
+			modrm_reg(6, RCX); // div ecx
+			mov_rr(a[0].host(), RDX);
+			break;
+		case 14: // not
+			get(RAX, a[1]);
+			alu_ri(6, RAX, M - 1);
+			alu_ri(4, RAX, M - 1);
+			mov_rr(a[0].host(), RAX);
+			break;
+		case 15: // rmem
+			// The page table covers every address, so no bounds check.
+			get(RAX, a[1]);
+			mov_rr(RCX, RAX);
+			byte(0xC1);
+			modrm_reg(5, RCX);
+			byte(paged_memory::page_bits); // shr ecx, page_bits
+			alu_ri(4, RAX, paged_memory::page_words - 1);
+			load_ctx64(RDX, CTX(pages));
+			rex(true, RDX, RCX, RDX);
+			byte(0x8B);
+			modrm_index(RDX, RDX, RCX, 8); // mov rdx, [rdx + rcx * 8]
+			load_word(RAX, RDX, RAX, sizeof(paged_memory::word));
+			mov_rr(a[0].host(), RAX);
+			break;
+		case 16: // wmem
+			// Address and value are the helper's second and third arguments.
+			get(RSI, a[0]);
+			get(RDX, a[1]);
+			call_helper(reinterpret_cast<const void *>(&wmem_helper));
+			alu_rr(0x85, RAX, RAX);
+			{
+				std::uint8_t *fine = jcc8(0x4); // jz
+				alu_ri(7, RAX, 1);
+				exit_to(jcc32(0x4), next, n + 1, false); // code changed
+				exit_to(jmp32(), addr, n, false); // bad address
+				patch8(fine);
+			}
+			break;
+		case 17: // call
+			if (a[0].reg && vm.natives.any()) {
+				get(RAX, a[0]);
+				load_ctx64(RCX, CTX(natives));
+				byte(0x80);
+				modrm_index(7, RCX, RAX, 1);
+				byte(0); // cmp byte [rcx + rax], 0
+				exit_to(jcc32(0x5), addr, n, false); // jnz
+			}
+			emit_push(operand{false, next});
+			if (a[0].reg) {
+				get(RAX, a[0]);
+				jump_dynamic();
+			} else if (follow(a[0].v)) {
+				next = a[0].v;
+				break;
+			} else {
+				jump_to(a[0].v, n + 1);
+			}
+			done = true;
+			break;
+		case 18: // ret. Empty stack: halt in the interpreter.
+			emit_pop(RAX, addr, n);
+			jump_dynamic();
+			done = true;
+			break;
+		case 21: // noop
+			break;
+		}
+		n += 1;
+		addr = next;
+	}
+
+	if (n == 0) {
+		cur = block;
+		stubs.clear();
+		heat[start] = never;
+		return false;
+	}
+
+	std::uint32_t total = n;
+	std::memcpy(total_site, &total, 4);
+	emit_stubs(n);
+
+	blocks[start] = block;
+	for (auto a : trace)
+		for (int i = 0; i < oplen[mem[a]]; i += 1)
+			covered[a + i] = true;
+	auto waiting = pending.find(start);
+	if (waiting != pending.end()) {
+		for (auto site : waiting->second)
+			patch32(site, block);
+		pending.erase(waiting);
+	}
+	compiled += 1;
+	return true;
+}
+
+void jit_compiler::load_context(void) {
+	std::copy(vm.cpu.regs.begin(), vm.cpu.regs.end(), ctx.regs);
+	ctx.count = 0;
+	ctx.pages = vm.mem.pages();
+	ctx.stack = vm.s.words.data();
+	ctx.sp = vm.s.n;
+	ctx.stack_cap = vm.s.words.size();
+}
+
+void jit_compiler::save_context(void) {
+	std::copy(ctx.regs, ctx.regs + 8, vm.cpu.regs.begin());
+	vm.s.n = ctx.sp;
+	vm.cpu.pc = ctx.pc;
+	vm.cpu.icount += ctx.count;
+	native += ctx.count;
+}
+
+std::uint64_t jit_compiler::enter(const void *code, std::uint64_t limit) {
+	load_context();
+	ctx.limit = limit;
+	trampoline(&ctx, code);
+	save_context();
+	return ctx.count;
+}
+
+// wmem from compiled code. Returns 0 to carry on, 1 if compiled code was
+// thrown away and the block has to exit, 2 if the interpreter should
+// redo the instruction.
+std::uint64_t jit_compiler::wmem_helper(jit_context *c, std::uint64_t addr,
+																				std::uint64_t v) {
+	image &vm = *c->vm;
+	jit_compiler &j = *vm.jit;
+	if (!is_number(addr))
+		return 2;
+	j.flushed = false;
+	vm.store(addr, v);
+	return j.flushed ? 1 : 0;
+}
+
+void jit_compiler::grow_helper(jit_context *c) {
+	word_stack &s = c->vm->s;
+	s.n = c->sp;
+	s.grow();
+	c->stack = s.words.data();
+	c->stack_cap = s.words.size();
+}
+
+#undef CTX
+
+void image::jit_invalidate(numtype addr) {
+	jit->written(addr);
+}
+
+// Run compiled code where there is some, and the interpreter elsewhere,
+// compiling blocks as they get hot.
+run_status image::run_jit(std::uint64_t max) {
+	if (!jit)
+		jit.reset(new jit_compiler{*this});
+	std::uint64_t start{cpu.icount};
+	while (cpu.pc < M) {
+		std::uint64_t done{cpu.icount - start};
+		if (done == max)
+			return run_status::budget_exhausted;
+		const void *code = jit->entry(cpu.pc);
+		if (code) {
+			// Nothing runs if the first block alone would go over budget, so
+			// fall through and interpret an instruction of it.
+			if (jit->enter(code, max - done) > 0)
+				continue;
+		} else if (jit->hot(cpu.pc) && jit->compile(cpu.pc)) {
+			continue;
+		}
+		step();
+		if (waiting) {
+			waiting = false;
+			return run_status::needs_input;
+		}
+		cpu.icount += 1;
+		if (halted)
+			return run_status::halted;
+	}
+	halted = true;
+	return run_status::halted;
+}
+
+void image::jit_stats(std::ostream &out) const {
+	if (jit)
+		out << "JIT: " << jit->compiled << " blocks compiled, " << jit->flushes
+				<< " flushes, " << jit->native << " instructions run natively.\n";
+}
+
+#else
+
+void image::jit_invalidate(numtype) {}
+
+run_status image::run_jit(std::uint64_t) {
+	throw std::runtime_error{"The JIT isn't supported on this platform."};
+}
+
+void image::jit_stats(std::ostream &) const {}
+
+#endif
+
+void image::jit_deleter::operator()(jit_compiler *j) const {
+#ifdef HAVE_JIT
+	delete j;
+#endif
+}
+
+image::~image() {}
@@ -0,0 +1,153 @@
+/* Native hooks: C++ stand-ins for guest routines, run in place of a call
+ * to them. See native_hook in image.h.
+ *
+ * Every engine checks for a hook on each call, which costs a byte load
+ * and a branch. The JIT leaves calls to a hooked literal address to the
+ * interpreter, and calls through a register check the table inline.
+ */
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+
+#include "image.h"
+#include "history.h"
+
+hook_table::hook_table() {
+	static const std::shared_ptr<std::vector<std::uint8_t>> none =
+		std::make_shared<std::vector<std::uint8_t>>(65536, 0);
+	flags = none;
+	bits = flags->data();
+}
+
+void hook_table::unshare(void) {
+	if (flags.use_count() != 1) {
+		flags = std::make_shared<std::vector<std::uint8_t>>(*flags);
+		bits = flags->data();
+	}
+}
+
+void hook_table::set(numtype addr, native_hook fn) {
+	unshare();
+	(*flags)[addr] = 1;
+	hooks[addr] = std::move(fn);
+}
+
+void hook_table::clear(numtype addr) {
+	unshare();
+	(*flags)[addr] = 0;
+	hooks.erase(addr);
+}
+
+// Compiled code knows which calls had hooks when it was compiled, so
+// it's thrown away whenever that changes.
+void image::set_native(numtype addr, native_hook fn) {
+	natives.set(addr, std::move(fn));
+	jit.reset();
+}
+
+void image::clear_native(numtype addr) {
+	natives.clear(addr);
+	jit.reset();
+}
+
+bool image::call_native(numtype addr, numtype *regs) {
+	std::array<numtype, 8> r;
+	std::copy(regs, regs + 8, r.begin());
+	if (!hist) {
+		if (!natives[addr](r, s, mem))
+			return false;
+		std::copy(r.begin(), r.end(), regs);
+		return true;
+	}
+
+	// Journal whatever it changed, as if the instructions that did it had
+	// run: each register, and the stack popped back to where the old and
+	// new ones part, then pushed back up.
+	std::vector<numtype> before(s.begin(), s.end());
+	if (!natives[addr](r, s, mem))
+		return false;
+	for (int i = 0; i < 8; i += 1)
+		if (r[i] != regs[i])
+			hist->record(history::reg, i, regs[i]);
+	std::size_t same{0};
+	while (same < before.size() && same < s.size() &&
+				 before[same] == s.begin()[same])
+		same += 1;
+	for (std::size_t i = before.size(); i > same; i -= 1)
+		hist->record(history::pop, 0, before[i - 1]);
+	for (std::size_t i = same; i < s.size(); i += 1)
+		hist->record(history::push, 0, 0);
+	std::copy(r.begin(), r.end(), regs);
+	return true;
+}
+
+namespace {
+
+// The teleporter's confirmation routine in the challenge, at 0x178B. A
+// variation on the Ackermann function with m in r0, n in r1 and r7 as
+// a parameter:
+//
+//   A(0, n) = n + 1
+//   A(m, 0) = A(m - 1, r7)
+//   A(m, n) = A(m - 1, A(m, n - 1))
+//
+// all mod 32768. It leaves A(m, n) in r0, and the n of the last A(0, n)
+// it got to, which is always A(m, n) - 1, in r1. The guest version
+// recurses billions of times for A(4, 1). Filling in A a row of m at a
+// time works out each A(m, n) once, for m * 32768 steps, and the last
+// row is kept for the next call.
+//
+// Copies of an image copy their hooks. The row is never changed once
+// it's filled in, only replaced, so copies share it instead of each
+// getting 64KB of their own, and can go on using it from other threads.
+constexpr numtype ackermann_entry{0x178B};
+const std::array<paged_memory::word, 41> ackermann_code{{
+	7, 32768, 6035, 9, 32768, 32769, 1, 18, 7, 32769, 6048, 9, 32768, 32768,
+	32767, 1, 32769, 32775, 17, 6027, 18, 2, 32768, 9, 32769, 32769, 32767,
+	17, 6027, 1, 32769, 32768, 3, 32768, 9, 32768, 32768, 32767, 17, 6027, 18
+}};
+
+class ackermann {
+public:
+	bool operator()(std::array<numtype, 8> &regs, word_stack &,
+									const paged_memory &mem) {
+		for (numtype i = 0; i < ackermann_code.size(); i += 1)
+			if (mem[ackermann_entry + i] != ackermann_code[i])
+				return false;
+		numtype m{fix15(regs[0])}, n{fix15(regs[1])}, r7{fix15(regs[7])};
+		if (!last || m != last->m || r7 != last->r7)
+			last = fill(m, r7);
+		regs[0] = last->a[n];
+		regs[1] = (last->a[n] + M - 1) % M;
+		return true;
+	}
+
+private:
+	// A(m, n) for every n.
+	struct row {
+		numtype m, r7;
+		std::vector<paged_memory::word> a;
+	};
+	std::shared_ptr<const row> last;
+
+	static std::shared_ptr<const row> fill(numtype m, numtype r7) {
+		std::vector<paged_memory::word> a(M), next(M);
+		for (numtype i = 0; i < M; i += 1)
+			a[i] = (i + 1) % M;
+		for (numtype k = 1; k <= m; k += 1) {
+			next[0] = a[r7];
+			for (numtype i = 1; i < M; i += 1)
+				next[i] = a[next[i - 1]];
+			a.swap(next);
+		}
+		return std::make_shared<const row>(row{m, r7, std::move(a)});
+	}
+};
+
+}
+
+void add_builtin_natives(image &vm) {
+	vm.set_native(ackermann_entry, ackermann{});
+}
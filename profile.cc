@@ -0,0 +1,261 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <array>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <cctype>
+#include <cstdint>
+
+#include "image.h"
+#include "profile.h"
+
+namespace {
+
+const std::array<const char *, 22> opnames{{
+	"halt", "set", "push", "pop", "eq", "gt", "jmp", "jt", "jf", "add",
+	"mult", "mod", "and", "or", "not", "rmem", "wmem", "call", "ret", "out",
+	"in", "noop"
+}};
+
+// How many of the top instructions, loops and routines get listed.
+constexpr std::size_t top_instructions = 40;
+constexpr std::size_t top_loops = 10;
+constexpr std::size_t top_routines = 30;
+
+void value(std::ostream &out, numtype v) {
+	if (is_register(v))
+		out << " r" << to_register(v);
+	else
+		out << ' ' << std::dec << v;
+}
+
+void address(std::ostream &out, numtype v) {
+	if (is_register(v))
+		out << " r" << to_register(v);
+	else
+		out << " 0x" << std::hex << std::uppercase << std::setw(4)
+				<< std::setfill('0') << v << std::setfill(' ') << std::nouppercase
+				<< std::dec;
+}
+
+double percent(std::uint64_t part, std::uint64_t whole) {
+	return whole > 0 ? 100.0 * part / whole : 0;
+}
+
+void line(std::ostream &out, numtype addr, std::uint64_t count,
+					std::uint64_t total, const paged_memory &mem) {
+	paged_memory::word scratch[4];
+	out << "  0x" << std::hex << std::uppercase << std::setw(4)
+			<< std::setfill('0') << addr << std::setfill(' ') << std::nouppercase
+			<< std::dec << std::setw(14) << count << std::setw(7) << std::fixed
+			<< std::setprecision(2) << percent(count, total) << "%  ";
+	disassemble(out, mem.fetch(addr, scratch));
+	out << '\n';
+}
+
+}
+
+constexpr std::uint32_t profile::max_depth;
+constexpr std::size_t profile::max_unwind;
+
+profile::profile(std::uint64_t now)
+	: hits(M, 0), back_edges(M, 0), loop_heads(M, 0), routines(M),
+		charged(now) {
+	nodes.push_back({M, 0, 0, 0});
+	frames.push_back({M, M, 0});
+}
+
+std::uint32_t profile::child(std::uint32_t parent, numtype entry) {
+	std::uint64_t key{std::uint64_t{parent} << 16 | entry};
+	auto found = children.find(key);
+	if (found != children.end())
+		return found->second;
+	std::uint32_t id = nodes.size();
+	nodes.push_back({entry, parent, nodes[parent].depth + 1, 0});
+	children.emplace(key, id);
+	return id;
+}
+
+int disassemble(std::ostream &out, const paged_memory::word *words) {
+	numtype op = words[0];
+	if (op >= opnames.size()) {
+		out << ".word " << op;
+		return 1;
+	}
+	out << opnames[op];
+	int len = oplen[op];
+	for (int i = 1; i < len; i += 1) {
+		numtype v = words[i];
+		switch (op) {
+		case 19: // out
+			if (v == '\'')
+				out << " '\\''";
+			else if (v < 128 && std::isprint(v))
+				out << " '" << static_cast<char>(v) << '\'';
+			else if (v == '\n')
+				out << " '\\n'";
+			else
+				value(out, v);
+			break;
+		case 7: // jt
+		case 8: // jf
+		case 15: // rmem
+			if (i == 2)
+				address(out, v);
+			else
+				value(out, v);
+			break;
+		case 6: // jmp
+		case 16: // wmem
+		case 17: // call
+			if (i == 1)
+				address(out, v);
+			else
+				value(out, v);
+			break;
+		default:
+			value(out, v);
+		}
+	}
+	return len;
+}
+
+void profile::report(std::ostream &out, const paged_memory &mem,
+										 std::uint64_t now) const {
+	std::uint64_t total{std::accumulate(ops.begin(), ops.end(), std::uint64_t{0})};
+	out << "Profile of " << total << " instructions.\n\nBy opcode:\n";
+	std::vector<numtype> order(ops.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(),
+		[this](numtype a, numtype b) { return ops[a] > ops[b]; });
+	for (numtype op : order)
+		if (ops[op] > 0)
+			out << "  " << std::left << std::setw(6) << opnames[op] << std::right
+					<< std::setw(14) << ops[op] << std::setw(7) << std::fixed
+					<< std::setprecision(2) << percent(ops[op], total) << "%\n";
+
+	// A loop is everything from where a backwards jump goes to the jump
+	// itself. Calls out of it aren't counted as part of it.
+	struct loop {
+		numtype head, tail;
+		std::uint64_t iterations, instructions;
+	};
+	std::vector<loop> loops;
+	for (numtype addr = 0; addr < M; addr += 1) {
+		if (back_edges[addr] == 0)
+			continue;
+		loop l{loop_heads[addr], addr, back_edges[addr], 0};
+		for (numtype a = l.head; a <= l.tail; a += 1)
+			l.instructions += hits[a];
+		loops.push_back(l);
+	}
+	std::stable_sort(loops.begin(), loops.end(),
+		[](const loop &a, const loop &b) { return a.instructions > b.instructions; });
+	if (loops.size() > top_loops)
+		loops.resize(top_loops);
+	out << "\nHot loops:\n";
+	for (const loop &l : loops) {
+		out << "0x" << std::hex << std::uppercase << std::setw(4)
+				<< std::setfill('0') << l.head << "-0x" << std::setw(4) << l.tail
+				<< std::setfill(' ') << std::nouppercase << std::dec << ": "
+				<< l.iterations << " iterations, " << l.instructions
+				<< " instructions (" << std::fixed << std::setprecision(2)
+				<< percent(l.instructions, total) << "%)\n";
+		for (numtype a = l.head; a <= l.tail; a += 1)
+			if (hits[a] > 0)
+				line(out, a, hits[a], total, mem);
+	}
+
+	std::vector<numtype> hot;
+	for (numtype addr = 0; addr < M; addr += 1)
+		if (hits[addr] > 0)
+			hot.push_back(addr);
+	std::stable_sort(hot.begin(), hot.end(),
+		[this](numtype a, numtype b) { return hits[a] > hits[b]; });
+	if (hot.size() > top_instructions)
+		hot.resize(top_instructions);
+	out << "\nHot instructions:\n";
+	for (numtype addr : hot)
+		line(out, addr, hits[addr], total, mem);
+
+	// Routines still running are charged up to now, as if they'd returned.
+	struct charged_routine {
+		numtype entry;
+		std::uint64_t calls, inclusive, exclusive;
+	};
+	std::vector<charged_routine> called;
+	for (numtype entry = 0; entry < M; entry += 1) {
+		const routine &r = routines[entry];
+		if (r.calls == 0)
+			continue;
+		charged_routine c{entry, r.calls, r.inclusive, r.exclusive};
+		if (r.active > 0)
+			c.inclusive += now - r.outermost;
+		if (frames.size() > 1 && frames.back().entry == entry)
+			c.exclusive += now - charged;
+		called.push_back(c);
+	}
+	std::stable_sort(called.begin(), called.end(),
+		[](const charged_routine &a, const charged_routine &b) {
+			return a.inclusive > b.inclusive;
+		});
+	if (called.size() > top_routines)
+		called.resize(top_routines);
+	out << "\nRoutines:\n  Entry          Calls     Inclusive        "
+		"Exclusive\n";
+	for (const charged_routine &c : called)
+		out << "  0x" << std::hex << std::uppercase << std::setw(4)
+				<< std::setfill('0') << c.entry << std::setfill(' ')
+				<< std::nouppercase << std::dec << std::setw(13) << c.calls
+				<< std::setw(14) << c.inclusive << std::setw(7) << std::fixed
+				<< std::setprecision(2) << percent(c.inclusive, total) << '%'
+				<< std::setw(14) << c.exclusive << std::setw(7)
+				<< percent(c.exclusive, total) << "%\n";
+	out << mismatched << " rets went somewhere no call on the stack would "
+		"have returned to.\n";
+}
+
+void profile::folded(std::ostream &out, std::uint64_t now) const {
+	std::vector<std::uint64_t> exclusive(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i += 1)
+		exclusive[i] = nodes[i].exclusive;
+	exclusive[frames.back().node] += now - charged;
+
+	std::vector<numtype> chain;
+	for (std::size_t i = 0; i < nodes.size(); i += 1) {
+		if (exclusive[i] == 0)
+			continue;
+		chain.clear();
+		for (std::uint32_t n = i; n != 0; n = nodes[n].parent)
+			chain.push_back(nodes[n].entry);
+		out << "top";
+		for (auto entry = chain.rbegin(); entry != chain.rend(); ++entry)
+			out << ";0x" << std::hex << std::uppercase << std::setw(4)
+					<< std::setfill('0') << *entry << std::setfill(' ')
+					<< std::nouppercase << std::dec;
+		out << ' ' << exclusive[i] << '\n';
+	}
+}
+
+void image::profile_deleter::operator()(profile *p) const {
+	delete p;
+}
+
+void image::set_profiling(bool on) {
+	if (on && !prof)
+		prof.reset(new profile{cpu.icount});
+	else if (!on)
+		prof.reset();
+}
+
+void image::profile_report(std::ostream &out) const {
+	if (prof)
+		prof->report(out, mem, cpu.icount);
+}
+
+void image::profile_folded(std::ostream &out) const {
+	if (prof)
+		prof->folded(out, cpu.icount);
+}
@@ -0,0 +1,148 @@
+/* Where a program spends its time.
+ *
+ * With profiling turned on, run_for() runs everything through a copy of
+ * run_threaded() that also counts how many times each address and each
+ * opcode is executed, and how many times each backwards jump is taken.
+ * The copy is a separate instantiation, so running without profiling
+ * costs exactly what it always did. Debug mode goes through run_table(),
+ * and isn't profiled, while it's stepping, recording or watching memory;
+ * with only breakpoints set, it's the threaded engine and is.
+ *
+ * call and ret also drive a shadow call stack, which charges every
+ * instruction to the routine (The address a call went to) it ran in, and
+ * to the chain of calls that got there. Programs don't always use ret
+ * the way call meant it to be used: a ret to an address no call on the
+ * shadow stack pushed is taken to be a computed jump, and a ret to one
+ * further down unwinds everything above it.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <iosfwd>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+
+#include "image.h"
+
+class profile {
+public:
+	// now is the instruction count profiling starts at.
+	explicit profile(std::uint64_t now);
+
+	void count(numtype addr, numtype op) {
+		hits[addr] += 1;
+		ops[op] += 1;
+	}
+	// Take back a count() for an instruction that didn't run after all.
+	void uncount(numtype addr, numtype op) {
+		hits[addr] -= 1;
+		ops[op] -= 1;
+	}
+	// A jump from addr back to head, which is taken as the top of a loop.
+	void back_edge(numtype addr, numtype head) {
+		back_edges[addr] += 1;
+		loop_heads[addr] = head;
+	}
+
+	// A call to entry that will return to ret. now is the instruction
+	// count, including the call.
+	void call(numtype entry, numtype ret, std::uint64_t now) {
+		// Calls past the end of memory halt, so they don't go anywhere.
+		if (entry >= M)
+			return;
+		charge(now);
+		std::uint32_t node{frames.back().node};
+		// Direct recursion stays in the same node, and so does anything
+		// past max_depth, so deep recursion can't blow up the tree.
+		if (nodes[node].entry != entry && nodes[node].depth < max_depth)
+			node = child(node, entry);
+		if (routines[entry].active++ == 0)
+			routines[entry].outermost = now;
+		routines[entry].calls += 1;
+		frames.push_back({entry, ret, node});
+	}
+	// A ret to the address to.
+	void ret(numtype to, std::uint64_t now) {
+		std::size_t i{frames.size() - 1};
+		std::size_t bottom{i > max_unwind ? i - max_unwind : 0};
+		while (i > bottom && frames[i].ret != to)
+			i -= 1;
+		if (i == 0 || frames[i].ret != to) {
+			mismatched += 1;
+			return;
+		}
+		charge(now);
+		while (frames.size() > i) {
+			routine &r = routines[frames.back().entry];
+			if (--r.active == 0)
+				r.inclusive += now - r.outermost;
+			frames.pop_back();
+		}
+	}
+
+	// The instructions, loops and routines that ran the most, biggest
+	// first, with the instructions as they are in mem now.
+	void report(std::ostream &, const paged_memory &mem, std::uint64_t now) const;
+	// One line per call chain, with the instructions run in the last
+	// routine of it, in the folded format flame graph tools read.
+	void folded(std::ostream &, std::uint64_t now) const;
+
+private:
+	std::vector<std::uint64_t> hits;
+	std::array<std::uint64_t, 22> ops{{}};
+	// By the address of the jump. Only the last place each one went is
+	// kept, which for jumps to a literal address is the only place.
+	std::vector<std::uint64_t> back_edges;
+	std::vector<numtype> loop_heads;
+
+	static constexpr std::uint32_t max_depth = 256;
+	// How far down the shadow stack a ret looks for its address.
+	static constexpr std::size_t max_unwind = 64;
+
+	// By entry address.
+	struct routine {
+		std::uint64_t calls{0}, inclusive{0}, exclusive{0};
+		// How many times it's on the shadow stack, and when the bottom one
+		// was called. Recursive calls only count towards inclusive once.
+		std::uint32_t active{0};
+		std::uint64_t outermost{0};
+	};
+	std::vector<routine> routines;
+	// A tree of call chains. Node 0 is the root, for code that isn't in
+	// any routine, and its entry is M.
+	struct node {
+		numtype entry;
+		std::uint32_t parent, depth;
+		std::uint64_t exclusive;
+	};
+	std::vector<node> nodes;
+	std::unordered_map<std::uint64_t, std::uint32_t> children;
+	struct frame {
+		numtype entry, ret;
+		std::uint32_t node;
+	};
+	// frames[0] stands for the root, and is never popped.
+	std::vector<frame> frames;
+	// When the routine on top of frames was last charged up to.
+	std::uint64_t charged;
+	std::uint64_t mismatched{0};
+
+	// Give the routine running now everything since it was last charged.
+	void charge(std::uint64_t now) {
+		const frame &top = frames.back();
+		nodes[top.node].exclusive += now - charged;
+		if (top.node != 0)
+			routines[top.entry].exclusive += now - charged;
+		charged = now;
+	}
+	std::uint32_t child(std::uint32_t parent, numtype entry);
+};
+
+// Write out the instruction in words the way disassem.pl would, and
+// return its length.
+int disassemble(std::ostream &, const paged_memory::word *words);
+
+#endif
@@ -0,0 +1,675 @@
+/* Server for the Synacor Challenge VM, with a session of the image for
+ * every connection. */
+
+
+/* Usage: vm-server [-s -H -j THREADS -q QUOTA -n COUNT -e ENGINE] -u PATH|-p PORT IMGFILE
+*
+* Listens on the Unix domain socket PATH, or on PORT on localhost, and
+* starts a copy of IMGFILE for each connection, with what the client sends
+* as its input and its output sent back. The image is only loaded once;
+* every session starts out as a copy-on-write clone of it, so an idle one
+* only costs the memory it has written to, and about 14KB more, most of
+* it the page table and the output buffer. A session whose client isn't
+* reading what it prints stops getting turns while a megabyte of that is
+* waiting to be sent.
+*
+* Options: -s IMGFILE is a saved state from a previous session
+*          -H Run guest routines as they are, without native hooks.
+*          -j THREADS Number of threads running sessions. Defaults to one
+*                     per core.
+*          -q QUOTA Instructions a session runs before the next one that's
+*                   ready gets a turn. Defaults to 100000.
+*          -n COUNT End a session after COUNT instructions.
+*          -e ENGINE Execution engine, as for vm. Defaults to threaded;
+*                    decoded and jit keep big caches for each session.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "snapshot.h"
+
+// Output from a slice of running, for the event loop to send.
+class string_sink : public output_sink {
+public:
+	void write(const char *p, std::size_t n) override { data.append(p, n); }
+	std::string take(void) {
+		std::string taken;
+		taken.swap(data);
+		return taken;
+	}
+private:
+	std::string data;
+};
+
+// One connection. The event loop owns the socket and what's waiting to be
+// written to it, and only the worker running the session touches vm. The
+// rest is shared, under lock.
+struct session {
+	// throttled is ready to run, but held back until the client has read
+	// some of its output.
+	enum class state { waiting, queued, running, throttled, finished };
+
+	session(int fd, const image &base) : fd(fd), vm(base) {
+		vm.set_output(produced);
+	}
+
+	const int fd;
+	image vm;
+	string_sink produced;
+
+	std::mutex lock;
+	state st{state::queued};
+	// Input that hasn't been fed to vm yet. Only whole lines are.
+	std::string input;
+	// Output for the event loop to pick up.
+	std::string output;
+	// The client won't send any more. The session ends once it's used up
+	// what it has.
+	bool eof{false};
+	// The connection's gone, so there's no point running it any more.
+	bool cancelled{false};
+	// How much of its output the event loop has yet to send.
+	std::size_t backlog{0};
+
+	// The event loop's: output the socket wouldn't take yet, and whether
+	// it's waiting for it to take more.
+	std::string unsent;
+	bool writing{false};
+};
+
+using session_ptr = std::shared_ptr<session>;
+
+// Output a session can have waiting to be sent before it stops getting
+// turns, so that a client that doesn't read can't make it grow forever.
+constexpr std::size_t max_backlog{1 << 20};
+
+// Sessions ready to run, first come first served. A session that runs
+// out of quota goes to the back.
+class run_queue {
+public:
+	void push(session_ptr s) {
+		std::lock_guard<std::mutex> hold(lock);
+		ready.push_back(std::move(s));
+		more.notify_one();
+	}
+	// Null once stop() has been called.
+	session_ptr pop(void) {
+		std::unique_lock<std::mutex> hold(lock);
+		more.wait(hold, [this](void) { return stopping || !ready.empty(); });
+		if (stopping)
+			return nullptr;
+		session_ptr s{std::move(ready.front())};
+		ready.pop_front();
+		return s;
+	}
+	void stop(void) {
+		std::lock_guard<std::mutex> hold(lock);
+		stopping = true;
+		more.notify_all();
+	}
+
+private:
+	std::mutex lock;
+	std::condition_variable more;
+	std::deque<session_ptr> ready;
+	bool stopping{false};
+};
+
+// Sessions with something for the event loop to do, and the eventfd that
+// wakes it up to do it.
+class mailbox {
+public:
+	mailbox() : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+		if (fd < 0)
+			throw std::runtime_error{"Unable to create an eventfd."};
+	}
+	~mailbox() { close(fd); }
+	void post(session_ptr s) {
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			posted.push_back(std::move(s));
+		}
+		std::uint64_t one{1};
+		if (::write(fd, &one, sizeof one) < 0 && errno != EAGAIN)
+			std::cerr << "Unable to wake the event loop.\n";
+	}
+	std::vector<session_ptr> collect(void) {
+		std::uint64_t count;
+		while (::read(fd, &count, sizeof count) > 0)
+			;
+		std::vector<session_ptr> taken;
+		std::lock_guard<std::mutex> hold(lock);
+		taken.swap(posted);
+		return taken;
+	}
+	const int fd;
+
+private:
+	std::mutex lock;
+	std::vector<session_ptr> posted;
+};
+
+// Everything up to the last newline, less carriage returns and empty
+// lines, which the terminal skips too.
+static std::string whole_lines(std::string &input) {
+	std::string lines;
+	auto end = input.rfind('\n');
+	if (end == std::string::npos)
+		return lines;
+	std::size_t start{0};
+	while (start <= end) {
+		auto nl = input.find('\n', start);
+		std::string line{input, start, nl - start};
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (!line.empty())
+			lines += line + '\n';
+		start = nl + 1;
+	}
+	input.erase(0, end + 1);
+	return lines;
+}
+
+// Give a session a turn: feed it whatever whole lines have come in, and
+// run it until it wants more, finishes or uses up its quota.
+static void run_session(const session_ptr &s, run_queue &queue, mailbox &mail,
+												std::uint64_t quota, std::uint64_t limit) {
+	std::string lines;
+	{
+		std::lock_guard<std::mutex> hold(s->lock);
+		if (s->cancelled) {
+			s->st = session::state::finished;
+			return;
+		}
+		lines = whole_lines(s->input);
+		s->st = session::state::running;
+	}
+	if (!lines.empty())
+		s->vm.feed(lines);
+
+	run_status status;
+	std::string error;
+	try {
+		status = s->vm.run_for(std::min(quota, limit - s->vm.instructions()));
+	} catch (std::exception &e) {
+		error = std::string{"\nError: "} + e.what() + '\n';
+		status = run_status::halted;
+	}
+
+	bool again{false};
+	{
+		std::lock_guard<std::mutex> hold(s->lock);
+		if (s->cancelled) {
+			s->produced.take();
+			s->st = session::state::finished;
+			return;
+		}
+		s->output += s->produced.take() + error;
+		if (status == run_status::budget_exhausted && s->vm.instructions() < limit)
+			again = true;
+		else if (status == run_status::needs_input)
+			again = s->input.find('\n') != std::string::npos;
+		if (again && s->output.size() + s->backlog >= max_backlog) {
+			// send() puts it back in the queue once the client catches up.
+			again = false;
+			s->st = session::state::throttled;
+		} else if (again)
+			s->st = session::state::queued;
+		else if (status == run_status::needs_input && !s->eof)
+			s->st = session::state::waiting;
+		else
+			s->st = session::state::finished;
+		if (!s->output.empty() || s->st == session::state::finished)
+			mail.post(s);
+	}
+	if (again)
+		queue.push(s);
+}
+
+class server {
+public:
+	// Sessions start out as copies of base, having printed intro. If base
+	// is waiting for input, they start out waiting too.
+	server(int listener, const image &base, const std::string &intro,
+				 bool waiting);
+	~server();
+	// Run sessions on threads workers until SIGINT or SIGTERM.
+	void run(unsigned threads, std::uint64_t quota, std::uint64_t limit);
+
+private:
+	int listener, epoll, signals;
+	const image &base;
+	const std::string &intro;
+	bool waiting;
+	run_queue queue;
+	mailbox mail;
+	std::unordered_map<int, session_ptr> sessions;
+
+	void watch(int fd, std::uint32_t events, int op = EPOLL_CTL_ADD);
+	void rearm(const session_ptr &, bool eof);
+	void accept_all(void);
+	void receive(const session_ptr &);
+	void send(const session_ptr &);
+	void end(const session_ptr &);
+};
+
+server::server(int listener, const image &base, const std::string &intro,
+							 bool waiting)
+	: listener(listener), base(base), intro(intro), waiting(waiting) {
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll < 0)
+		throw std::runtime_error{"Unable to create an epoll instance."};
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signals < 0)
+		throw std::runtime_error{"Unable to create a signalfd."};
+	watch(listener, EPOLLIN);
+	watch(mail.fd, EPOLLIN);
+	watch(signals, EPOLLIN);
+}
+
+server::~server() {
+	for (const auto &s : sessions)
+		close(s.first);
+	close(signals);
+	close(epoll);
+}
+
+void server::watch(int fd, std::uint32_t events, int op) {
+	epoll_event ev;
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll, op, fd, &ev) < 0)
+		throw std::runtime_error{std::string{"epoll_ctl: "} + std::strerror(errno)};
+}
+
+void server::accept_all(void) {
+	for (;;) {
+		int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				std::cerr << "accept: " << std::strerror(errno) << '\n';
+			return;
+		}
+		session_ptr s{std::make_shared<session>(fd, base)};
+		sessions[fd] = s;
+		watch(fd, EPOLLIN | EPOLLRDHUP);
+		s->unsent = intro;
+		if (waiting) {
+			s->st = session::state::waiting;
+			send(s);
+		} else {
+			queue.push(s);
+		}
+	}
+}
+
+// What the socket wants to hear about: more input until there isn't any,
+// and room for more output while there's some waiting.
+void server::rearm(const session_ptr &s, bool eof) {
+	std::uint32_t events{0};
+	if (!eof)
+		events |= EPOLLIN | EPOLLRDHUP;
+	if (s->writing)
+		events |= EPOLLOUT;
+	watch(s->fd, events, EPOLL_CTL_MOD);
+}
+
+void server::receive(const session_ptr &s) {
+	char buf[4096];
+	std::string got;
+	bool eof{false};
+	for (;;) {
+		ssize_t n = ::read(s->fd, buf, sizeof buf);
+		if (n > 0)
+			got.append(buf, n);
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else {
+			eof = true;
+			break;
+		}
+	}
+
+	std::unique_lock<std::mutex> hold(s->lock);
+	s->input += got;
+	if (eof) {
+		s->eof = true;
+		// A last line without a newline still counts.
+		if (!s->input.empty() && s->input.back() != '\n')
+			s->input += '\n';
+	}
+	bool ready{s->input.find('\n') != std::string::npos};
+	if (s->st == session::state::waiting && ready) {
+		s->st = session::state::queued;
+		hold.unlock();
+		queue.push(s);
+	} else if (s->st == session::state::waiting && eof) {
+		s->st = session::state::finished;
+		hold.unlock();
+		send(s);
+		return;
+	} else {
+		hold.unlock();
+	}
+	if (eof)
+		rearm(s, true);
+}
+
+// Write what we can, and wait for the socket to take more if that isn't
+// everything. Ends the session once it's finished and everything's sent,
+// and lets a throttled one run again once there's room.
+void server::send(const session_ptr &s) {
+	bool finished, eof;
+	{
+		std::lock_guard<std::mutex> hold(s->lock);
+		s->unsent += s->output;
+		s->output.clear();
+		finished = s->st == session::state::finished;
+		eof = s->eof;
+	}
+	bool blocked{false};
+	while (!s->unsent.empty()) {
+		ssize_t n = ::write(s->fd, s->unsent.data(), s->unsent.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			blocked = true;
+			break;
+		}
+		if (n < 0) {
+			// Nobody's listening, so don't give it anything more to say.
+			std::lock_guard<std::mutex> hold(s->lock);
+			s->cancelled = true;
+			s->eof = true;
+			s->input.clear();
+			s->unsent.clear();
+			finished = true;
+			break;
+		}
+		s->unsent.erase(0, n);
+	}
+	if (finished && !blocked) {
+		end(s);
+		return;
+	}
+	if (blocked != s->writing) {
+		s->writing = blocked;
+		rearm(s, eof);
+	}
+
+	bool resume{false};
+	{
+		std::lock_guard<std::mutex> hold(s->lock);
+		s->backlog = s->unsent.size();
+		if (s->st == session::state::throttled &&
+				s->output.size() + s->backlog < max_backlog) {
+			s->st = session::state::queued;
+			resume = true;
+		}
+	}
+	if (resume)
+		queue.push(s);
+}
+
+void server::end(const session_ptr &s) {
+	{
+		std::lock_guard<std::mutex> hold(s->lock);
+		s->cancelled = true;
+		s->output.clear();
+	}
+	if (sessions.erase(s->fd) == 0)
+		return;
+	epoll_ctl(epoll, EPOLL_CTL_DEL, s->fd, nullptr);
+	close(s->fd);
+}
+
+void server::run(unsigned threads, std::uint64_t quota, std::uint64_t limit) {
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; i += 1)
+		workers.emplace_back([this, quota, limit](void) {
+			while (session_ptr s = queue.pop())
+				run_session(s, queue, mail, quota, limit);
+		});
+	struct stopper {
+		run_queue &queue;
+		std::vector<std::thread> &workers;
+		~stopper() {
+			queue.stop();
+			for (auto &t : workers)
+				t.join();
+		}
+	} stop_workers{queue, workers};
+
+	std::vector<epoll_event> events(256);
+	for (;;) {
+		int n = epoll_wait(epoll, events.data(), events.size(), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error{std::string{"epoll_wait: "} + std::strerror(errno)};
+		}
+		for (int i = 0; i < n; i += 1) {
+			int fd = events[i].data.fd;
+			if (fd == signals) {
+				std::cerr << "Stopping with " << sessions.size() << " sessions.\n";
+				return;
+			} else if (fd == listener) {
+				accept_all();
+			} else if (fd == mail.fd) {
+				for (const session_ptr &s : mail.collect())
+					if (sessions.count(s->fd) && sessions[s->fd] == s)
+						send(s);
+			} else {
+				auto found = sessions.find(fd);
+				if (found == sessions.end())
+					continue;
+				session_ptr s{found->second};
+				if (events[i].events & EPOLLOUT)
+					send(s);
+				// Unless sending found the connection gone and ended it.
+				found = sessions.find(fd);
+				if (found == sessions.end() || found->second != s)
+					continue;
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					receive(s);
+			}
+		}
+	}
+}
+
+static int listen_unix(const std::string &path) {
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path)
+		throw std::runtime_error{"Socket path is too long."};
+	std::strcpy(addr.sun_path, path.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::runtime_error{"Unable to create a socket."};
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) < 0 ||
+			listen(fd, SOMAXCONN) < 0)
+		throw std::runtime_error{"Unable to listen on " + path + ": " +
+			std::strerror(errno)};
+	return fd;
+}
+
+static int listen_tcp(unsigned port) {
+	sockaddr_in addr;
+	std::memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::runtime_error{"Unable to create a socket."};
+	int on{1};
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) < 0 ||
+			listen(fd, SOMAXCONN) < 0)
+		throw std::runtime_error{"Unable to listen on port " +
+			std::to_string(port) + ": " + std::strerror(errno)};
+	return fd;
+}
+
+int main(int argc, char **argv) {
+	bool saved{false};
+	bool natives{true};
+	unsigned threads{std::thread::hardware_concurrency()};
+	std::uint64_t quota{100000};
+	std::uint64_t limit{std::numeric_limits<std::uint64_t>::max()};
+	engine eng{engine::threaded};
+	std::string path;
+	unsigned port{0};
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i += 1) {
+		if (std::strcmp(argv[i], "-s") == 0)
+			saved = true;
+		else if (std::strcmp(argv[i], "-H") == 0)
+			natives = false;
+		else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+			quota = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			limit = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+			path = argv[++i];
+		else if (std::strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			port = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			i += 1;
+			if (std::strcmp(argv[i], "threaded") == 0)
+				eng = engine::threaded;
+			else if (std::strcmp(argv[i], "decoded") == 0)
+				eng = engine::decoded;
+			else if (std::strcmp(argv[i], "jit") == 0)
+				eng = engine::jit;
+			else if (std::strcmp(argv[i], "table") == 0)
+				eng = engine::table;
+			else {
+				std::cerr << "Unknown engine '" << argv[i] << "'.\n";
+				return 1;
+			}
+		} else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+	if (argc - i != 1 || path.empty() == (port == 0)) {
+		std::cout << "Usage: " << argv[0]
+							<< " [-s -H -j THREADS -q QUOTA -n COUNT -e ENGINE] -u PATH|-p PORT IMAGEFILE\n";
+		return 1;
+	}
+	if (threads == 0)
+		threads = 1;
+	if (quota == 0)
+		quota = 1;
+
+	// The signals are read from a signalfd, so every thread has to have
+	// them blocked, and a client going away mustn't kill us.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+	std::signal(SIGPIPE, SIG_IGN);
+	// A descriptor a session.
+	rlimit files;
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	std::string filename{argv[i]};
+	std::unique_ptr<image> base;
+	int listener;
+	try {
+		if (saved && snapshot::is_snapshot(filename)) {
+			snapshot snap{filename};
+			base.reset(new image{snap, true});
+		} else if (saved) {
+			std::ifstream input(filename, std::ifstream::in | std::ifstream::binary);
+			if (!input.is_open())
+				throw std::runtime_error{"Unable to open " + filename + " for reading."};
+			base.reset(new image{input, true, true});
+		} else {
+			base.reset(new image{filename, true});
+		}
+		listener = path.empty() ? listen_tcp(port) : listen_unix(path);
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+	base->set_engine(eng);
+	if (natives)
+		add_builtin_natives(*base);
+
+	// Every session starts the same way, so that part is only run once.
+	// Sessions start from where the image first wants input, with what it
+	// printed on the way there, sharing the memory it wrote. An image that
+	// hasn't asked for any by warmup carries on from there instead.
+	const std::uint64_t warmup{100000000};
+	memory_sink intro;
+	base->set_output(intro);
+	run_status status;
+	try {
+		status = base->run_for(std::min(warmup, limit));
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+
+	int exit_status{0};
+	try {
+		server srv{listener, *base, intro.str(),
+			status == run_status::needs_input};
+		std::cerr << "Listening on "
+							<< (path.empty() ? "port " + std::to_string(port) : path)
+							<< " with " << threads << " threads.\n";
+		srv.run(threads, quota, limit);
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		exit_status = 1;
+	}
+	close(listener);
+	if (!path.empty())
+		unlink(path.c_str());
+	return exit_status;
+}
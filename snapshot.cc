@@ -0,0 +1,263 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/endian/conversion.hpp>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "image.h"
+#include "snapshot.h"
+
+constexpr char snapshot_header::signature[8];
+constexpr std::uint32_t snapshot_header::current_version;
+
+namespace {
+
+constexpr bool little_endian =
+	boost::endian::order::native == boost::endian::order::little;
+
+// Copy n little-endian words into dst, widening them if numtype is
+// bigger than 16 bits. A straight copy on little-endian hosts, which the
+// compiler turns into a memcpy or vector loads.
+template <typename T>
+void from_le(const std::uint16_t *src, std::size_t n, T *dst) {
+	if (little_endian)
+		std::copy(src, src + n, dst);
+	else
+		for (std::size_t i = 0; i < n; i += 1)
+			dst[i] = boost::endian::little_to_native(src[i]);
+}
+
+void put16(std::vector<unsigned char> &buf, std::size_t at, std::uint16_t w) {
+	w = boost::endian::native_to_little(w);
+	std::memcpy(buf.data() + at, &w, sizeof w);
+}
+
+}
+
+// Fletcher-32 over the data as little-endian 16 bit words. An odd byte
+// at the end is padded with a zero.
+std::uint32_t snapshot::checksum(const unsigned char *p, std::size_t len) {
+	std::uint32_t sum1{0xFFFF}, sum2{0xFFFF};
+	std::size_t words{len / 2};
+	while (words > 0) {
+		// 359 words is as many as can be summed before sum2 could overflow.
+		std::size_t block{std::min<std::size_t>(words, 359)};
+		words -= block;
+		for (std::size_t i = 0; i < block; i += 1, p += 2) {
+			sum1 += p[0] | p[1] << 8;
+			sum2 += sum1;
+		}
+		sum1 = (sum1 & 0xFFFF) + (sum1 >> 16);
+		sum2 = (sum2 & 0xFFFF) + (sum2 >> 16);
+	}
+	if (len % 2 != 0) {
+		sum1 += p[0];
+		sum2 += sum1;
+	}
+	sum1 = (sum1 & 0xFFFF) + (sum1 >> 16);
+	sum2 = (sum2 & 0xFFFF) + (sum2 >> 16);
+	return sum2 << 16 | sum1;
+}
+
+bool snapshot::is_snapshot(const std::string &filename) {
+	std::ifstream in(filename, std::ifstream::in | std::ifstream::binary);
+	char magic[sizeof snapshot_header::signature];
+	return in.read(magic, sizeof magic) &&
+		std::memcmp(magic, snapshot_header::signature, sizeof magic) == 0;
+}
+
+mapped_file::mapped_file(const std::string &filename) {
+#ifdef __unix__
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error{"Unable to open " + filename + " for reading."};
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		throw std::runtime_error{"Unable to read " + filename + "."};
+	}
+	length = st.st_size;
+	if (length > 0) {
+		void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			throw std::runtime_error{"Unable to map " + filename + "."};
+		bytes = static_cast<unsigned char *>(p);
+		mapped = true;
+	} else {
+		close(fd);
+	}
+#else
+	std::ifstream in(filename, std::ifstream::in | std::ifstream::binary);
+	if (!in.is_open())
+		throw std::runtime_error{"Unable to open " + filename + " for reading."};
+	std::vector<char> contents{std::istreambuf_iterator<char>(in),
+		std::istreambuf_iterator<char>()};
+	length = contents.size();
+	bytes = new unsigned char[length];
+	std::copy(contents.begin(), contents.end(), bytes);
+#endif
+}
+
+mapped_file::~mapped_file() {
+#ifdef __unix__
+	if (mapped)
+		munmap(bytes, length);
+#else
+	delete[] bytes;
+#endif
+}
+
+snapshot::snapshot(const std::string &filename) : file(filename) {
+	const unsigned char *data{file.data()};
+	std::size_t length{file.size()};
+	if (length < sizeof hdr)
+		throw std::runtime_error{"Snapshot is truncated."};
+	std::memcpy(&hdr, data, sizeof hdr);
+	if (std::memcmp(hdr.magic, snapshot_header::signature, sizeof hdr.magic) != 0)
+		throw std::runtime_error{"Not a snapshot file."};
+
+	using boost::endian::little_to_native_inplace;
+	little_to_native_inplace(hdr.version);
+	little_to_native_inplace(hdr.checksum);
+	little_to_native_inplace(hdr.pc);
+	for (auto &r : hdr.regs)
+		little_to_native_inplace(r);
+	little_to_native_inplace(hdr.mem_size);
+	little_to_native_inplace(hdr.stack_size);
+	little_to_native_inplace(hdr.breakpoint_count);
+	little_to_native_inplace(hdr.input_size);
+
+	if (hdr.version != snapshot_header::current_version)
+		throw std::runtime_error{"Unsupported snapshot version."};
+	std::uint64_t expected{sizeof hdr + hdr.input_size +
+		2 * (std::uint64_t{hdr.mem_size} + hdr.stack_size + hdr.breakpoint_count)};
+	if (expected != length ||
+			hdr.mem_size > paged_memory::page_count * paged_memory::page_words)
+		throw std::runtime_error{"Snapshot has the wrong size."};
+	if (checksum(data + sizeof hdr, length - sizeof hdr) != hdr.checksum)
+		throw std::runtime_error{"Snapshot checksum mismatch."};
+}
+
+// Little-endian words are used as they are. Big-endian hosts swap them
+// in place first, in a loop simple enough for the compiler to vectorize.
+image::image(const std::string &filename, bool quiet)
+	: debug(false), stepping(false) {
+	if (!quiet)
+		std::cout << "Reading program..." << std::flush;
+	std::shared_ptr<mapped_file> file{std::make_shared<mapped_file>(filename)};
+	// Checked before anything's loaded, rather than on finding half a word.
+	if (file->size() % 2 != 0)
+		throw std::runtime_error{"Unable to read full word from input file."};
+	std::size_t n{file->size() / 2};
+	if (n > M)
+		throw std::runtime_error{"Program is too big."};
+	paged_memory::word *words = reinterpret_cast<paged_memory::word *>(file->data());
+	if (!little_endian)
+		for (std::size_t i = 0; i < n; i += 1)
+			boost::endian::little_to_native_inplace(words[i]);
+	mem.adopt(file, words, n);
+	if (!quiet)
+		std::cout << " done. Read " << n << " words.\n";
+}
+
+// Restore a saved state. The memory and stack are copied straight out of
+// the mapping a page at a time; nothing is parsed a word at a time.
+image::image(const snapshot &snap, bool quiet)
+	: debug(false), stepping(false) {
+	if (!quiet)
+		std::cout << "Restoring snapshot..." << std::flush;
+	const snapshot_header &h = snap.header();
+
+	cpu.pc = h.pc;
+	std::copy(h.regs, h.regs + 8, cpu.regs.begin());
+	if (little_endian) {
+		mem.assign(snap.memory(), snap.memory() + h.mem_size);
+	} else {
+		std::vector<paged_memory::word> words(h.mem_size);
+		from_le(snap.memory(), h.mem_size, words.data());
+		mem.assign(words.begin(), words.end());
+	}
+	std::vector<numtype> stack(h.stack_size);
+	from_le(snap.stack(), h.stack_size, stack.data());
+	s.assign(stack.begin(), stack.end());
+	std::vector<numtype> bps(h.breakpoint_count);
+	from_le(snap.breakpoints(), h.breakpoint_count, bps.data());
+	for (auto addr : bps)
+		if (addr < M)
+			breakpoints.set(addr);
+	feed(std::string(snap.input(), h.input_size));
+
+	if (!quiet)
+		std::cout << " done. Read " << h.mem_size << " words.\n";
+}
+
+// Save the current state as a snapshot. The whole file is put together in
+// memory and written in one go. Zeros at the end of memory are left out.
+void image::dump(const char *filename) {
+	memory::size_type mem_size{mem.used()};
+	// Conditions aren't saved, only where the breakpoints are.
+	std::vector<numtype> bps{breakpoints.addresses()};
+
+	snapshot_header h;
+	std::memset(&h, 0, sizeof h);
+	std::memcpy(h.magic, snapshot_header::signature, sizeof h.magic);
+	h.version = snapshot_header::current_version;
+	h.pc = cpu.pc;
+	std::copy(cpu.regs.begin(), cpu.regs.end(), h.regs);
+	h.mem_size = mem_size;
+	h.stack_size = s.size();
+	h.breakpoint_count = bps.size();
+	h.input_size = input_end - input_pos;
+
+	std::vector<unsigned char> buf(sizeof h + h.input_size +
+		2 * (mem_size + s.size() + bps.size()));
+	std::size_t at{sizeof h};
+	for (memory::size_type i = 0; i < mem_size; i += 1) {
+		put16(buf, at, mem[i]);
+		at += 2;
+	}
+	for (auto w : s) {
+		put16(buf, at, w);
+		at += 2;
+	}
+	for (auto w : bps) {
+		put16(buf, at, w);
+		at += 2;
+	}
+	std::copy(input_pos, input_end, buf.begin() + at);
+	h.checksum = snapshot::checksum(buf.data() + sizeof h, buf.size() - sizeof h);
+
+	using boost::endian::native_to_little_inplace;
+	native_to_little_inplace(h.version);
+	native_to_little_inplace(h.checksum);
+	native_to_little_inplace(h.pc);
+	for (auto &r : h.regs)
+		native_to_little_inplace(r);
+	native_to_little_inplace(h.mem_size);
+	native_to_little_inplace(h.stack_size);
+	native_to_little_inplace(h.breakpoint_count);
+	native_to_little_inplace(h.input_size);
+	std::memcpy(buf.data(), &h, sizeof h);
+
+	std::ofstream out(filename, std::ofstream::out | std::ofstream::binary);
+	if (!out.is_open()) {
+		std::cerr << "Unable to open file " << filename << " for writing.\n";
+		throw std::runtime_error("Unable to open output file.");
+	}
+	out.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+	if (!out)
+		throw std::runtime_error("Unable to write snapshot.");
+}
@@ -0,0 +1,93 @@
+/* Binary save states, and the file mapping they and program images are
+ * loaded through.
+ *
+ * A snapshot file is a fixed 64 byte header followed by the memory, the
+ * stack (Bottom first), the breakpoints and any input that was buffered
+ * but not read yet. Everything is little-endian, and every array of
+ * words starts at an even offset, so a mapped file can be used in place.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+struct snapshot_header {
+	static constexpr char signature[8] = {'S', 'Y', 'N', 'S', 'N', 'A', 'P', '\x1A'};
+	static constexpr std::uint32_t current_version = 1;
+
+	char magic[8];
+	std::uint32_t version;
+	// Fletcher-32 of everything after the header.
+	std::uint32_t checksum;
+	std::uint16_t pc;
+	std::uint16_t regs[8];
+	std::uint16_t reserved0;
+	// In words, except input_size which is in bytes.
+	std::uint32_t mem_size;
+	std::uint32_t stack_size;
+	std::uint32_t breakpoint_count;
+	std::uint32_t input_size;
+	std::uint8_t reserved1[12];
+};
+
+static_assert(sizeof(snapshot_header) == 64, "Snapshot header must be 64 bytes");
+
+// A whole file in memory: mapped where there's mmap, read in otherwise.
+// The mapping is private, so what's in it can be changed without the file
+// changing. It's aligned for any type of word either way.
+class mapped_file {
+public:
+	explicit mapped_file(const std::string &filename);
+	~mapped_file();
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	unsigned char *data(void) const { return bytes; }
+	std::size_t size(void) const { return length; }
+
+private:
+	unsigned char *bytes{nullptr};
+	std::size_t length{0};
+	bool mapped{false};
+};
+
+// A snapshot file mapped into memory, checked and ready to be restored
+// by image::image(const snapshot &).
+class snapshot {
+public:
+	explicit snapshot(const std::string &filename);
+	snapshot(const snapshot &) = delete;
+	snapshot &operator=(const snapshot &) = delete;
+
+	// True if the file starts with a snapshot header, as opposed to being
+	// a plain program image or an old text save state.
+	static bool is_snapshot(const std::string &filename);
+
+	const snapshot_header &header(void) const { return hdr; }
+	// The sections, still in little-endian order.
+	const std::uint16_t *memory(void) const { return words(0); }
+	const std::uint16_t *stack(void) const { return words(hdr.mem_size); }
+	const std::uint16_t *breakpoints(void) const {
+		return words(hdr.mem_size + hdr.stack_size);
+	}
+	const char *input(void) const {
+		return reinterpret_cast<const char *>(
+			words(hdr.mem_size + hdr.stack_size + hdr.breakpoint_count));
+	}
+
+	static std::uint32_t checksum(const unsigned char *, std::size_t);
+
+private:
+	mapped_file file;
+	snapshot_header hdr;
+
+	const std::uint16_t *words(std::size_t offset) const {
+		return reinterpret_cast<const std::uint16_t *>(file.data() + sizeof hdr) +
+			offset;
+	}
+};
+
+#endif
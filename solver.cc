@@ -1,28 +1,471 @@
-#include <vector>
+/* Solver for the coin puzzle in synacor, or any like it: which order do
+ * some values go in for an equation to hold?
+ *
+ * The equation has a _ for each value, filled in from left to right, and
+ * +, -, *, /, %, ^ (power), unary minus and parentheses, all on 64 bit
+ * integers. It's parsed once into a list of terms in postfix order, which
+ * a little stack machine runs for a batch of orderings at a time. Each
+ * stack entry holds a value for every ordering in the batch, so working
+ * out what a term does is paid for once a batch, and doing it is a loop
+ * the compiler can vectorize.
+ *
+ * The orderings are split up by their first few values, enough ways that
+ * every thread has plenty to do, and threads take the next prefix as soon
+ * as they're done with the last. Each one runs through every order of
+ * the rest with std::next_permutation. What they find is put back
+ * together in order, so it comes out the same however many threads there
+ * are: in the order std::next_permutation would have found it.
+ */
+
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <algorithm>
-#include <iterator>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct term {
+	enum kind_t : std::uint8_t {
+		number, slot, negate,
+		// Everything from here on takes two operands.
+		add, sub, mul, div, mod, pow, eq
+	} kind;
+	std::int64_t value;
+};
+
+constexpr std::size_t max_depth{64};
+
+// Wraps around instead of overflowing. Anything that can't be worked out,
+// like dividing by zero, makes the equation fail.
+class equation {
+public:
+	explicit equation(const std::string &text);
+
+	std::size_t slots(void) const { return count; }
+	// The equation with values in place of the _s.
+	std::string fill(const int *values) const;
+
+private:
+	friend class evaluator;
+
+	std::string text;
+	std::vector<term> terms;
+	std::size_t count{0};
+};
+
+// Works out an equation for a batch of orderings at once. One for each
+// thread.
+class evaluator {
+public:
+	static constexpr std::size_t lanes = 32;
+
+	explicit evaluator(const equation &eq)
+		: eq(eq), stack(max_depth * lanes), values(eq.count * lanes) {}
+	// Put in the values for one ordering in the batch.
+	void set(std::size_t lane, const int *v) {
+		for (std::size_t i = 0; i < eq.count; i += 1)
+			values[i * lanes + lane] = v[i];
+	}
+	// And take them back out.
+	void get(std::size_t lane, int *v) const {
+		for (std::size_t i = 0; i < eq.count; i += 1)
+			v[i] = values[i * lanes + lane];
+	}
+	// Set ok[lane] to whether the equation holds for each one.
+	void run(bool *ok);
+
+private:
+	const equation &eq;
+	// Each entry is lanes long.
+	std::vector<std::uint64_t> stack, values;
+};
+
+class parser {
+public:
+	parser(const std::string &text, std::vector<term> &out, std::size_t &slots)
+		: s(text), terms(out), slots(slots) {}
+
+	void parse(void) {
+		sum();
+		if (!accept("="))
+			fail("Missing =");
+		sum();
+		emit(term::eq);
+		skip_space();
+		if (at < s.size())
+			fail("Unexpected '" + s.substr(at) + "'");
+	}
+
+private:
+	const std::string &s;
+	std::vector<term> &terms;
+	std::size_t &slots;
+	std::size_t at{0};
+
+	[[noreturn]] void fail(const std::string &why) {
+		throw std::runtime_error{why + " in equation."};
+	}
+	void skip_space(void) {
+		while (at < s.size() && std::isspace(static_cast<unsigned char>(s[at])))
+			at += 1;
+	}
+	bool accept(const char *op) {
+		skip_space();
+		if (at < s.size() && s[at] == op[0]) {
+			at += 1;
+			return true;
+		}
+		return false;
+	}
+	void emit(term::kind_t k, std::int64_t value = 0) {
+		terms.push_back({k, value});
+	}
+
+	void sum(void) {
+		product();
+		for (;;) {
+			if (accept("+")) {
+				product();
+				emit(term::add);
+			} else if (accept("-")) {
+				product();
+				emit(term::sub);
+			} else {
+				return;
+			}
+		}
+	}
+	void product(void) {
+		unary();
+		for (;;) {
+			if (accept("*")) {
+				unary();
+				emit(term::mul);
+			} else if (accept("/")) {
+				unary();
+				emit(term::div);
+			} else if (accept("%")) {
+				unary();
+				emit(term::mod);
+			} else {
+				return;
+			}
+		}
+	}
+	void unary(void) {
+		if (accept("-")) {
+			unary();
+			emit(term::negate);
+		} else {
+			power();
+		}
+	}
+	// ^ goes right to left, and binds tighter than unary minus.
+	void power(void) {
+		primary();
+		if (accept("^")) {
+			unary();
+			emit(term::pow);
+		}
+	}
+	void primary(void) {
+		skip_space();
+		if (at == s.size())
+			fail("Unexpected end");
+		char c = s[at];
+		if (accept("(")) {
+			sum();
+			if (!accept(")"))
+				fail("Missing )");
+		} else if (accept("_")) {
+			emit(term::slot, slots++);
+		} else if (std::isdigit(static_cast<unsigned char>(c))) {
+			std::size_t len;
+			emit(term::number, std::stoll(s.substr(at), &len, 10));
+			at += len;
+		} else {
+			fail(std::string{"Unexpected '"} + c + "'");
+		}
+	}
+};
+
+equation::equation(const std::string &source) : text(source) {
+	parser{text, terms, count}.parse();
+	std::size_t sp{0};
+	for (const term &t : terms) {
+		if (t.kind >= term::add)
+			sp -= 1;
+		else if (t.kind != term::negate)
+			sp += 1;
+		if (sp > max_depth)
+			throw std::runtime_error{"Equation is nested too deeply."};
+	}
+}
+
+constexpr std::size_t evaluator::lanes;
+
+void evaluator::run(bool *ok) {
+	bool fine[lanes];
+	std::fill(fine, fine + lanes, true);
+	std::size_t sp{0};
+	for (const term &t : eq.terms) {
+		std::uint64_t *b{nullptr};
+		if (t.kind >= term::add)
+			b = &stack[--sp * lanes];
+		std::uint64_t *a = &stack[(t.kind >= term::negate ? sp - 1 : sp++) * lanes];
+		switch (t.kind) {
+		case term::number:
+			std::fill(a, a + lanes, t.value);
+			break;
+		case term::slot:
+			std::copy(&values[t.value * lanes], &values[t.value * lanes] + lanes, a);
+			break;
+		case term::negate:
+			for (std::size_t l = 0; l < lanes; l += 1)
+				a[l] = -a[l];
+			break;
+		case term::add:
+			for (std::size_t l = 0; l < lanes; l += 1)
+				a[l] += b[l];
+			break;
+		case term::sub:
+			for (std::size_t l = 0; l < lanes; l += 1)
+				a[l] -= b[l];
+			break;
+		case term::mul:
+			for (std::size_t l = 0; l < lanes; l += 1)
+				a[l] *= b[l];
+			break;
+		case term::div:
+		case term::mod:
+			for (std::size_t l = 0; l < lanes; l += 1) {
+				std::int64_t sa = a[l], sb = b[l];
+				if (sb == 0 || (sb == -1 && sa == INT64_MIN)) {
+					fine[l] = false;
+					a[l] = 0;
+				} else {
+					a[l] = t.kind == term::div ? sa / sb : sa % sb;
+				}
+			}
+			break;
+		case term::pow:
+			for (std::size_t l = 0; l < lanes; l += 1) {
+				std::uint64_t x{a[l]}, p{1};
+				if (static_cast<std::int64_t>(b[l]) < 0)
+					fine[l] = false;
+				else
+					for (std::uint64_t e = b[l]; e > 0; e >>= 1, x *= x)
+						if (e & 1)
+							p *= x;
+				a[l] = p;
+			}
+			break;
+		case term::eq:
+			for (std::size_t l = 0; l < lanes; l += 1)
+				a[l] = a[l] == b[l];
+			break;
+		}
+	}
+	for (std::size_t l = 0; l < lanes; l += 1)
+		ok[l] = fine[l] && stack[l] != 0;
+}
+
+std::string equation::fill(const int *values) const {
+	std::string out;
+	std::size_t n{0};
+	for (char c : text)
+		if (c == '_')
+			out += std::to_string(values[n++]);
+		else
+			out += c;
+	return out;
+}
+
+// Every distinct way to start an ordering of sorted with k of its values.
+void prefixes(std::vector<int> &rest, std::size_t k, std::vector<int> &prefix,
+							std::vector<std::vector<int>> &out) {
+	if (prefix.size() == k) {
+		out.push_back(prefix);
+		return;
+	}
+	for (std::size_t i = 0; i < rest.size(); i += 1) {
+		if (i > 0 && rest[i] == rest[i - 1])
+			continue;
+		int v = rest[i];
+		prefix.push_back(v);
+		rest.erase(rest.begin() + i);
+		prefixes(rest, k, prefix, out);
+		rest.insert(rest.begin() + i, v);
+		prefix.pop_back();
+	}
+}
+
+// Orderings of values that make eq hold, in the order
+// std::next_permutation comes to them. Only the first, unless all.
+std::vector<std::vector<int>> solve(const equation &eq, std::vector<int> values,
+																		unsigned threads, bool all) {
+	std::sort(values.begin(), values.end());
+	const std::size_t n{values.size()};
+	// Enough prefixes that no thread is left with much to do at the end.
+	std::size_t k{0}, jobs{1};
+	while (k < n && jobs < 64 * threads)
+		jobs *= n - k++;
+	std::vector<std::vector<int>> starts;
+	std::vector<int> prefix;
+	prefixes(values, k, prefix, starts);
+
+	std::vector<std::vector<std::vector<int>>> found(starts.size());
+	std::atomic<std::size_t> next{0}, earliest{starts.size()};
+	auto worker = [&](void) {
+		evaluator eval{eq};
+		std::vector<int> order(n), solution(n);
+		bool ok[evaluator::lanes];
+		for (;;) {
+			std::size_t j = next.fetch_add(1);
+			if (j >= starts.size() || (!all && j > earliest))
+				break;
+			// The prefix, then the rest of the values in order.
+			std::vector<int> rest{values};
+			for (int v : starts[j])
+				rest.erase(std::find(rest.begin(), rest.end(), v));
+			std::copy(starts[j].begin(), starts[j].end(), order.begin());
+			std::copy(rest.begin(), rest.end(), order.begin() + k);
+			for (bool more = true; more; ) {
+				std::size_t count{0};
+				for (; count < evaluator::lanes && more; count += 1) {
+					eval.set(count, order.data());
+					more = std::next_permutation(order.begin() + k, order.end());
+				}
+				eval.run(ok);
+				for (std::size_t l = 0; l < count; l += 1)
+					if (ok[l]) {
+						eval.get(l, solution.data());
+						found[j].push_back(solution);
+						if (!all) {
+							more = false;
+							break;
+						}
+					}
+			}
+			if (!all && !found[j].empty()) {
+				std::size_t e = earliest;
+				while (j < e && !earliest.compare_exchange_weak(e, j))
+					;
+			}
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < threads; i += 1)
+		pool.emplace_back(worker);
+	worker();
+	for (auto &t : pool)
+		t.join();
 
-constexpr int pow(int x, int y) {
-	int p = x;
-	while (--y) p *= x;
-	return p;
+	std::vector<std::vector<int>> solutions;
+	for (auto &f : found) {
+		solutions.insert(solutions.end(), f.begin(), f.end());
+		if (!all && !solutions.empty())
+			break;
+	}
+	return solutions;
 }
 
-bool is_solution(const std::vector<int> &n) {
-	int goal = 399;
-	return (n[0] + n[1] * pow(n[2],2) + pow(n[3],3) - n[4]) == goal;
+// The inscription on the door, and the coins.
+const char coins[] = "_ + _ * _^2 + _^3 - _ = 399";
+const std::vector<int> coin_values{2, 3, 5, 7, 9};
+
 }
 
-int main(void) {
-	std::vector<int> nums{2,3,5,7,9};
-	do {
-		if (is_solution(nums)) {
-			std::copy(nums.begin(), nums.end(),
-				std::ostream_iterator<int>(std::cout, "\n"));
+/* Usage: solver [-j THREADS] [-a] [-f FILE | EQUATION VALUE...]
+*
+* Prints the first ordering of the values that makes EQUATION hold, with
+* the values filled in. With no EQUATION, solves the coin puzzle.
+*
+* Options: -j THREADS Number of threads to search with. Defaults to one
+*                     per core.
+*          -a Print every ordering that works, not just the first.
+*          -f FILE Read the equation from the first line of FILE, and the
+*                  values from the rest. Lines starting with # are ignored.
+*/
+int main(int argc, char **argv) {
+	unsigned threads{std::thread::hardware_concurrency()};
+	bool all{false};
+	const char *file{nullptr};
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i += 1) {
+		if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		} else if (std::strcmp(argv[i], "-a") == 0) {
+			all = true;
+		} else if (std::strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			file = argv[++i];
+		} else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+	if (threads == 0)
+		threads = 1;
+
+	std::string text{coins};
+	std::vector<int> values{coin_values};
+	try {
+		if (file) {
+			std::ifstream in(file);
+			if (!in.is_open()) {
+				std::cerr << "Unable to open " << file << ".\n";
+				return 1;
+			}
+			std::string line;
+			text.clear();
+			values.clear();
+			while (std::getline(in, line)) {
+				std::size_t start = line.find_first_not_of(" \t");
+				if (start == std::string::npos || line[start] == '#')
+					continue;
+				if (text.empty()) {
+					text = line;
+					continue;
+				}
+				std::istringstream words(line);
+				int v;
+				while (words >> v)
+					values.push_back(v);
+			}
+		} else if (i < argc) {
+			text = argv[i];
+			values.clear();
+			for (i += 1; i < argc; i += 1)
+				values.push_back(std::stoi(argv[i]));
+		}
+
+		equation eq{text};
+		if (eq.slots() != values.size()) {
+			std::cerr << "The equation has " << eq.slots() << " places for values, "
+								<< "but there are " << values.size() << " values.\n";
+			return 1;
+		}
+		std::vector<std::vector<int>> solutions{solve(eq, values, threads, all)};
+		if (solutions.empty()) {
+			std::cout << "No solution found!\n";
 			return 0;
 		}
-	} while (std::next_permutation(nums.begin(), nums.end()));
-	std::cout << "No solution found!\n";
+		for (const auto &s : solutions)
+			std::cout << eq.fill(s.data()) << '\n';
+		if (all)
+			std::cout << solutions.size() << " solutions.\n";
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
 	return 0;
-}
\ No newline at end of file
+}
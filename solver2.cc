@@ -1,14 +1,31 @@
 #include <iostream>
+#include <iomanip>
 #include <cstdint>
 #include <string>
 #include <stack>
+#include <vector>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <utility>
 #include <tuple>
 #include <map>
 #include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <csignal>
 
-/* Code is G++ specific. Also works better with OpenMP turned on. */
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+/* Code is G++ specific. */
 
 using numtype = std::uint_fast16_t;
 constexpr numtype M{32768}; 
@@ -121,36 +138,502 @@ solver2(numtype r0, numtype r1, numtype r7, cache &c) {
 	}
 }
 
+// The same function, worked out with a dense table instead of a cache.
+// r0 only goes up to 4, so for one r7 all of it fits in 5 rows of 32768.
+// A(m, n) only depends on row m - 1 and A(m, n - 1), so a row can be
+// filled in one pass over the one before it, with no hashing and no
+// stacks. The r1 it leaves is always the r0 less one.
+class table_solver {
+public:
+	static constexpr numtype rows = 5;
+
+	table_solver() : t(rows * M) {
+		for (numtype n = 0; n < M; n += 1)
+			t[n] = (n + 1) % M;
+	}
+
+	// r0 has to be less than rows. Fills in every row before r0 (Which
+	// row 0 already is), and only as much of row r0 as it needs.
+	regs operator()(numtype r0, numtype r1, numtype r7) {
+		if (r7 != filled_r7)
+			filled = 1;
+		filled_r7 = r7;
+		for (; filled < r0; filled += 1) {
+			const std::uint16_t *prev = &t[(filled - 1) * M];
+			std::uint16_t *row = &t[filled * M];
+			row[0] = prev[r7];
+			for (numtype n = 1; n < M; n += 1)
+				row[n] = prev[row[n - 1]];
+		}
+		numtype v = r1 + 1;
+		if (r0 > 0) {
+			const std::uint16_t *prev = &t[(r0 - 1) * M];
+			v = prev[r7];
+			for (numtype n = 1; n <= r1; n += 1)
+				v = prev[v];
+		}
+		v %= M;
+		return std::make_pair(v, (v + M - 1) % M);
+	}
+
+private:
+	std::vector<std::uint16_t> t;
+	// Rows below filled are good for filled_r7.
+	numtype filled{1}, filled_r7{M};
+};
+
+
+// Many r7s at once. Rows 1 and 2 of the table turn out to be straight
+// lines, A(1, n) = n + r7 + 1 and A(2, n) = (n + 2)(r7 + 1) - 1, so
+// row 3 is A(3, n) = (A(3, n - 1) + 2)(r7 + 1) - 1, or with
+// b(n) = A(3, n) + 1, b(n) = (b(n - 1) + 1)(r7 + 1). That's the same two
+// operations for every r7, so a SIMD register's worth of r7s can step
+// through it in lockstep, with nothing to look up. A(4, 1) is
+// A(3, A(3, r7)), so it takes two passes: one to pick out A(3, r7) as n
+// goes past each lane's r7, and one to pick out A(4, 1) as it goes past
+// that.
+//
+// Everything is done mod 65536 in 16 bit lanes, which gives the right
+// answer mod 32768 once the top bit is masked off. Lanes says how: it
+// has a vec type of width lanes, and the operations on it.
+
+// Plain arrays, for the compiler to vectorize if it can.
+struct scalar_lanes {
+	static constexpr int width = 16;
+	struct vec { std::uint16_t v[width]; };
+
+	static vec set1(std::uint16_t x) {
+		vec r;
+		std::fill(r.v, r.v + width, x);
+		return r;
+	}
+	// first, first + 1, ...
+	static vec iota(std::uint16_t first) {
+		vec r;
+		for (int i = 0; i < width; i += 1)
+			r.v[i] = first + i;
+		return r;
+	}
+	static vec add(vec a, vec b) {
+		for (int i = 0; i < width; i += 1)
+			a.v[i] += b.v[i];
+		return a;
+	}
+	static vec mul(vec a, vec b) {
+		for (int i = 0; i < width; i += 1)
+			a.v[i] *= b.v[i];
+		return a;
+	}
+	// a == b ? x : y, lane by lane.
+	static vec select_eq(vec a, vec b, vec x, vec y) {
+		for (int i = 0; i < width; i += 1)
+			y.v[i] = a.v[i] == b.v[i] ? x.v[i] : y.v[i];
+		return y;
+	}
+	static vec load(const std::uint16_t *p) {
+		vec r;
+		std::copy(p, p + width, r.v);
+		return r;
+	}
+	static void store(std::uint16_t *p, vec a) {
+		std::copy(a.v, a.v + width, p);
+	}
+};
+
+#ifdef __AVX2__
+struct avx2_lanes {
+	static constexpr int width = 16;
+	using vec = __m256i;
+
+	static vec set1(std::uint16_t x) { return _mm256_set1_epi16(x); }
+	static vec iota(std::uint16_t first) {
+		return _mm256_add_epi16(_mm256_set1_epi16(first), _mm256_setr_epi16(
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	}
+	static vec add(vec a, vec b) { return _mm256_add_epi16(a, b); }
+	static vec mul(vec a, vec b) { return _mm256_mullo_epi16(a, b); }
+	static vec select_eq(vec a, vec b, vec x, vec y) {
+		return _mm256_blendv_epi8(y, x, _mm256_cmpeq_epi16(a, b));
+	}
+	static vec load(const std::uint16_t *p) {
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+	}
+	static void store(std::uint16_t *p, vec a) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(p), a);
+	}
+};
+#endif
+
+#ifdef __AVX512BW__
+struct avx512_lanes {
+	static constexpr int width = 32;
+	using vec = __m512i;
+
+	static vec set1(std::uint16_t x) { return _mm512_set1_epi16(x); }
+	static vec iota(std::uint16_t first) {
+		std::uint16_t lanes[width];
+		for (int i = 0; i < width; i += 1)
+			lanes[i] = first + i;
+		return load(lanes);
+	}
+	static vec add(vec a, vec b) { return _mm512_add_epi16(a, b); }
+	static vec mul(vec a, vec b) { return _mm512_mullo_epi16(a, b); }
+	static vec select_eq(vec a, vec b, vec x, vec y) {
+		return _mm512_mask_blend_epi16(_mm512_cmpeq_epi16_mask(a, b), y, x);
+	}
+	static vec load(const std::uint16_t *p) { return _mm512_loadu_si512(p); }
+	static void store(std::uint16_t *p, vec a) {
+		_mm512_storeu_si512(p, a);
+	}
+};
+#endif
+
+#if defined(__AVX512BW__)
+using fastest_lanes = avx512_lanes;
+#elif defined(__AVX2__)
+using fastest_lanes = avx2_lanes;
+#else
+using fastest_lanes = scalar_lanes;
+#endif
+
+// A(4, 1) for r7 = first up to first + Lanes::width * K - 1, into out.
+// Each step of the recurrence waits on the last, so K vectors are
+// stepped together to keep the multiplier busy.
+template <typename Lanes, int K = 4>
+void batch_solver(numtype first, std::uint16_t *out) {
+	using vec = typename Lanes::vec;
+	constexpr int width = Lanes::width;
+	const vec one = Lanes::set1(1);
+	vec c[K], start[K], b[K], target[K], found[K];
+	for (int k = 0; k < K; k += 1) {
+		target[k] = Lanes::iota(first + k * width);
+		c[k] = Lanes::add(target[k], one);
+		// b(0) = A(2, r7) + 1 = (r7 + 2)(r7 + 1)
+		start[k] = Lanes::mul(Lanes::add(c[k], one), c[k]);
+	}
+	numtype last = std::min<numtype>(first + K * width, M);
+	for (int pass = 0; pass < 2; pass += 1) {
+		for (int k = 0; k < K; k += 1) {
+			b[k] = start[k];
+			found[k] = Lanes::set1(0);
+		}
+		for (numtype n = 0; n < last; n += 1) {
+			vec at = Lanes::set1(n);
+			for (int k = 0; k < K; k += 1) {
+				found[k] = Lanes::select_eq(target[k], at, b[k], found[k]);
+				b[k] = Lanes::mul(Lanes::add(b[k], one), c[k]);
+			}
+		}
+		// found is A(3, target) + 1. After the first pass, that's where the
+		// second one looks.
+		last = 0;
+		for (int k = 0; k < K; k += 1) {
+			std::uint16_t *lanes = out + k * width;
+			Lanes::store(lanes, found[k]);
+			for (int i = 0; i < width; i += 1) {
+				lanes[i] = (lanes[i] - 1) & (M - 1);
+				last = std::max<numtype>(last, lanes[i] + 1);
+			}
+			target[k] = Lanes::load(lanes);
+		}
+	}
+}
+
+// A(4, 1) for every r7, indexed by r7.
+template <typename Lanes, int K = 4>
+std::vector<std::uint16_t> batch_sweep(void) {
+	constexpr numtype step = Lanes::width * K;
+	std::vector<std::uint16_t> a41(M + step);
+	for (numtype r7 = 0; r7 < M; r7 += step)
+		batch_solver<Lanes, K>(r7, &a41[r7]);
+	a41.resize(M);
+	return a41;
+}
+
+// Time a sweep, and count the r7s it disagrees with expected about.
+template <typename Sweep>
+std::vector<std::uint16_t> time_sweep(const char *name, Sweep sweep,
+																			const std::vector<std::uint16_t> *expected) {
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::uint16_t> a41 = sweep();
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+						<< std::setprecision(3) << std::setw(9) << elapsed.count() << 's';
+	if (expected) {
+		numtype bad = 0;
+		for (numtype r7 = 1; r7 < M; r7 += 1)
+			bad += a41[r7] != (*expected)[r7];
+		std::cout << std::setw(8) << bad << " wrong";
+	}
+	std::cout << '\n';
+	return a41;
+}
+
+// Set by ^C. Searches stop handing out chunks, and report what they found
+// so far.
+std::atomic<bool> interrupted{false};
+
+void interrupt(int) {
+	interrupted = true;
+}
+
+// Hands out [first, last] to a pool of threads a chunk at a time, each
+// taking the next chunk as soon as it's done with the last, so a slow
+// chunk doesn't hold anyone else up. What each chunk finds is kept apart
+// and put together in order at the end, so the results are the same for
+// any number of threads.
+//
+// With first_only, nobody starts a chunk past the earliest one that found
+// something. The chunks before it are still finished, so the result is
+// the lowest match, just as it would be one thread.
+class search_driver {
+public:
+	// Look through first to last, adding whatever matches to found in order.
+	using work = std::function<void(numtype first, numtype last,
+																	std::vector<numtype> &found)>;
+
+	search_driver(unsigned threads, numtype chunk, bool first_only)
+		: threads(threads ? threads : 1), chunk(chunk), first_only(first_only) {}
+	// Shows a percentage done and a guess at the time left on stderr, if
+	// that's a terminal.
+	std::vector<numtype> run(numtype first, numtype last, const work &w);
+	// Whether the last run was cut short by ^C.
+	bool interrupted(void) const { return stopped; }
+
+private:
+	unsigned threads;
+	numtype chunk;
+	bool first_only, stopped{false};
+};
+
+std::vector<numtype> search_driver::run(numtype first, numtype last,
+																				const work &w) {
+	const numtype chunks = (last - first + chunk) / chunk;
+	const numtype total = last - first + 1;
+	std::vector<std::vector<numtype>> found(chunks);
+	std::atomic<numtype> next{0}, done{0}, earliest{chunks};
+	std::mutex lock;
+	std::condition_variable finished;
+	unsigned running = threads;
+
+	auto worker = [&](void) {
+		for (;;) {
+			numtype c = next.fetch_add(1);
+			if (c >= chunks || c > earliest || ::interrupted)
+				break;
+			numtype lo = first + c * chunk, hi = std::min(lo + chunk - 1, last);
+			w(lo, hi, found[c]);
+			if (first_only && !found[c].empty()) {
+				numtype e = earliest;
+				while (c < e && !earliest.compare_exchange_weak(e, c))
+					;
+			}
+			done += hi - lo + 1;
+		}
+		std::lock_guard<std::mutex> hold(lock);
+		running -= 1;
+		finished.notify_one();
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (unsigned i = 0; i < threads; i += 1)
+		pool.emplace_back(worker);
+
+	bool progress = isatty(2);
+	{
+		std::unique_lock<std::mutex> hold(lock);
+		while (!finished.wait_for(hold, std::chrono::milliseconds(250),
+															[&](void) { return running == 0; }))
+			if (progress && done > 0) {
+				std::chrono::duration<double> elapsed =
+					std::chrono::steady_clock::now() - start;
+				double part = double(done) / total;
+				std::cerr << "\r" << std::fixed << std::setprecision(1)
+									<< std::setw(5) << 100 * part << "% done, about "
+									<< std::setprecision(0) << elapsed.count() * (1 - part) / part
+									<< "s to go " << std::flush;
+			}
+	}
+	for (auto &t : pool)
+		t.join();
+	if (progress)
+		std::cerr << "\r\033[K" << std::flush;
+	stopped = ::interrupted;
+
+	std::vector<numtype> all;
+	for (const auto &f : found) {
+		all.insert(all.end(), f.begin(), f.end());
+		if (first_only && !all.empty()) {
+			all.resize(1);
+			break;
+		}
+	}
+	return all;
+}
+
+// A(4, 1) for every r7 from first to last, into out, a batch at a time.
+// first has to be a multiple of the batch size.
+void sweep_range(numtype first, numtype last, std::uint16_t *out) {
+	constexpr numtype step = fastest_lanes::width * 4;
+	std::uint16_t batch[step];
+	for (numtype r7 = first; r7 <= last; r7 += step) {
+		batch_solver<fastest_lanes>(r7, batch);
+		std::copy(batch, batch + std::min(step, last - r7 + 1), out + r7 - first);
+	}
+}
+
+/* Usage: solver2 [-j THREADS] [-1] [R7 | -c [FIRST [LAST]] | -b]
+*
+* With no arguments, tries every r7 from 1 to 32767 and prints the ones
+* that make the teleporter's check leave 6 in r0, and how long it took.
+* With R7, prints what the check leaves in r0 and r1 for that one. -c
+* checks the table and the batches against solver(), the cached version
+* of solver2_reference.cc, for every r7 from FIRST to LAST (1 to 32767 by
+* default). That takes about a tenth of a second each, but up to half a
+* minute for a few near 32767. -b times a whole
+* sweep done each way this build can, and checks them against the table.
+*
+* Options: -j THREADS Number of threads to search with. Defaults to one
+*                     per core. What's printed doesn't depend on it.
+*          -1 Stop at the lowest r7 that matches, or with -c, the lowest
+*             one that doesn't.
+*/
+// An r7 given on the command line, in decimal or with 0x in hex. Only 1 to
+// 32767 are any use.
+static bool parse_r7(const char *arg, numtype &r7) {
+	char *end;
+	bool hex{std::strncmp(arg, "0x", 2) == 0};
+	unsigned long v = std::strtoul(arg, &end, hex ? 16 : 10);
+	if (*arg == '\0' || *end != '\0' || v < 1 || v >= M)
+		return false;
+	r7 = v;
+	return true;
+}
+
+static int usage(const char *name) {
+	std::cerr << "Usage: " << name
+						<< " [-j THREADS] [-1] [R7 | -c [FIRST [LAST]] | -b]\n"
+						<< "R7, FIRST and LAST are 1 to 32767, with FIRST <= LAST.\n";
+	return 1;
+}
+
 int main(int argc, char **argv) {
+	const char *name = argv[0];
+	unsigned threads{std::thread::hardware_concurrency()};
+	bool first_only{false};
+	int i = 1;
+	for (; i < argc; i += 1) {
+		if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "-1") == 0)
+			first_only = true;
+		else
+			break;
+	}
+	argc -= i - 1;
+	argv += i - 1;
+	std::signal(SIGINT, interrupt);
 
 	std::cout.setf(std::ios::showbase);
 	std::cout << std::hex;
 	
+	if (argc >= 2 && std::strcmp(argv[1], "-c") == 0) {
+		numtype first{1}, last{M - 1};
+		if (argc > 4 || (argc > 2 && !parse_r7(argv[2], first)) ||
+				(argc > 3 && !parse_r7(argv[3], last)) || first > last)
+			return usage(name);
+		std::vector<std::uint16_t> batch = batch_sweep<fastest_lanes>();
+		search_driver search{threads, 4, first_only};
+		std::vector<numtype> bad = search.run(first, last,
+			[&batch](numtype lo, numtype hi, std::vector<numtype> &found) {
+				table_solver t;
+				for (numtype r7 = lo; r7 <= hi && !interrupted; r7 += 1) {
+					regs fast = t(4, 1, r7), slow = solver(4, 1, r7);
+					if (fast != slow || batch[r7] != slow.first)
+						found.push_back(r7);
+				}
+			});
+		for (numtype r7 : bad) {
+			table_solver t;
+			regs fast = t(4, 1, r7), slow = solver(4, 1, r7);
+			std::cout << "r7=" << r7 << ": table gives r0=" << fast.first
+								<< " r1=" << fast.second << ", batch r0=" << batch[r7]
+								<< ", reference r0=" << slow.first << " r1="
+								<< slow.second << '\n';
+		}
+		if (search.interrupted())
+			std::cout << "Interrupted.\n";
+		std::cout << std::dec << bad.size() << " mismatches.\n";
+		return bad.empty() && !search.interrupted() ? 0 : 1;
+	}
+
+	if (argc == 2 && std::strcmp(argv[1], "-b") == 0) {
+		std::cout << std::dec;
+		std::vector<std::uint16_t> table = time_sweep("table", [](void) {
+			std::vector<std::uint16_t> a41(M);
+			table_solver t;
+			for (numtype r7 = 1; r7 < M; r7 += 1)
+				a41[r7] = t(4, 1, r7).first;
+			return a41;
+		}, nullptr);
+		time_sweep("scalar", batch_sweep<scalar_lanes>, &table);
+#ifdef __AVX2__
+		time_sweep("avx2", batch_sweep<avx2_lanes>, &table);
+#endif
+#ifdef __AVX512BW__
+		time_sweep("avx512", batch_sweep<avx512_lanes>, &table);
+#endif
+		std::string name{"j" + std::to_string(threads ? threads : 1)};
+		time_sweep(name.c_str(), [threads](void) {
+			std::vector<std::uint16_t> a41(M);
+			search_driver{threads, fastest_lanes::width * 4, false}.run(0, M - 1,
+				[&a41](numtype lo, numtype hi, std::vector<numtype> &) {
+					sweep_range(lo, hi, &a41[lo]);
+				});
+			return a41;
+		}, &table);
+		return 0;
+	}
+
 	if (argc == 2) {
-		numtype r0, r1;
-		int base = 10;
-		if (argv[1][0] && argv[1][0] == '0' && argv[1][1] == 'x')
-			base = 16;
-		numtype r7 = std::stoul(argv[1], 0, base);
-		cache c;
-		std::tie(r0, r1) = solver(4, 1, r7);
+		numtype r0, r1, r7;
+		if (!parse_r7(argv[1], r7))
+			return usage(name);
+		table_solver t;
+		std::tie(r0, r1) = t(4, 1, r7);
 		std::cout << "r0=" << r0 << "\nr1=" << r1 << "\nr7=" << r7 << '\n';
 		return 0;
 	}
 		
-	#pragma omp parallel for
-	for (int r7 = 5; r7 < M; r7 += 1) {
-		numtype r0, r1;
-		cache c;
-		stack s;
-		std::tie(r0, r1) = solver(4, 1, r7);
-		if (r0 == 6) {
-			std::cout << "\nr0 = " << r0 << "\nr1 = " << r1 << "\nr7 = " << r7 << '\n';
-			std::exit(0);
-		} else {
-			if ((r7 % 250) == 0) 
-				std::cout << '.' << std::flush;
-		}
+	auto start = std::chrono::steady_clock::now();
+	// A chunk is 16 batches, enough to keep the threads busy without
+	// leaving one of them with much to do at the end.
+	search_driver search{threads, fastest_lanes::width * 4 * 16, first_only};
+	std::vector<numtype> matches = search.run(0, M - 1,
+		[](numtype lo, numtype hi, std::vector<numtype> &found) {
+			std::vector<std::uint16_t> a41(hi - lo + 1);
+			sweep_range(lo, hi, a41.data());
+			for (numtype r7 = std::max<numtype>(lo, 1); r7 <= hi; r7 += 1)
+				if (a41[r7 - lo] == 6)
+					found.push_back(r7);
+		});
+	// The check leaves A(4, 1) - 1 in r1.
+	for (numtype r7 : matches) {
+		numtype r0 = 6, r1 = 5;
+		std::cout << "\nr0 = " << r0 << "\nr1 = " << r1 << "\nr7 = " << r7 << '\n';
 	}
-	return 0;
-}
\ No newline at end of file
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	if (search.interrupted())
+		std::cout << "\nInterrupted after " << std::dec << elapsed.count()
+							<< " seconds.\n";
+	else if (first_only && !matches.empty())
+		std::cout << "\nFound the first match in " << std::dec << elapsed.count()
+							<< " seconds.\n";
+	else
+		std::cout << "\nTried every r7 in " << std::dec << elapsed.count()
+							<< " seconds.\n";
+	return search.interrupted() ? 1 : 0;
+}
@@ -1,14 +1,36 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <vector>
-#include <utility>
-#include <tuple>
-#include <array>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Solver for another puzzle in synacor: the orb and the vault door.
+//
+// The orb starts on the bottom left of a grid of numbers and operators,
+// weighing what the number there says, and has to get to the top right
+// weighing exactly the goal. Stepping onto a number applies the operator
+// just stepped off to the weight. Going back to the start resets the orb,
+// and reaching the top right ends the attempt, so neither is walked
+// through.
+//
+// Where the orb is and what it weighs is all that matters about a state,
+// so it's a breadth-first search over (cell, weight) pairs. The first
+// time a state is reached is by a shortest way there, and every later
+// way there is no better, so it's never looked at again. Weights are kept
+// mod 32768, which is how the VM works them out, so there are only so
+// many states.
 
-// Solver for another puzzle in synacor.
 enum class type { NUM, OP };
 enum class edgeop { ADD, SUB, MUL };
 struct node {
-	bool goal{false};
 	type t;
 	union {
 		edgeop op;
@@ -19,102 +41,300 @@ struct node {
 	explicit node(edgeop o_) : t(type::OP) { v.op = o_; }
 };
 
-using coords = std::pair<int, int>;
-using coordlist = std::vector<coords>;
-using grid = std::array<std::array<node, 4>, 4>;
+constexpr std::uint32_t M{32768};
 
-constexpr int max_steps = 18;
-constexpr int goal = 30; // Goal weight
+// A grid stored a row at a time from the bottom, so x goes north and y
+// goes east.
+struct puzzle {
+	int rows{0}, cols{0};
+	std::uint32_t goal{0};
+	std::vector<node> cells;
 
-void rove(const grid &g, int x, int y, coordlist &p, int steps, int weight, coordlist route) {
-  steps += 1;
-	if (steps > max_steps || (!p.empty() && steps > p.size())) {
-		// Too long of a path.
-		return;
+	const node &at(int x, int y) const { return cells[x * cols + y]; }
+	int start(void) const { return 0; }
+	int finish(void) const { return rows * cols - 1; }
+};
+
+// A puzzle is the goal weight followed by the grid, a row to a line from
+// the top, as it would be drawn on a map. Each cell is a number, +, - or
+// *. Numbers and operators have to alternate in both directions, starting
+// with a number. Lines starting with # are ignored.
+puzzle parse(std::istream &in) {
+	puzzle p;
+	std::vector<std::vector<node>> rows;
+	bool have_goal{false};
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream words(line);
+		std::string w;
+		if (!(words >> w) || w[0] == '#')
+			continue;
+		if (!have_goal) {
+			long goal{std::stol(w) % long{M}};
+			p.goal = (goal + M) % M;
+			have_goal = true;
+			continue;
+		}
+		rows.emplace_back();
+		do {
+			if (w == "+")
+				rows.back().emplace_back(edgeop::ADD);
+			else if (w == "-")
+				rows.back().emplace_back(edgeop::SUB);
+			else if (w == "*")
+				rows.back().emplace_back(edgeop::MUL);
+			else
+				rows.back().emplace_back(std::stoi(w));
+		} while (words >> w);
 	}
-	if (x == 0 && y == 0 && steps > 1) {
-		// Can't go back to the starting point.
-		return;
+	if (rows.empty())
+		throw std::runtime_error{"Puzzle has no grid."};
+	p.rows = rows.size();
+	p.cols = rows[0].size();
+	for (auto r = rows.rbegin(); r != rows.rend(); ++r) {
+		if (static_cast<int>(r->size()) != p.cols)
+			throw std::runtime_error{"Puzzle rows aren't all the same length."};
+		p.cells.insert(p.cells.end(), r->begin(), r->end());
 	}
-	
-	if (g[x][y].t == type::NUM) {
-		if (route.empty()) {
-			weight = g[x][y].v.val;
-		} else {
-			int ox, oy;
-			std::tie(ox, oy) = route.back();
-			switch (g[ox][oy].v.op) {
+	if (std::uint64_t(p.rows) * p.cols * M > 0xFFFFFFFF)
+		throw std::runtime_error{"Puzzle is too big."};
+	for (int x = 0; x < p.rows; x += 1)
+		for (int y = 0; y < p.cols; y += 1)
+			if ((p.at(x, y).t == type::NUM) != ((x + y) % 2 == 0))
+				throw std::runtime_error{"Numbers and operators don't alternate."};
+	return p;
+}
+
+// The orb and vault door from the challenge.
+const char vault[] =
+	"30\n"
+	"*  8  -  1\n"
+	"4  *  11 *\n"
+	"+  4  -  18\n"
+	"22 -  9  *\n";
+
+class searcher {
+public:
+	searcher(const puzzle &p, unsigned threads);
+	// The cells on a shortest way from start to finish, or nothing if
+	// there isn't one.
+	std::vector<int> solve(void);
+
+private:
+	using state = std::uint32_t;
+
+	const puzzle &p;
+	unsigned threads;
+	// Every state reached so far, a bit each. Four bits a cell per weight
+	// fits a 4x4 grid in 64K, and a 16x16 one in 4M.
+	std::unique_ptr<std::atomic<std::uint64_t>[]> seen;
+	// The states reached at each step, one after another, with where each
+	// step starts in steps. Kept to work the way back from the finish.
+	std::vector<state> states;
+	std::vector<std::size_t> steps;
+	// What each thread reaches in the next step. They keep their room
+	// from step to step.
+	std::vector<std::vector<state>> next;
+
+	template <typename F>
+	void moves(state s, F f) const;
+	bool next_to(state a, state b) const;
+	template <bool Shared>
+	void expand(std::size_t first, std::size_t last, std::vector<state> &out);
+};
+
+searcher::searcher(const puzzle &p, unsigned threads)
+	: p(p), threads(threads ? threads : 1),
+		seen(new std::atomic<std::uint64_t>[(p.cells.size() * M + 63) / 64]),
+		next(this->threads) {
+	for (std::size_t i = 0; i < (p.cells.size() * M + 63) / 64; i += 1)
+		seen[i].store(0, std::memory_order_relaxed);
+}
+
+// Call f with every state s leads to.
+template <typename F>
+void searcher::moves(state s, F f) const {
+	static const int dx[] = {1, -1, 0, 0}, dy[] = {0, 0, 1, -1};
+	int cell = s / M;
+	std::uint32_t weight{s % M};
+	if (cell == p.finish())
+		return;
+	int x = cell / p.cols, y = cell % p.cols;
+	const node &here = p.cells[cell];
+	for (int d = 0; d < 4; d += 1) {
+		int nx = x + dx[d], ny = y + dy[d];
+		if (nx < 0 || nx >= p.rows || ny < 0 || ny >= p.cols)
+			continue;
+		int to = nx * p.cols + ny;
+		if (to == p.start())
+			continue;
+		const node &there = p.cells[to];
+		// M is a power of two, so wrapping at 2^32 and masking is the
+		// same as working mod M.
+		std::uint32_t w{weight};
+		if (there.t == type::NUM) {
+			std::uint32_t v = there.v.val;
+			switch (here.v.op) {
 			case edgeop::ADD:
-				weight += g[x][y].v.val;
+				w = (w + v) & (M - 1);
 				break;
 			case edgeop::SUB:
-				weight -= g[x][y].v.val;
+				w = (w - v) & (M - 1);
 				break;
 			case edgeop::MUL:
-				weight *= g[x][y].v.val;
+				w = (w * v) & (M - 1);
 				break;
 			}
 		}
+		f(state(to) * M + w);
 	}
-	
-	route.emplace_back(x, y);
+}
 
-	if (x == 3 && y == 3) {
-		// Going to the ending room is a fail unless weight is right.
-		if (weight == goal && (p.empty() || route.size() < p.size()))
-			p = std::move(route);
-		return;
-	}
+bool searcher::next_to(state a, state b) const {
+	int from = a / M, to = b / M;
+	return (from / p.cols == to / p.cols && (from == to + 1 || to == from + 1)) ||
+		from == to + p.cols || to == from + p.cols;
+}
 
-	if (x > 0)
-		rove(g, x - 1, y, p, steps, weight, route);
-	if (x < 3)
-		rove(g, x + 1, y, p, steps, weight, route);
-	if (y > 0)
-		rove(g, x, y - 1, p, steps, weight, route);
-	if (y < 3)
-		rove(g, x, y + 1, p, steps, weight, route);
+// Add the states reached from states[first] up to states[last] that
+// haven't been seen before to out. Shared says whether other threads are
+// at it too, which takes a locked or to mark a state seen.
+template <bool Shared>
+void searcher::expand(std::size_t first, std::size_t last,
+											std::vector<state> &out) {
+	for (std::size_t i = first; i < last; i += 1)
+		moves(states[i], [this, &out](state t) {
+			std::atomic<std::uint64_t> &word = seen[t / 64];
+			std::uint64_t bit{std::uint64_t{1} << t % 64};
+			std::uint64_t old{word.load(std::memory_order_relaxed)};
+			if (old & bit)
+				return;
+			if (Shared) {
+				if (word.fetch_or(bit, std::memory_order_relaxed) & bit)
+					return;
+			} else {
+				word.store(old | bit, std::memory_order_relaxed);
+			}
+			out.push_back(t);
+		});
 }
 
+std::vector<int> searcher::solve(void) {
+	state first = p.start() * M + (std::uint32_t(p.cells[p.start()].v.val) & (M - 1));
+	state goal = p.finish() * M + p.goal;
+	states.assign(1, first);
+	steps.assign(1, 0);
+	seen[first / 64] |= std::uint64_t{1} << first % 64;
+
+	while (steps.back() < states.size() && !(seen[goal / 64] >> goal % 64 & 1)) {
+		std::size_t begin{steps.back()}, end{states.size()};
+		// Small steps aren't worth starting threads for.
+		unsigned use = end - begin < 4096 ? 1 : threads;
+		std::size_t slice = (end - begin + use - 1) / use;
+		if (use == 1) {
+			expand<false>(begin, end, next[0]);
+		} else {
+			std::vector<std::thread> pool;
+			for (unsigned i = 1; i < use; i += 1)
+				pool.emplace_back([this, i, slice, begin, end](void) {
+					expand<true>(std::min(begin + i * slice, end),
+											 std::min(begin + (i + 1) * slice, end), next[i]);
+				});
+			expand<true>(begin, std::min(begin + slice, end), next[0]);
+			for (auto &t : pool)
+				t.join();
+		}
 
-grid
-build_graph(void) {
-	grid g{{
-		{ node(22), node(edgeop::SUB), node(9), node(edgeop::MUL) },
-		{ node(edgeop::ADD), node(4), node(edgeop::SUB), node(18) },
-		{ node(4), node(edgeop::MUL), node(11), node(edgeop::MUL) },
-		{ node(edgeop::MUL), node(8), node(edgeop::SUB), node(1) }
-	}};
-	g[3][3].goal = true;
-	return g;
+		steps.push_back(end);
+		for (unsigned i = 0; i < use; i += 1) {
+			states.insert(states.end(), next[i].begin(), next[i].end());
+			next[i].clear();
+		}
+	}
+
+	// Work back a step at a time, to the lowest numbered state in the step
+	// before that leads where we are. Which thread got to a state first
+	// doesn't matter, so neither does the number of threads.
+	std::vector<int> path;
+	if (!(seen[goal / 64] >> goal % 64 & 1))
+		return path;
+	state at{goal};
+	path.push_back(at / M);
+	for (std::size_t k = steps.size() - 1; k > 0; k -= 1) {
+		state from{~state{0}};
+		for (std::size_t i = steps[k - 1]; i < steps[k]; i += 1)
+			if (states[i] < from && next_to(states[i], at))
+				moves(states[i], [&](state t) {
+					if (t == at)
+						from = states[i];
+				});
+		at = from;
+		path.push_back(at / M);
+	}
+	std::reverse(path.begin(), path.end());
+	return path;
 }
-	
-int main(void) {
-	grid g{build_graph()};
-	coordlist path;
-	
-	rove(g, 0, 0, path, 0, 0, {});
+
+/* Usage: solver3 [-j THREADS] [FILE]
+*
+* Finds a shortest way through the puzzle in FILE, or the one in the
+* challenge if there's no FILE, and prints how many rooms it goes through
+* and the directions to take.
+*
+* Options: -j THREADS Number of threads to search with. Defaults to one
+*                     per core. The way found doesn't depend on it.
+*/
+int main(int argc, char **argv) {
+	unsigned threads{std::thread::hardware_concurrency()};
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i += 1) {
+		if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		} else {
+			std::cerr << "Unknown option '" << argv[i] << "'.\n";
+			return 1;
+		}
+	}
+
+	puzzle p;
+	try {
+		if (i < argc) {
+			std::ifstream in(argv[i]);
+			if (!in.is_open()) {
+				std::cerr << "Unable to open " << argv[i] << ".\n";
+				return 1;
+			}
+			p = parse(in);
+		} else {
+			std::istringstream in(vault);
+			p = parse(in);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
+
+	searcher s{p, threads};
+	std::vector<int> path{s.solve()};
 
 	if (path.empty()) {
 	  std::cout << "No path found!\n";
 	} else {
 	  std::cout << "Length: " << path.size() << '\n';
 		std::cout << "Route:";
-		coords prev = path.front();
-		path.erase(path.begin());
-		for (const auto &c : path) {
-			if (prev.first < c.first)
+		for (std::size_t k = 1; k < path.size(); k += 1) {
+			int from = path[k - 1], to = path[k];
+			if (to == from + p.cols)
 				std::cout << " N";
-			else if (prev.first > c.first)
+			else if (to == from - p.cols)
 				std::cout << " S";
-			else if (prev.second < c.second)
+			else if (to == from + 1)
 				std::cout << " E";
 			else
 				std::cout << " W";
-			prev = c;
 		}
 		std::cout << '\n';
 	}
-	
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -3,7 +3,8 @@ use strict;
 use warnings;
 
 # Removes pc,registers,etc from start of a saved state file, leaving
-# just the memory image.
+# just the memory image. Understands both binary snapshots and the old
+# text save states.
 # Usage: stripstate.pl SAVE.BIN output.img
 
 my ($infile, $outfile) = @ARGV;
@@ -11,6 +12,18 @@ my ($infile, $outfile) = @ARGV;
 open my $IN, "<:raw:bytes", $infile or die "Unable to open $infile: $!\n";
 open my $OUT, ">:raw:bytes", $outfile or die "Unable to open $outfile: $!\n";
 
+my $header;
+read($IN, $header, 64);
+if (length $header == 64 && substr($header, 0, 8) eq "SYNSNAP\x1A") {
+	my ($memsize) = unpack "x36 V", $header;
+	my $mem;
+	read($IN, $mem, 2 * $memsize) == 2 * $memsize
+		or die "$infile is truncated.\n";
+	print $OUT $mem;
+	exit 0;
+}
+
+seek $IN, 0, 0;
 my $c;
 do {
 	$c = getc $IN;
@@ -1,462 +1,79 @@
 /* Virtual Machine for Synacor Challenge, take 1 */
 
 
-/* Usage: vm [-s -d -g] IMGFILE
+/* Usage: vm [-s -d -g -m -H -C -W BITS -e ENGINE -n COUNT -i FILE -o FILE -t FILE -p FILE -f FILE -r MB] IMGFILE
 *
 * Options: -s IMGFILE is a saved state from a previous session
 *          -d Don't dump a saved state on SIGINT.
 *          -g Debug mode
+*          -m Print instruction count and MIPS to stderr on exit.
+*          -H Run guest routines as they are, without the native hooks
+*             that replace some of them. See natives.cc.
+*          -e ENGINE Select the execution engine: table (The default),
+*             threaded, decoded or jit.
+*          -C Check every operand, opcode and address, as a build without
+*             UNSAFE would. Threaded engine only.
+*          -W BITS Keep registers in 16 or 32 bit words. Defaults to what
+*             FAST_WORD says. Threaded engine only.
+*          -n COUNT Stop after executing COUNT instructions.
+*          -i FILE Read input from FILE before the terminal.
+*          -o FILE Write the program's output to FILE.
+*          -t FILE Write every instruction executed, and the registers before
+*             it, to FILE. Runs on the threaded engine whatever -e says.
+*          -p FILE Profile the program, and write a report to FILE on exit.
+*             Runs on the threaded engine whatever -e says.
+*          -f FILE Profile the program, and write the call stacks it went
+*             through to FILE on exit, folded for flame graph tools.
+*          -r MB In debug mode, record up to MB megabytes of history from
+*             the start, for the debugger's rstep and rc to go back through.
 */
 
-/* Normally, when I write an interpeter for a small bytecode language, I
- * use a big switch statement to dispatch, one case per opcode. This time
- * I decided to try something slightly different, though, and use an array
- * of functions, with index corresponding to the opcode. C++11 lambdas make
- * defining this array all happen in one spot, and ends up visually looking
- * a lot like the classic switch. The actual execution of the program turns
- * into two lines of while loop and function call.
- *
- * Possible other directions, for fun and profit: threaded code turning it
- * into an array of functions, and JIT compiling a program to native code.
- */
-
 #include <iostream>
-#include <array>
-#include <stack>
-#include <vector>
-#include <deque>
-#include <stdexcept>
 #include <fstream>
-#include <sstream>
 #include <string>
-#include <functional>
-#include <unordered_set>
+#include <stdexcept>
+#include <limits>
+#include <memory>
+#include <chrono>
 #include <cstdint>
-
-#include <boost/endian/conversion.hpp>
-
-/* Control what type is used to represent words. Fastest for the host system,
-   or exactly 16 bits.
-*/
-#define FAST_WORD
-/* Disables some bounds and consistency checks. Should be okay on
-   well formed binary images.
-*/
-#define UNSAFE
-
-#ifdef FAST_WORD
-using numtype = std::uint_fast16_t;
-#else
-using numtype = std::uint16_t;
-#endif
-
-#ifdef UNSAFE
-#define AT(c, i) c[i]
-#else
-#define AT(c, i) c.at(i)
-#endif
-
-constexpr numtype M{32768}; 
-
-constexpr numtype fix15(numtype a) {
-	return a & 0b0111111111111111;
-}
-
-constexpr bool is_number(numtype n) {
-	return n < 32768;
-}
-	
-constexpr bool is_register(numtype n) {
-	return n > 32767 && n < 32776;
-}
-	
-constexpr int to_register(numtype n) {
-	return n - 32768;
-}
-
-class image {
-private:
-	using registers = std::array<numtype, 8>;
-	using stack = std::stack<numtype>;
-	using memory = std::vector<numtype>;
-	using char_pool = std::deque<char>;
-	
-	memory mem;
-	numtype pc{0}, cpc{0};
-	registers regs{{0,0,0,0,0,0,0,0}};
-	stack s;
-	bool debug;
-	bool stepping;
-	std::unordered_set<numtype> breakpoints;
-	char_pool input_buffer;
-
-	numtype val(numtype);
-	numtype load(numtype);
-	void store(numtype, numtype);
-	void regstore(numtype, numtype);
-
-	char next_char(void);
-	bool debugger(const std::string &);
-
-	struct end_of_program{};
-
-#define A   pc += 1; numtype a{AT(mem, pc++)}
-#define AB  A; numtype b{AT(mem, pc++)}
-#define ABC AB; numtype c{AT(mem, pc++)} 
-	std::array<std::function<void(void)>, 22>
-	ops{{
-		[](){  throw end_of_program(); }, // 0 halt
-		[&](){ AB; regstore(a, val(b)); }, // 1 set
-		[&](){ A; s.push(val(a)); }, // 2 push
-		[&](){ A; if (s.empty()) throw std::runtime_error{"empty stack"};
-					 regstore(a, s.top()); s.pop(); }, // 3 pop
-		[&](){ ABC; regstore(a, val(b) == val(c)); }, // 4 eq
-		[&](){ ABC; regstore(a, val(b) > val(c)); }, // 5 gt
-		[&](){ A; pc = val(a); }, // 6 jmp
-		[&](){ AB; if (val(a) != 0) pc = val(b); }, // 7 jt
-		[&](){ AB; if (val(a) == 0) pc = val(b); }, // 8 jf
-		[&](){ ABC; regstore(a, (val(b) + val(c)) % M); }, // 9 add
-		[&](){ ABC; regstore(a, (val(b) * val(c)) % M); }, // 10 mult
-		[&](){ ABC; regstore(a, val(b) % val(c)); }, // 11 mod
-		[&](){ ABC; regstore(a, val(b) & val(c)); }, // 12 and
-		[&](){ ABC; regstore(a, val(b) | val(c)); }, // 13 or
-		[&](){ AB; regstore(a, fix15(~val(b))); }, // 14 not
-		[&](){ AB; regstore(a, load(val(b))); }, // 15 rmem
-		[&](){ AB; store(val(a), val(b)); }, // 16 wmem
-		[&](){ A; s.push(pc); pc = val(a); }, // 17 call
-		[&](){ if (s.empty()) throw end_of_program(); pc = s.top(); s.pop(); }, // 18 ret
-		[&](){ A; std::cout.put(static_cast<char>(val(a))); }, // 19 out
-		[&](){ A; regstore(a, next_char()); }, // 20 in
-		[&](){ pc += 1; } // 21 noop
-	}};
-
-#undef ABC
-#undef AB
-#undef A
-	
-	public:	
-		explicit image(std::istream &, bool = false);
-		void rundebug(void);
-		void run(void);
-		void dump(const std::string &s) { dump(s.c_str()); }
-		void dump(const char *);
-};
-
-// Convert a numtype to a number, or return the value
-// in a register if numtype refers to one.
-numtype image::val(numtype n) {
-#ifdef UNSAFE
-	if (is_number(n))
-		return n;
-	else
-		return regs[to_register(n)];
-#else
-	if (is_number(n))
-		return n;
-	else if (is_register(n))
-		return regs[to_register(n)];
-	else
-		throw std::runtime_error{"Invalid number."};
-#endif
-}
-
-// Return the value stored in a memory location
-numtype image::load(numtype addr) {
-#ifndef UNSAFE
-	if (!is_number(addr))
-		throw std::runtime_error("Trying to load from an invalid address.");
-#endif
-	if (mem.size() <= addr)
-		return 0;
-	else
-		return mem[addr];
-}
-
-// Write a value to a memory location.
-void image::store(numtype addr, numtype v) {
-#ifndef UNSAFE
-	if (!is_number(addr))
-		throw std::runtime_error("Trying to store in an invalid address.");
-#endif
-	if (mem.size() <= addr)
-		mem.resize(addr + 1);
-
-	mem[addr] = v;
-}
-
-// Write val to the encoded register r
-void image::regstore(numtype r, numtype val) {
-#ifdef UNSAFE
-	regs[to_register(r)] = val;
-#else
-	if (is_register(r))
-		regs[to_register(r)] = val;
-	else 
-		throw std::runtime_error("not a register");
-#endif
-}
-
-// Load image from a file.
-image::image(std::istream &in, bool dump)
-	: debug(false), stepping(false) {
-	std::cout << "Reading program..." << std::flush;
-
-	if (dump) { // Load saved state information at start of image
-		in >> pc;
-		for (int i = 0; i < 8; i += 1)
-			in >> regs[i];
-		stack::size_type ssize;
-		in >> ssize;
-		for (stack::size_type i = 0; i < ssize; i += 1) {
-			numtype n;
-			in >> n;
-			s.push(n);
-		}
-		while (in.peek() != '~')
-			in.get();
-		in.get();
-	}
-
-	 do {
-	 	 // Read 1k words at a time.
-	 	 char raw[sizeof(std::uint16_t) * 1024];
-	 	 in.read(raw, sizeof raw);
-	 	 auto bytes = in.gcount();
-	 	 if (bytes > 0) {
-	 	 	 if (bytes % 2 != 0) {
-	 	 	 	 // Couldn't read a full 16 bit word 
-	 	 	 	 throw std::runtime_error{"Unable to read full word from input file."};
-	 	 	 }
-	 	 	 mem.reserve(mem.size() + (bytes/2));
-	 	 	 for (int n = 0; n < bytes; n += 2) {
-	 	 	 	 std::uint16_t *word = reinterpret_cast<std::uint16_t*>(raw + n);
-	 	 	 	 mem.push_back(boost::endian::little_to_native(*word));
-	 	 	 }
-	 	 }
-	 } while (in.good());
-	 std::cout << " done. Read " << mem.size() << " words.\n";
-}
-
-
-// Return the next char to be read from standard input
-char image::next_char(void) {
-	if (!input_buffer.empty()) {
-		char c = input_buffer.front();
-		input_buffer.pop_front();
-		return c;
-	} else {
-		while (true) {
-			std::string line;
-			if (std::getline(std::cin, line) && line.length() > 0) {
-				if (debug && line[0] == '~') {
-					line.erase(0, 1);
-					debugger(line);
-				} else {
-					line += '\n';
-					input_buffer.assign(std::next(line.begin()), line.end());
-					return line[0];
-				}
-			}	else {
-				// Error!
-				throw std::runtime_error("Input failed");
-			}
-		}
-	}
-}
-
-bool image::debugger(const std::string &cmdstr) {
-	std::istringstream cmdstream{cmdstr};
-	std::string cmd, arg;
-	// Should clean this up instead of having one big chain of if/else
-	cmdstream >> cmd;
-	if (cmd == "c") {
-		// c: continue execution until next breakpoint, stop stepping.
-		stepping = false;
-		return false;
-	} else if (cmd == "n") {
-		// n: continue to next instruction.
-		return false;
-	} else if (cmd == "step") {
-		// step (on|off): turn on or off instruction level stepping
-		cmdstream >> arg;
-		stepping = arg == "on";
-		std::cout << "DEBUG: stepping " << (stepping ? "on\n" : "off\n");
-	} else if (cmd == "quit") {
-		std::cout << "DEBUG: Quitting.\n";
-		throw end_of_program();
-	} else if (cmd == "dump") {
-		// dump filename: Dump state to a file.
-		cmdstream >> arg;
-		std::cout << "DEBUG: Dumping state to " << arg << '\n';
-		dump(arg);
-	} else if (cmd == "showr" || cmd == "showx") {
-		// showr N: Show a single register.
-		bool wanthex = cmd == "showx";
-		int r;
-		cmdstream >> r;
-		std::cout << "DEBUG: Register r" << r << " = ";
-		if (wanthex)
-			std::cout << std::hex;
-		std::cout << regs[r] << std::dec << '\n';
-	} else if (cmd == "showallr" || cmd == "showallx") {
-		// showallr: Show all 8 registers
-		std::cout << "DEBUG: Registers: ";
-		for (int i = 0; i < 8; i += 1) 
-			std::cout << 'r' << i << " = " << (cmd == "showallx" ? std::hex : std::dec)
-				<< regs[i] << std::dec << ' ';
-		std::cout << '\n';
-	} else if (cmd == "setr" || cmd == "setx") {
-		// setr N V: Set a register to a new base-10 value.
-		// setx N V: Set a register to a new base-16 value.
-		int r;
-		numtype val;
-		cmdstream >> r >> (cmd == "setr" ? std::dec : std::hex) >> val;
-		std::cout << "DEBUG: Setting register r" << r << " = " << std::hex << val
-			<< std::dec << '\n';
-		regs[r] = val;
-	} else if (cmd == "showpc" || cmd == "showpcx") {
-		// showpc: Show the program counter in base 10 or 16.
-		if (cmd == "showpcx")
-			std::cout << std::hex;
-		std::cout << "DEBUG: pc=" << cpc << std::dec << '\n';
-	} else if (cmd == "setpc") {
-		// setpc A: Set the program counter to a new base-16 value
-		numtype addr;
-		cmdstream >> std::hex >> addr;
-		std::cout << "DEBUG: Setting program counter.\n";
-		cpc = pc = addr;
-	} else if (cmd == "break") {
-		// break A: Set a breakpoint at base-16 address.
-		numtype addr;
-		cmdstream >> std::hex >> addr;
-		std::cout << "DEBUG: Setting breakpoint.\n";
-		breakpoints.insert(addr);
-	} else if (cmd == "unbreak") {
-		// unbreak A: Clear a breakpoint.
-		numtype addr;
-		cmdstream >> std::hex >> addr;
-		std::cout << "DEBUG: Clearing breakpoint.\n";
-		breakpoints.erase(addr);
-	} else if (cmd == "showmem" || cmd == "showmemx") {
-		// showmemx A: Show the word at base-16 address.
-		numtype addr;
-		cmdstream >> std::hex >> addr;
-		std::cout << "DEBUG: Value at address " << std::hex << addr << ": ";
-		if (cmd == "showmemx")
-			std::cout << std::hex;
-		std::cout << mem[addr] << std::dec << '\n';
-	} else if (cmd == "stack" || cmd == "stackx") {
-		stack s2;
-		std::cout << "DEBUG: Stack:";
-		if (cmd == "stackx")
-			std::cout << std::hex;
-		while (!s.empty()) {
-			s2.push(s.top());
-			s.pop();
-			std::cout << ' ' << s2.top();
-		}
-		while (!s2.empty()) {
-			s.push(s2.top());
-			s2.pop();
-		}
-		std::cout << std::dec << '\n';
-	} else if (cmd == "push" || cmd == "pushx") {
-		// push V: push base-10 or base-16 value onto stack
-		numtype val;
-		if (cmd == "pushx")
-			cmdstream >> std::hex;
-		cmdstream >> val;
-		std::cout << "DEBUG: Pushing " << std::hex << val << std::dec << " onto the stack.\n";
-		s.push(val);
-	} else if (cmd == "pop") {
-		// pop: pop value off the stack
-		std::cout << "DEBUG: Popping " << std::hex << s.top() << std::dec << " off of the stack.\n";
-		s.pop();
-	} else {
-		std::cout << "DEBUG: Unknown command.\n";
-	}
-	return true;
-}
-
-// Dump current image to a file
-void image::dump(const char *filename) {
-	std::ofstream out(filename, std::ofstream::out | std::ofstream::binary);
-	if (!out.is_open()) {
-		std::cerr << "Unable to open file " << filename << " for writing.\n";
-		throw std::runtime_error("Unable to open output file.");
-	}
-
-	out << cpc << '\n';
-
-	for (auto r : regs)
-		out << r << '\n';
-
-	out << s.size() << '\n';
-	stack sr;
-	while (!s.empty()) {
-		sr.push(s.top());
-		s.pop();
-	}
-	while (!sr.empty()) {
-		s.push(sr.top());
-		sr.pop();
-		out << s.top() << '\n';
-	}
-
-	out << "~";
-
-	for (auto w : mem) {
-		std::uint16_t word_le =
-			boost::endian::native_to_little(static_cast<std::uint16_t>(w));
-		out.write(reinterpret_cast<char *>(&word_le), sizeof word_le);
-	}
-}
-
-void image::rundebug(void) {
-	debug = true;
-	stepping = true;
-	try {
-		while (pc < mem.size()) {
-			cpc = pc;
-			
-			if (debug && (stepping || breakpoints.count(pc))) {
-				std::string debugcmd;
-				if (!stepping)
-					std::cout << "DEBUG: Breakpoint at " << std::hex << pc << std::dec << '\n';
-				stepping = true;
-
-				do {
-					std::cout << "DEBUG(" << std::hex << pc << std::dec << ")> " << std::flush;
-					std::getline(std::cin, debugcmd);
-				} while (debugger(debugcmd));
-			}
-			
-			AT(ops, mem[pc])();
-		}
-	} catch (end_of_program) {
-		return;
-	}
-}
-
-void image::run(void) {
-	try {
-		while (pc < mem.size()) {
-			cpc = pc;
-			AT(ops, mem[pc])();
-		}
-	} catch (end_of_program) {
-		return;
-	}
+#include <cstdlib>
+#include <cstring>
+
+#include "image.h"
+#include "snapshot.h"
+
+// Stop and take debugger commands until one of them resumes execution.
+static void debug_prompt(image &p) {
+	if (!p.is_stepping())
+		std::cout << "DEBUG: Breakpoint at " << std::hex << p.program_counter()
+							<< std::dec << '\n';
+	p.set_stepping(true);
+
+	std::string debugcmd;
+	do {
+		std::cout << "DEBUG(" << std::hex << p.program_counter() << std::dec
+							<< ")> " << std::flush;
+		if (!std::getline(std::cin, debugcmd))
+			throw std::runtime_error("Input failed");
+	} while (p.debugger(debugcmd));
 }
 
 int main(int argc, char **argv) {
 	if (argc < 2) {
-		std::cout << "Usage: " << argv[0] << "[-s -d -g] IMAGEFILE\n";
+		std::cout << "Usage: " << argv[0] << " [-s -d -g -m -H -C -W BITS -e ENGINE -n COUNT -i FILE -o FILE -t FILE -p FILE -f FILE -r MB] IMAGEFILE\n";
 		return 1;
 	}
 	
 	bool debug{false};
 	bool saved{false};
+	bool stats{false};
+	bool natives{true};
+	bool checked{false};
+	int word_bits{0};
+	engine eng{engine::table};
+	std::uint64_t limit{std::numeric_limits<std::uint64_t>::max()};
+	std::size_t history{0};
+	std::string infile, outfile, tracefile, profile, folded;
 
 	if (argc > 2) {
 		for (int i = 1; i < argc - 1; i += 1) {
@@ -464,7 +81,49 @@ int main(int argc, char **argv) {
 				debug = true;
 			else if (std::strcmp(argv[i], "-s") == 0)
 				saved = true;
-			else if (argv[i][0] == '-') {
+			else if (std::strcmp(argv[i], "-m") == 0)
+				stats = true;
+			else if (std::strcmp(argv[i], "-H") == 0)
+				natives = false;
+			else if (std::strcmp(argv[i], "-C") == 0)
+				checked = true;
+			else if (std::strcmp(argv[i], "-W") == 0 && i + 2 < argc) {
+				word_bits = std::atoi(argv[++i]);
+				if (word_bits != 16 && word_bits != 32) {
+					std::cerr << "Registers can be 16 or 32 bits, not " << argv[i] << ".\n";
+					return 1;
+				}
+			}
+			else if (std::strcmp(argv[i], "-e") == 0 && i + 2 < argc) {
+				i += 1;
+				if (std::strcmp(argv[i], "threaded") == 0)
+					eng = engine::threaded;
+				else if (std::strcmp(argv[i], "decoded") == 0)
+					eng = engine::decoded;
+				else if (std::strcmp(argv[i], "jit") == 0)
+					eng = engine::jit;
+				else if (std::strcmp(argv[i], "table") == 0)
+					eng = engine::table;
+				else {
+					std::cerr << "Unknown engine '" << argv[i] << "'.\n";
+					return 1;
+				}
+			} else if (std::strcmp(argv[i], "-n") == 0 && i + 2 < argc) {
+				i += 1;
+				limit = std::strtoull(argv[i], nullptr, 10);
+			} else if (std::strcmp(argv[i], "-i") == 0 && i + 2 < argc) {
+				infile = argv[++i];
+			} else if (std::strcmp(argv[i], "-o") == 0 && i + 2 < argc) {
+				outfile = argv[++i];
+			} else if (std::strcmp(argv[i], "-t") == 0 && i + 2 < argc) {
+				tracefile = argv[++i];
+			} else if (std::strcmp(argv[i], "-p") == 0 && i + 2 < argc) {
+				profile = argv[++i];
+			} else if (std::strcmp(argv[i], "-f") == 0 && i + 2 < argc) {
+				folded = argv[++i];
+			} else if (std::strcmp(argv[i], "-r") == 0 && i + 2 < argc) {
+				history = std::strtoull(argv[++i], nullptr, 10) << 20;
+			} else if (argv[i][0] == '-') {
 				std::cerr << "Unknown option '" << argv[i] << "'.\n";
 				return 1;
 			}
@@ -485,12 +144,131 @@ int main(int argc, char **argv) {
 	if (debug)
 		std::cout.setf(std::ios::showbase);
 	
-	image p{input, saved};
+	// Snapshots from dump are mapped and restored as is. Anything else is a
+	// program image, which is mapped and used in place, or with -s an old
+	// text save state.
+	std::unique_ptr<image> vm;
+	if (saved && snapshot::is_snapshot(filename)) {
+		try {
+			snapshot snap{filename};
+			vm.reset(new image{snap});
+		} catch (std::exception &e) {
+			std::cerr << "Unable to restore " << filename << ": " << e.what() << '\n';
+			return 1;
+		}
+	} else {
+		try {
+			if (saved)
+				vm.reset(new image{input, saved});
+			else
+				vm.reset(new image{filename});
+		} catch (std::exception &e) {
+			std::cerr << "\nUnable to load " << filename << ": " << e.what() << '\n';
+			return 1;
+		}
+	}
+	image &p = *vm;
+	p.set_engine(eng);
+	if (natives)
+		add_builtin_natives(p);
+	p.set_debug(debug);
 	if (debug)
-		p.rundebug();
-	else
-		p.run();
-	
-	std::cout << '\n';
-	return 0;
+		p.set_history(history);
+	p.set_profiling(!profile.empty() || !folded.empty());
+	if (checked)
+		p.set_checked(true);
+	if (word_bits != 0)
+		p.set_narrow(word_bits == 16);
+	std::ofstream trace;
+	if (!tracefile.empty()) {
+		trace.open(tracefile);
+		if (!trace.is_open()) {
+			std::cerr << "Unable to open " << tracefile << " for writing.\n";
+			return 1;
+		}
+		p.set_trace(&trace);
+	}
+	std::unique_ptr<file_sink> sink;
+	if (!outfile.empty()) {
+		try {
+			sink.reset(new file_sink{outfile});
+		} catch (std::exception &e) {
+			std::cerr << e.what() << '\n';
+			return 1;
+		}
+		p.set_output(*sink);
+	}
+	int status{0};
+	auto start = std::chrono::steady_clock::now();
+	try {
+		std::unique_ptr<file_source> script;
+		if (!infile.empty())
+			script.reset(new file_source{infile});
+		terminal_source terminal{debug};
+
+		bool running{true};
+		while (running) {
+			switch (p.run_for(limit - p.instructions())) {
+			case run_status::halted:
+				running = false;
+				break;
+			case run_status::budget_exhausted:
+				running = p.instructions() < limit;
+				break;
+			case run_status::breakpoint:
+				debug_prompt(p);
+				break;
+			case run_status::needs_input:
+				if (script && p.feed(*script))
+					break;
+				script.reset();
+				if (!p.feed(terminal))
+					throw std::runtime_error("Input failed");
+				break;
+			}
+		}
+	} catch (std::exception &e) {
+		std::cout << std::flush;
+		std::cerr << "\nError: " << e.what() << '\n';
+		status = 1;
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+
+	std::cout << '\n' << std::flush;
+	if (stats) {
+		double secs = elapsed.count();
+		std::cerr << "Executed " << p.instructions() << " instructions in "
+							<< secs << " seconds";
+		if (secs > 0)
+			std::cerr << " (" << (p.instructions() / secs / 1e6) << " MIPS)";
+		std::cerr << ".\n";
+		if (eng == engine::decoded && p.instructions() > 0) {
+			double hits = p.instructions() - p.decoded_instructions();
+			std::cerr << "Decode cache: " << p.decoded_instructions()
+								<< " decodes, " << (100.0 * hits / p.instructions())
+								<< "% hit rate, " << p.invalidated_instructions()
+								<< " invalidations.\n";
+		}
+		if (eng == engine::jit)
+			p.jit_stats(std::cerr);
+	}
+	if (!profile.empty()) {
+		std::ofstream report(profile);
+		if (!report.is_open()) {
+			std::cerr << "Unable to open " << profile << " for writing.\n";
+			return 1;
+		}
+		p.profile_report(report);
+	}
+	if (!folded.empty()) {
+		std::ofstream stacks(folded);
+		if (!stacks.is_open()) {
+			std::cerr << "Unable to open " << folded << " for writing.\n";
+			return 1;
+		}
+		p.profile_folded(stacks);
+	}
+	return status;
 }
+